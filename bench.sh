@@ -0,0 +1,47 @@
+#!/bin/sh
+# bench.sh -- performance baseline for the tools; run with `make bench`
+#
+# Builds a contiguous and a fragmented image with mkimage, then times
+# diskinfo, disklist, diskget and diskput on each with benchrun.
+# BENCH_DIR (default bench.out), BENCH_BLOCKS (default 32768 4 KiB
+# blocks) and BENCH_RUNS (default 3) override the defaults.
+set -e
+
+DIR=${BENCH_DIR:-bench.out}
+BLOCKS=${BENCH_BLOCKS:-32768}
+RUNS=${BENCH_RUNS:-3}
+RUN="./benchrun -n $RUNS"
+
+mkdir -p "$DIR"
+head -c 16777216 /dev/urandom > "$DIR/put.bin"
+
+for kind in seq frag; do
+    img="$DIR/$kind.img"
+    frag=0
+    [ "$kind" = frag ] && frag=40
+    summary=$(./mkimage -b 4096 -n "$BLOCKS" -d 3 -f 4 -F 12 \
+                        -s log:512:256K -u 70 -x "$frag" "$img")
+    echo "$summary"
+    total=$(echo "$summary" | sed 's/.* files, \([0-9]*\) bytes.*/\1/')
+
+    # Largest file in the root, for the single-file extract
+    big=$(./disklist "$img" / | awk '$1 == "F" && $2 > max { max = $2; n = $3 }
+                                    END { print n, max }')
+    big_name=${big% *}
+    big_size=${big#* }
+
+    $RUN -l "$kind diskinfo" -- ./diskinfo "$img"
+    $RUN -l "$kind disklist /" -- ./disklist "$img" /
+    $RUN -l "$kind disklist /d0/d0/d0" -- ./disklist "$img" /d0/d0/d0
+    $RUN -l "$kind diskget $big_name" -b "$big_size" \
+        -- ./diskget "$img" "/$big_name" "$DIR/get.bin"
+    $RUN -l "$kind diskget -r /" -b "$total" \
+        -p "rm -rf $DIR/tree" -- ./diskget -r "$img" / "$DIR/tree"
+    $RUN -l "$kind diskput 16M" -b 16777216 \
+        -p "cp $img $DIR/work.img" -- ./diskput "$DIR/work.img" "$DIR/put.bin" /put.bin
+    $RUN -l "$kind diskput -r /d0/d0" \
+        -b "$(du -sb "$DIR/tree/d0/d0" | cut -f1)" \
+        -p "cp $img $DIR/work.img" -- ./diskput -r "$DIR/work.img" "$DIR/tree/d0/d0" /copy
+done
+
+rm -rf "$DIR/tree" "$DIR/work.img" "$DIR/get.bin"
@@ -0,0 +1,569 @@
+#!/bin/sh
+# check.sh -- end-to-end tests for the tools; run with `make check`
+#
+# Builds images with mkimage, runs the tools on them and checks what
+# comes back: file and tree round trips, streaming through pipes, ranged
+# reads, compressed files, replace, append and --sync, journal replay
+# after a crash, diskshell scripts, the library under concurrent
+# readers, diskfsck on clean and damaged images and stale summaries,
+# diskdefrag, diskexport archives against tar, diskfind against find(1),
+# disklist -R, tsv and json against the tree, growing and hashed
+# directories, and diskinfo's counts, with the free-space summary and
+# without it, against a scan of the FAT done here.  CHECK_DIR (default
+# check.out) holds the scratch files.
+set -e
+
+DIR=${CHECK_DIR:-check.out}
+rm -rf "$DIR"
+mkdir -p "$DIR"
+checks=0
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+pass() {
+    checks=$((checks + 1))
+    echo "ok $checks - $*"
+}
+
+# Value of a "Name: value" line of diskinfo
+info() {
+    ./diskinfo "$1" | sed -n "s/^$2: //p"
+}
+
+# Free, reserved and allocated counts from reading every FAT entry here
+# (big-endian words: 0 free, 1 reserved), as "free reserved alloc"
+scan_fat() {
+    bs=$(info "$1" "Block size")
+    start=$(info "$1" "FAT starts")
+    blocks=$(info "$1" "FAT blocks")
+    dd if="$1" bs="$bs" skip="$start" count="$blocks" 2>/dev/null |
+        od -An -v -tx1 -w4 |
+        awk '{ v = $1 $2 $3 $4 }
+             v == "00000000" { f++; next }
+             v == "00000001" { r++; next }
+             { a++ }
+             END { print f + 0, r + 0, a + 0 }'
+}
+
+counts() {
+    echo "$(info "$1" "Free Blocks") $(info "$1" "Reserved Blocks") $(info "$1" "Allocated Blocks")"
+}
+
+# diskinfo's counts must match the scan, and so must a run with the
+# free-space summary knocked out
+check_counts() {
+    want=$(scan_fat "$1")
+    got=$(counts "$1")
+    [ "$got" = "$want" ] || fail "$2: diskinfo says $got, FAT scan $want"
+    cp "$1" "$DIR/nosum.img"
+    printf '\0\0\0\0' | dd of="$DIR/nosum.img" bs=1 seek=38 conv=notrunc 2>/dev/null
+    got=$(counts "$DIR/nosum.img")
+    [ "$got" = "$want" ] || fail "$2: diskinfo without summary says $got, FAT scan $want"
+    pass "$2: diskinfo counts match the FAT ($want)"
+}
+
+fsck_clean() {
+    ./diskfsck "$1" > "$DIR/fsck.txt" || { cat "$DIR/fsck.txt"; fail "$2: diskfsck"; }
+    pass "$2: diskfsck clean"
+}
+
+# What must hold for every image after every change
+verify() {
+    fsck_clean "$1" "$2"
+    check_counts "$1" "$2"
+}
+
+# Big-endian word at byte offset $2 of image $1, and writing one
+get_be32() {
+    od -An -tu1 -j "$2" -N4 "$1" |
+        awk '{ printf "%.0f\n", $1 * 16777216 + $2 * 65536 + $3 * 256 + $4 }'
+}
+
+put_be32() {
+    printf "$(printf '\\%03o' $(($3 >> 24 & 255)) $(($3 >> 16 & 255)) \
+                               $(($3 >> 8 & 255)) $(($3 & 255)))" |
+        dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+roundtrip() {
+    ./diskget "$1" "$2" "$DIR/got" || fail "diskget $2"
+    cmp -s "$3" "$DIR/got" || fail "$2 differs from $3"
+}
+
+# --- Images ---
+./mkimage -b 512 -n 16384 -d 2 -f 3 -F 6 -s log:1:32K -x 30 \
+          "$DIR/frag.img" > /dev/null
+./mkimage -b 4096 -n 4096 -d 1 -f 2 -F 4 -s log:1:256K \
+          "$DIR/seq.img" > /dev/null
+./mkimage -b 1024 -n 8192 -d 1 -f 2 -F 4 -s log:1:64K -J \
+          "$DIR/journal.img" > /dev/null
+IMAGES="frag seq journal"
+for img in $IMAGES; do
+    verify "$DIR/$img.img" "$img.img"
+done
+
+# --- Round trips ---
+SIZES="0 1 511 512 513 4096 100000 1000000"
+for n in $SIZES; do
+    head -c "$n" /dev/urandom > "$DIR/r$n.bin"
+done
+for img in $IMAGES; do
+    for n in $SIZES; do
+        ./diskput "$DIR/$img.img" "$DIR/r$n.bin" "/rt/r$n.bin" ||
+            fail "$img.img: diskput r$n.bin"
+        roundtrip "$DIR/$img.img" "/rt/r$n.bin" "$DIR/r$n.bin"
+    done
+    pass "$img.img: put/get round trips"
+
+    rm -rf "$DIR/tree" "$DIR/tree2"
+    ./diskget -r "$DIR/$img.img" /rt "$DIR/tree" || fail "$img.img: diskget -r"
+    ./diskput -r "$DIR/$img.img" "$DIR/tree" /copy || fail "$img.img: diskput -r"
+    ./diskget -r "$DIR/$img.img" /copy "$DIR/tree2" ||
+        fail "$img.img: diskget -r /copy"
+    diff -r "$DIR/tree" "$DIR/tree2" > /dev/null ||
+        fail "$img.img: tree round trip differs"
+    pass "$img.img: put -r/get -r round trip"
+    verify "$DIR/$img.img" "$img.img after puts"
+done
+
+# --- Streaming ---
+# Pipes have no size up front: diskput claims blocks as data arrives,
+# and diskget - writes the file to stdout
+for img in $IMAGES; do
+    for n in 0 513 1000000; do
+        cat "$DIR/r$n.bin" | ./diskput "$DIR/$img.img" - "/pipe/r$n.bin" ||
+            fail "$img.img: diskput - r$n.bin"
+        ./diskget "$DIR/$img.img" "/pipe/r$n.bin" - | cmp -s - "$DIR/r$n.bin" ||
+            fail "$img.img: diskget /pipe/r$n.bin - differs"
+    done
+    pass "$img.img: diskput - and diskget - through pipes"
+    verify "$DIR/$img.img" "$img.img after streaming"
+done
+
+# A stream larger than the free space fails and leaves the image as it was
+img=$DIR/small.img
+./mkimage -b 512 -n 1024 -d 0 -F 0 "$img" > /dev/null
+before=$(counts "$img")
+cat "$DIR/r1000000.bin" | ./diskput "$img" - /big.bin 2> /dev/null &&
+    fail "small.img: an oversized stream went in"
+[ "$(counts "$img")" = "$before" ] || fail "small.img: a failed stream leaked blocks"
+pass "small.img: an oversized stream leaves the image unchanged"
+verify "$img" "small.img after a failed stream"
+
+# --- Ranged reads ---
+# offset:length pairs across block and extent boundaries and past the
+# end, an empty length meaning to the end of the file; each must match
+# the same bytes cut from the host copy
+RANGES="0:1 511:2 4095:8193 300000:200000 999999: 1000000:5 900000:500000 1K:4K"
+for img in $IMAGES; do
+    for r in $RANGES; do
+        off=${r%%:*} len=${r#*:}
+        set -- --offset "$off"
+        [ -n "$len" ] && set -- "$@" --length "$len"
+        ./diskget "$@" "$DIR/$img.img" /rt/r1000000.bin - > "$DIR/got" ||
+            fail "$img.img: diskget $*"
+        case $off in *K) off=$((${off%K} * 1024)) ;; esac
+        case $len in *K) len=$((${len%K} * 1024)) ;; esac
+        tail -c +$((off + 1)) "$DIR/r1000000.bin" |
+            head -c "${len:-1000000}" | cmp -s - "$DIR/got" ||
+            fail "$img.img: diskget $* differs"
+    done
+    pass "$img.img: diskget --offset/--length"
+done
+
+# --- Compression ---
+# Text compresses; random data falls back to a plain copy.  The text is
+# large enough to take two compression batches, and comes in once from
+# a file and once through a pipe.
+seq 1 100000 | sed "s/\$/ the quick brown fox jumps over the lazy dog/" > "$DIR/text.bin"
+img=$DIR/seq.img
+free0=$(info "$img" "Free Blocks")
+./diskput -z "$img" "$DIR/text.bin" /z/text.bin || fail "diskput -z text"
+roundtrip "$img" /z/text.bin "$DIR/text.bin"
+free1=$(info "$img" "Free Blocks")
+bs=$(info "$img" "Block size")
+size=$(wc -c < "$DIR/text.bin")
+[ $(( (free0 - free1) * bs )) -lt $(( size / 2 )) ] ||
+    fail "-z text took $((free0 - free1)) blocks"
+cat "$DIR/text.bin" | ./diskput -z "$img" - /z/piped.bin ||
+    fail "diskput -z from a pipe"
+roundtrip "$img" /z/piped.bin "$DIR/text.bin"
+./diskget --offset 3000000 --length 100000 "$img" /z/text.bin - \
+    > "$DIR/got" || fail "diskget a range of a compressed file"
+tail -c +3000001 "$DIR/text.bin" | head -c 100000 | cmp -s - "$DIR/got" ||
+    fail "a range of a compressed file differs"
+./diskput -z "$img" "$DIR/r1000000.bin" /z/rand.bin || fail "diskput -z random"
+roundtrip "$img" /z/rand.bin "$DIR/r1000000.bin"
+./diskput -z "$img" "$DIR/r0.bin" /z/empty.bin || fail "diskput -z empty"
+roundtrip "$img" /z/empty.bin "$DIR/r0.bin"
+pass "compressed files"
+verify "$img" "seq.img after -z"
+
+# --- Replace, append, --sync ---
+# A put over an existing file keeps one entry and reuses its chain
+img=$DIR/frag.img
+./diskput "$img" "$DIR/r4096.bin" /rt/r100000.bin || fail "replace"
+roundtrip "$img" /rt/r100000.bin "$DIR/r4096.bin"
+./diskput "$img" "$DIR/r1000000.bin" /rt/r100000.bin || fail "replace"
+roundtrip "$img" /rt/r100000.bin "$DIR/r1000000.bin"
+[ "$(./disklist "$img" /rt | grep -c ' r100000\.bin ')" = 1 ] ||
+    fail "replace left a second entry"
+pass "replace a file with a shorter one, then a longer one"
+
+cat "$DIR/r513.bin" "$DIR/r100000.bin" > "$DIR/joined.bin"
+./diskput "$img" "$DIR/r513.bin" /app.bin || fail "append: first put"
+./diskput -a "$img" "$DIR/r100000.bin" /app.bin || fail "append"
+roundtrip "$img" /app.bin "$DIR/joined.bin"
+./diskput -a "$img" - /app.bin < "$DIR/r1.bin" || fail "append from stdin"
+cat "$DIR/r1.bin" >> "$DIR/joined.bin"
+roundtrip "$img" /app.bin "$DIR/joined.bin"
+pass "append"
+
+cp "$DIR/r1000000.bin" "$DIR/edit.bin"
+./diskput --sync "$img" "$DIR/edit.bin" /sync.bin || fail "--sync: first put"
+./diskput --sync -v "$img" "$DIR/edit.bin" /sync.bin 2>&1 |
+    grep -q ': unchanged$' || fail "--sync rewrote an unchanged file"
+printf 'changed' | dd of="$DIR/edit.bin" bs=1 seek=300000 conv=notrunc 2>/dev/null
+# Same size: only a different modification time makes --sync look
+touch -d '2001-02-03 04:05:06' "$DIR/edit.bin"
+./diskput --sync -v "$img" "$DIR/edit.bin" /sync.bin 2>&1 |
+    grep -q ', 1 changed$' || fail "--sync: update did not rewrite one block"
+roundtrip "$img" /sync.bin "$DIR/edit.bin"
+head -c 200000 "$DIR/r1000000.bin" > "$DIR/edit.bin"
+./diskput --sync "$img" "$DIR/edit.bin" /sync.bin || fail "--sync: shrink"
+roundtrip "$img" /sync.bin "$DIR/edit.bin"
+pass "--sync"
+
+# Names that would not survive a round trip are refused
+for dest in /rt/ /rt/.. /a_name_of_thirty_one_characters /rt; do
+    ./diskput "$img" "$DIR/r1.bin" "$dest" 2> /dev/null &&
+        fail "diskput to $dest went in"
+done
+pass "bad destination names are refused"
+verify "$img" "frag.img after replace, append and --sync"
+
+# --- Journal replay ---
+# A crash after the commit but before the blocks were all copied home:
+# put the metadata back as it was and the journal header back as the
+# commit left it, then open read-write.
+img=$DIR/journal.img
+bs=$(info "$img" "Block size")
+meta=$(( $(info "$img" "Root directory start") + $(info "$img" "Root directory blocks") ))
+jstart=$(./diskfsck -J "$img" | sed -n 's/.* journal at block \([0-9]*\)$/\1/p')
+[ -n "$jstart" ] || fail "no journal on journal.img"
+cp "$img" "$DIR/before.img"
+./diskput "$img" "$DIR/r100000.bin" /replayed.bin || fail "journal: put"
+cp "$img" "$DIR/after.img"
+
+cp "$DIR/after.img" "$DIR/crash.img"
+dd if="$DIR/before.img" of="$DIR/crash.img" bs="$bs" count="$meta" \
+   conv=notrunc 2>/dev/null
+printf 'CSC360JL' | dd of="$DIR/crash.img" bs=1 seek=$((jstart * bs)) \
+   conv=notrunc 2>/dev/null
+./diskget "$DIR/crash.img" /replayed.bin "$DIR/got" ||
+    fail "journal: read-only open does not see the commit"
+cmp -s "$DIR/got" "$DIR/r100000.bin" || fail "journal: read-only overlay"
+cmp -s "$DIR/crash.img" "$DIR/after.img" && fail "journal: crash image unchanged"
+./diskfsck -y "$DIR/crash.img" > "$DIR/replay.txt" 2>&1 ||
+    fail "journal: replay"
+grep -q '^Replayed [0-9]* journalled block' "$DIR/replay.txt" ||
+    fail "journal: nothing replayed"
+cmp -s "$DIR/crash.img" "$DIR/after.img" ||
+    fail "journal: replayed image differs from the committed one"
+pass "journal replay after a cut-short copy home"
+
+# A commit torn before its fsync fails its checksum and is ignored
+cp "$DIR/crash.img" "$DIR/torn.img"
+dd if="$DIR/before.img" of="$DIR/torn.img" bs="$bs" count="$meta" \
+   conv=notrunc 2>/dev/null
+printf 'CSC360JL' | dd of="$DIR/torn.img" bs=1 seek=$((jstart * bs)) \
+   conv=notrunc 2>/dev/null
+dd if=/dev/zero of="$DIR/torn.img" bs="$bs" seek=$((jstart + 1)) count=1 \
+   conv=notrunc 2>/dev/null
+./diskfsck -y "$DIR/torn.img" > "$DIR/replay.txt" 2>&1 ||
+    fail "journal: torn"
+grep -q '^Replayed' "$DIR/replay.txt" && fail "journal: torn commit replayed"
+./diskget "$DIR/torn.img" /replayed.bin "$DIR/got" > /dev/null 2>&1 &&
+    fail "journal: torn commit took effect"
+fsck_clean "$DIR/torn.img" "journal.img after a torn commit"
+check_counts "$DIR/crash.img" "journal.img after replay"
+
+# --- diskshell ---
+# One script puts, syncs, reads back and lists; a bad command fails the
+# run but not the commands around it
+img=$DIR/seq.img
+cat > "$DIR/script" <<EOF
+# comments and blank lines are skipped
+
+put $DIR/r4096.bin /sh/a.bin
+put $DIR/r100000.bin /sh/b.bin
+sync
+get /sh/a.bin $DIR/a.out
+list /sh
+bogus
+get /sh/b.bin $DIR/b.out
+info
+EOF
+./diskshell "$img" "$DIR/script" > "$DIR/shell.txt" 2> "$DIR/shell.err" &&
+    fail "diskshell: bad command did not fail the run"
+grep -q "line 8: bad command 'bogus'" "$DIR/shell.err" ||
+    fail "diskshell: no message for the bad command"
+cmp -s "$DIR/a.out" "$DIR/r4096.bin" || fail "diskshell: get a.bin"
+cmp -s "$DIR/b.out" "$DIR/r100000.bin" || fail "diskshell: get b.bin"
+[ "$(grep -c '^F .* [ab]\.bin ' "$DIR/shell.txt")" = 2 ] ||
+    fail "diskshell: list /sh"
+grep -q '^Free Blocks: ' "$DIR/shell.txt" || fail "diskshell: info"
+roundtrip "$img" /sh/b.bin "$DIR/r100000.bin"
+pass "diskshell script"
+printf 'list /sh\nquit\nlist /nonexistent\n' |
+    ./diskshell "$img" > "$DIR/shell.txt" || fail "diskshell: quit"
+pass "diskshell reads stdin and stops at quit"
+verify "$img" "seq.img after diskshell"
+
+# --- libcsc360fs ---
+# Readers on eight threads beside a writer on one handle; libcheck
+# compares every range it reads with the host files
+mkdir "$DIR/lib"
+cp "$DIR/r0.bin" "$DIR/r513.bin" "$DIR/r4096.bin" "$DIR/r100000.bin" \
+   "$DIR/r1000000.bin" "$DIR/lib"
+img=$DIR/seq.img
+./diskput -r "$img" "$DIR/lib" /libsrc || fail "libcsc360fs: diskput -r"
+./libcheck "$img" /libsrc "$DIR/lib" > /dev/null ||
+    fail "libcsc360fs: concurrent readers"
+# Files go in by name: r0 r100000 r1000000 r4096 r513
+roundtrip "$img" /lib/w22 "$DIR/r1000000.bin"
+roundtrip "$img" /lib/in_list "$DIR/r513.bin"
+pass "libcsc360fs: concurrent readers beside put and sync"
+verify "$img" "seq.img after libcsc360fs"
+
+# --- diskfsck repair ---
+# On an image holding only a.bin (2 blocks) and b.bin (1 block), point
+# b.bin's chain into a.bin's and mark a free block allocated.  -y must
+# cut b.bin back to its one block and free the orphan.
+img=$DIR/damaged.img
+./mkimage -b 512 -n 1024 -d 0 -F 0 "$img" > /dev/null
+./diskput "$img" "$DIR/r513.bin" /a.bin || fail "fsck: put a.bin"
+./diskput "$img" "$DIR/r512.bin" /b.bin || fail "fsck: put b.bin"
+bs=$(info "$img" "Block size")
+fat=$(( $(info "$img" "FAT starts") * bs ))
+root=$(( $(info "$img" "Root directory start") * bs ))
+a=$(get_be32 "$img" $((root + 64 + 1)))      # slot 0 is "."
+b=$(get_be32 "$img" $((root + 128 + 1)))
+a2=$(get_be32 "$img" $((fat + 4 * a)))
+last=$(( $(info "$img" "Block count") - 1 ))
+[ "$(get_be32 "$img" $((fat + 4 * last)))" = 0 ] || fail "fsck: block $last in use"
+put_be32 "$img" $((fat + 4 * b)) "$a2"
+put_be32 "$img" $((fat + 4 * last)) 4294967295
+st=0; ./diskfsck "$img" > "$DIR/fsck.txt" || st=$?
+[ "$st" = 4 ] || fail "fsck: damaged image exits $st, want 4"
+grep -q "^/b.bin: file is cross-linked at block $a2\$" "$DIR/fsck.txt" &&
+    grep -q '^1 allocated block(s) belong to no file' "$DIR/fsck.txt" ||
+    { cat "$DIR/fsck.txt"; fail "fsck: damage not reported"; }
+st=0; ./diskfsck -y "$img" > "$DIR/fsck.txt" || st=$?
+[ "$st" = 1 ] || fail "fsck -y exits $st, want 1"
+roundtrip "$img" /a.bin "$DIR/r513.bin"
+roundtrip "$img" /b.bin "$DIR/r512.bin"
+pass "diskfsck -y repairs a cross-link and an orphan"
+verify "$img" "damaged.img after diskfsck -y"
+
+# A first-fit writer that does not keep the summary takes the lowest
+# free block: diskinfo must notice and scan, and -y must rewrite it
+first=$(dd if="$img" bs="$bs" skip="$(info "$img" "FAT starts")" \
+           count="$(info "$img" "FAT blocks")" 2>/dev/null |
+        od -An -v -tx1 -w4 |
+        awk '$1 $2 $3 $4 == "00000000" { print NR - 1; exit }')
+put_be32 "$img" $((fat + 4 * first)) 4294967295
+check_counts "$img" "damaged.img with a stale summary"
+./diskfsck "$img" > "$DIR/fsck.txt" && fail "fsck: stale summary passes"
+grep -q '^Free-space summary does not match the FAT$' "$DIR/fsck.txt" ||
+    { cat "$DIR/fsck.txt"; fail "fsck: stale summary not reported"; }
+st=0; ./diskfsck -y "$img" > "$DIR/fsck.txt" || st=$?
+[ "$st" = 1 ] || fail "fsck -y on a stale summary exits $st, want 1"
+grep -q '^rewrote the free-space summary$' "$DIR/fsck.txt" ||
+    { cat "$DIR/fsck.txt"; fail "fsck -y: summary not rewritten"; }
+verify "$img" "damaged.img after rewriting the summary"
+
+# --- Defrag ---
+# -n plans exactly what a real run then does, and every file survives
+for img in $IMAGES; do
+    rm -rf "$DIR/tree" "$DIR/tree2"
+    ./diskget -r "$DIR/$img.img" / "$DIR/tree" || fail "$img.img: diskget -r /"
+    ./diskdefrag -n "$DIR/$img.img" > "$DIR/plan.txt" ||
+        fail "$img.img: diskdefrag -n"
+    ./diskdefrag "$DIR/$img.img" > "$DIR/defrag.txt" ||
+        fail "$img.img: diskdefrag"
+    ./diskget -r "$DIR/$img.img" / "$DIR/tree2" || fail "$img.img: diskget -r /"
+    diff -r "$DIR/tree" "$DIR/tree2" > /dev/null ||
+        fail "$img.img: files changed by diskdefrag"
+    grep -q '^after: .* 0 fragmented' "$DIR/defrag.txt" ||
+        fail "$img.img: fragmented chains left: $(cat "$DIR/defrag.txt")"
+    [ "$(sed -n 's/^planned: *//p; s/^would move //p' "$DIR/plan.txt")" = \
+      "$(sed -n 's/^after: *//p; s/^moved //p' "$DIR/defrag.txt")" ] ||
+        fail "$img.img: diskdefrag -n planned something else"
+    pass "$img.img: diskdefrag keeps every file"
+    verify "$DIR/$img.img" "$img.img after diskdefrag"
+done
+
+# --- diskexport ---
+# The archive lists every file and directory and unpacks to the same
+# tree diskget -r writes, for the whole image and for one subdirectory
+for img in $IMAGES; do
+    for dir in / /rt; do
+        rm -rf "$DIR/tree" "$DIR/tree2"
+        mkdir "$DIR/tree2"
+        ./diskget -r "$DIR/$img.img" "$dir" "$DIR/tree" ||
+            fail "$img.img: diskget -r $dir"
+        ./diskexport "$DIR/$img.img" "$dir" > "$DIR/out.tar" ||
+            fail "$img.img: diskexport $dir"
+        (cd "$DIR/tree" && find . -mindepth 1 | sed 's|^\./||' | sort) \
+            > "$DIR/want.txt"
+        tar -tf "$DIR/out.tar" | sed 's|/$||' | sort > "$DIR/got.txt" ||
+            fail "$img.img: tar -t of diskexport $dir"
+        cmp -s "$DIR/want.txt" "$DIR/got.txt" ||
+            fail "$img.img: diskexport $dir lists other members"
+        tar -xf "$DIR/out.tar" -C "$DIR/tree2" ||
+            fail "$img.img: tar -x of diskexport $dir"
+        diff -r "$DIR/tree" "$DIR/tree2" > /dev/null ||
+            fail "$img.img: diskexport $dir differs from diskget -r"
+    done
+    pass "$img.img: diskexport matches diskget -r"
+done
+
+# --- diskfind ---
+# Each filter against find(1) on the tree diskget -r writes, on one
+# thread and on several; -0 gives the same paths NUL-terminated
+found() {
+    ./diskfind "$@" | sort > "$DIR/got.txt" || fail "diskfind $*"
+}
+
+wanted() {
+    (cd "$DIR/tree" && find . -mindepth 1 "$@") | sed 's|^\.||' | sort \
+        > "$DIR/want.txt"
+}
+
+for img in $IMAGES; do
+    rm -rf "$DIR/tree"
+    ./diskget -r "$DIR/$img.img" / "$DIR/tree" || fail "$img.img: diskget -r /"
+    for j in 1 4; do
+        set -- -j "$j" "$DIR/$img.img"
+        found "$@"; wanted
+        cmp -s "$DIR/want.txt" "$DIR/got.txt" || fail "$img.img: diskfind -j $j"
+        found -t d "$@"; wanted -type d
+        cmp -s "$DIR/want.txt" "$DIR/got.txt" || fail "$img.img: diskfind -t d"
+        found -t f -n 'f[13]*' "$@"; wanted -type f -name 'f[13]*'
+        cmp -s "$DIR/want.txt" "$DIR/got.txt" || fail "$img.img: diskfind -n"
+        found -s 4K,64K "$@"; wanted -type f -size +4095c -size -65537c
+        cmp -s "$DIR/want.txt" "$DIR/got.txt" || fail "$img.img: diskfind -s"
+        found -s ,0 "$@" /rt; (cd "$DIR/tree" && find ./rt -type f -empty) |
+            sed 's|^\.||' | sort > "$DIR/want.txt"
+        cmp -s "$DIR/want.txt" "$DIR/got.txt" || fail "$img.img: diskfind -s ,0 /rt"
+    done
+    ./diskfind -0 "$DIR/$img.img" | tr '\0\n' '\n\0' | sort > "$DIR/got.txt" ||
+        fail "$img.img: diskfind -0"
+    wanted
+    cmp -s "$DIR/want.txt" "$DIR/got.txt" || fail "$img.img: diskfind -0"
+    pass "$img.img: diskfind matches find(1)"
+done
+
+# -m takes whole days and minutes, and either end may be left out.
+# Puts are stamped with the current time, so the modify time of
+# old.bin (slot 1 of the root, after ".") is set here.
+img=$DIR/when.img
+./mkimage -b 512 -n 1024 -d 0 -F 0 "$img" > /dev/null
+./diskput "$img" "$DIR/r513.bin" /old.bin || fail "diskfind: put old.bin"
+./diskput "$img" "$DIR/r512.bin" /new.bin || fail "diskfind: put new.bin"
+root=$(( $(info "$img" "Root directory start") * $(info "$img" "Block size") ))
+printf '\007\321\002\003\004\005\006' |
+    dd of="$img" bs=1 seek=$((root + 64 + 20)) conv=notrunc 2>/dev/null
+for m in 2001-02-03 ,2001-02-03T04:05 '2001-02-01,2001-02-03 04:05:06'; do
+    [ "$(./diskfind -m "$m" "$img")" = /old.bin ] ||
+        fail "diskfind -m $m does not find just /old.bin"
+done
+[ "$(./diskfind -m 2001-02-03T04:05:07, "$img")" = /new.bin ] ||
+    fail "diskfind -m 2001-02-03T04:05:07, does not find just /new.bin"
+[ "$(./diskfind -m 2001-02-03T04:05:06, "$img" | sort | tr '\n' ' ')" = \
+  "/new.bin /old.bin " ] || fail "diskfind -m 2001-02-03T04:05:06, misses a file"
+pass "diskfind -m"
+
+# --- disklist -R and -f ---
+# -R shows the same listing as disklist on each directory in turn, one
+# heading per directory; tsv and json carry the same paths, types and
+# sizes as the tree diskget -r writes
+for img in $IMAGES; do
+    rm -rf "$DIR/tree"
+    ./diskget -r "$DIR/$img.img" / "$DIR/tree" || fail "$img.img: diskget -r /"
+    ./disklist -R "$DIR/$img.img" / > "$DIR/list.txt" ||
+        fail "$img.img: disklist -R"
+    sed -n 's/^\(\/.*\):$/\1/p' "$DIR/list.txt" > "$DIR/dirs.txt"
+    (echo /; cd "$DIR/tree" && find . -mindepth 1 -type d | sed 's|^\.||') |
+        sort > "$DIR/want.txt"
+    sort "$DIR/dirs.txt" | cmp -s "$DIR/want.txt" - ||
+        fail "$img.img: disklist -R headings are not the directories"
+    first=1
+    while read -r d; do
+        [ -n "$first" ] || echo
+        first=
+        echo "$d:"
+        ./disklist "$DIR/$img.img" "$d" || fail "$img.img: disklist $d"
+    done < "$DIR/dirs.txt" > "$DIR/want.txt"
+    cmp -s "$DIR/want.txt" "$DIR/list.txt" ||
+        fail "$img.img: disklist -R differs from disklist on each directory"
+
+    ./disklist -R -f tsv "$DIR/$img.img" / > "$DIR/list.tsv" ||
+        fail "$img.img: disklist -f tsv"
+    printf 'path\ttype\tsize\tblocks\tctime\tmtime\n' > "$DIR/head.tsv"
+    head -n 1 "$DIR/list.tsv" | cmp -s - "$DIR/head.tsv" ||
+        fail "$img.img: disklist -f tsv header"
+    tail -n +2 "$DIR/list.tsv" | awk -F '\t' -v OFS='\t' '
+        $2 == "dir" { print $1, $2; next } { print $1, $2, $3 }' |
+        sort > "$DIR/got.txt"
+    (cd "$DIR/tree" && find . -mindepth 1 -type d -printf '/%P\tdir\n' \
+                                -o -type f -printf '/%P\tfile\t%s\n') |
+        sort > "$DIR/want.txt"
+    cmp -s "$DIR/want.txt" "$DIR/got.txt" ||
+        fail "$img.img: disklist -f tsv differs from the tree"
+
+    ./disklist -R -f json "$DIR/$img.img" / |
+        sed 's/^{"path":"\(.*\)","type":"\(.*\)","size":\(.*\),"blocks":\(.*\),"ctime":"\(.*\)","mtime":"\(.*\)"}$/\1\t\2\t\3\t\4\t\5\t\6/' \
+        > "$DIR/list.json" || fail "$img.img: disklist -f json"
+    tail -n +2 "$DIR/list.tsv" | cmp -s - "$DIR/list.json" ||
+        fail "$img.img: disklist -f json differs from -f tsv"
+    pass "$img.img: disklist -R, -f tsv and -f json"
+done
+
+# --- Growing and hashed directories ---
+# A hashed directory is rebuilt larger when probes run long, and a full
+# plain one grows through its FAT chain: the root too, with the
+# superblock.  mkimage lays out the root as ".", f0.bin, f1.bin, d0, d1.
+mkdir "$DIR/many"
+for i in $(seq 1 300); do echo "$i" > "$DIR/many/m$i.txt"; done
+img=$DIR/dirs.img
+./mkimage -b 512 -n 8192 -r 1 -d 1 -f 2 -F 2 -H "$img" > /dev/null
+bs=$(info "$img" "Block size")
+d0=$(( $(info "$img" "Root directory start") * bs + 3 * 64 ))
+blocks0=$(get_be32 "$img" $((d0 + 5)))
+for i in $(seq 1 300); do echo "put $DIR/many/m$i.txt /d0/m$i.txt"; done > "$DIR/script"
+./diskshell "$img" "$DIR/script" > /dev/null || fail "dirs: fill hashed /d0"
+[ $(( $(od -An -tu1 -j "$d0" -N1 "$img") & 8 )) = 8 ] || fail "dirs: /d0 not hashed"
+[ "$(get_be32 "$img" $((d0 + 5)))" -gt "$blocks0" ] || fail "dirs: /d0 did not grow"
+rm -rf "$DIR/got.d0"
+./diskget -r "$img" /d0 "$DIR/got.d0" || fail "dirs: diskget -r /d0"
+rm "$DIR/got.d0/f0.bin" "$DIR/got.d0/f1.bin"
+diff -r "$DIR/many" "$DIR/got.d0" > /dev/null || fail "dirs: /d0 differs"
+roundtrip "$img" /d0/m123.txt "$DIR/many/m123.txt"
+pass "a hashed directory is rebuilt as it fills"
+
+for i in $(seq 1 100); do echo "put $DIR/many/m$i.txt /m$i.txt"; done > "$DIR/script"
+./diskshell "$img" "$DIR/script" > /dev/null || fail "dirs: fill the root"
+[ "$(info "$img" "Root directory blocks")" -gt 1 ] || fail "dirs: root did not grow"
+[ "$(./disklist "$img" / | grep -c '^F .* m[0-9]*\.txt ')" = 100 ] ||
+    fail "dirs: root lists the wrong files"
+roundtrip "$img" /m77.txt "$DIR/many/m77.txt"
+pass "a full root grows"
+verify "$img" "dirs.img after growing directories"
+
+rm -rf "$DIR"
+echo "all $checks checks passed"
@@ -0,0 +1,365 @@
+// compress.c -- LZ codec and the chunked compressed-file format
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fs.h"
+
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  14
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITS  5      // the stream always ends in this many literals
+#define LZ_MF_LIMIT   12     // no match starts closer than this to the end
+#define CZ_BATCH      64     // chunks decompressed per round
+
+// --- LZ codec ---
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length beyond the 15 a token nibble holds: 255s, then the remainder
+static int lz_put_len(uint8_t **op, const uint8_t *oend, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*op >= oend) return -1;
+        *(*op)++ = 255;
+    }
+    if (*op >= oend) return -1;
+    *(*op)++ = (uint8_t)len;
+    return 0;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// One sequence: a token, the literals, then (unless mlen is 0, which
+// ends the stream) a little-endian offset and the match length
+static int lz_emit(uint8_t **op, const uint8_t *oend, const uint8_t *lit,
+                   size_t nlit, size_t off, size_t mlen)
+{
+    if (*op >= oend) return -1;
+    uint8_t *token = (*op)++;
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15));
+    if (nlit >= 15 && lz_put_len(op, oend, nlit - 15) != 0) return -1;
+    if ((size_t)(oend - *op) < nlit) return -1;
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+    if (mlen == 0) return 0;
+    if (oend - *op < 2) return -1;
+    (*op)[0] = (uint8_t)off;
+    (*op)[1] = (uint8_t)(off >> 8);
+    *op += 2;
+    if (ml >= 15 && lz_put_len(op, oend, ml - 15) != 0) return -1;
+    return 0;
+}
+
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1u << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+
+    if (n > LZ_MF_LIMIT) {
+        const uint8_t *mflimit = end - LZ_MF_LIMIT;
+        const uint8_t *mlimit  = end - LZ_LAST_LITS;
+        while (ip < mflimit) {
+            uint32_t seq = load32(ip);
+            uint32_t h = lz_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || load32(ref) != seq) {
+                // Step faster through data that keeps missing
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *p = ip + LZ_MIN_MATCH, *q = ref + LZ_MIN_MATCH;
+            while (p < mlimit && *p == *q) {
+                p++;
+                q++;
+            }
+            if (lz_emit(&op, oend, anchor, ip - anchor, ip - ref, p - ip) != 0)
+                return 0;
+            ip = anchor = p;
+        }
+    }
+    if (lz_emit(&op, oend, anchor, end - anchor, 0, 0) != 0) return 0;
+    return op - dst;
+}
+
+long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && lz_get_len(&ip, iend, &lit) != 0) return -1;
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t ml = token & 15;
+        if (ml == 15 && lz_get_len(&ip, iend, &ml) != 0) return -1;
+        ml += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - dst) ||
+            (size_t)(oend - op) < ml)
+            return -1;
+        const uint8_t *m = op - off;
+        if (off >= ml) {
+            memcpy(op, m, ml);
+        } else {
+            for (size_t i = 0; i < ml; i++) op[i] = m[i];  // overlapping
+        }
+        op += ml;
+    }
+    return op - dst;
+}
+
+// --- Compressing a file ---
+// The input is read CZ_BATCH chunks at a time: the batch is compressed
+// in parallel into per-slot buffers, handed to the store in order, and
+// the buffers reused for the next batch, so memory stays at one batch
+// no matter how large the file.
+typedef struct {
+    const uint8_t *src;       // the batch's input
+    uint32_t       size;
+    uint32_t       first;     // file chunk of slot 0
+    uint32_t       count;     // chunks in the batch
+    uint8_t       *slots;     // CZ_CHUNK bytes per chunk of the batch
+    uint32_t      *len;       // stored bytes per chunk; raw length = as is
+    uint32_t       next;      // next chunk to take (atomic)
+} cz_put_t;
+
+static uint32_t chunk_raw_len(uint32_t size, uint32_t i) {
+    uint32_t left = size - i * CZ_CHUNK;
+    return left < CZ_CHUNK ? left : CZ_CHUNK;
+}
+
+static void *compress_worker(void *arg) {
+    cz_put_t *c = arg;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+        if (i >= c->count) break;
+        uint32_t raw = chunk_raw_len(c->size, c->first + i);
+        // Only keep the result if it saves at least one byte
+        size_t n = lz_compress(c->src + (size_t)i * CZ_CHUNK, raw,
+                               c->slots + (size_t)i * CZ_CHUNK, raw - 1);
+        c->len[i] = n ? (uint32_t)n : raw;
+    }
+    return NULL;
+}
+
+// len bytes of the input at off; a file that shrank is an error
+static int pread_input(int fd, uint8_t *buf, size_t len, uint64_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, (off_t)off);
+        STAT_ADD(read_calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) { errno = EIO; return -1; }
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+int compress_file_data(int fd, uint32_t size, int nthreads, uint64_t limit,
+                       cz_store_fn store, void *arg, uint32_t *out_len)
+{
+    uint32_t nchunks = (uint32_t)(((uint64_t)size + CZ_CHUNK - 1) / CZ_CHUNK);
+    uint64_t index_len = CZ_HEADER + 4ull * nchunks;
+    cz_put_t c = { .size = size };
+    uint8_t *index = malloc(index_len);
+    uint8_t *in = malloc((size_t)CZ_BATCH * CZ_CHUNK);
+    c.src = in;
+    c.slots = malloc((size_t)CZ_BATCH * CZ_CHUNK);
+    c.len = malloc(CZ_BATCH * sizeof(*c.len));
+    int rc = -1;
+    if (!index || !in || !c.slots || !c.len) goto out;
+
+    uint64_t end = 0;  // stored chunk bytes so far
+    for (c.first = 0; c.first < nchunks; c.first += c.count) {
+        c.count = nchunks - c.first < CZ_BATCH ? nchunks - c.first : CZ_BATCH;
+        uint64_t from_off = (uint64_t)c.first * CZ_CHUNK;
+        size_t batch = (size_t)(c.count - 1) * CZ_CHUNK +
+                       chunk_raw_len(size, c.first + c.count - 1);
+        if (pread_input(fd, in, batch, from_off) != 0) goto out;
+
+        uint64_t t0 = phase_begin();
+        c.next = 0;
+        run_pool(compress_worker, &c, nthreads, c.count);
+        phase_end(PH_COPY, t0);
+
+        for (uint32_t i = 0; i < c.count; i++) {
+            uint32_t k = c.first + i;
+            const uint8_t *from = c.len[i] < chunk_raw_len(size, k)
+                                ? c.slots + (size_t)i * CZ_CHUNK
+                                : in + (size_t)i * CZ_CHUNK;
+            if (index_len + end + c.len[i] > limit) { rc = 1; goto out; }
+            if (store(index_len + end, from, c.len[i], arg) != 0) goto out;
+            end += c.len[i];
+            put_be32(index + CZ_HEADER + 4ull * k, (uint32_t)end);
+        }
+    }
+
+    // The header and index go in last, once every chunk is in place
+    memcpy(index, "CZ\1\0", 4);
+    put_be32(index + 4, CZ_CHUNK);
+    put_be32(index + 8, nchunks);
+    if (store(0, index, index_len, arg) != 0) goto out;
+    *out_len = (uint32_t)(index_len + end);
+    rc = 0;
+out:
+    free(index);
+    free(in);
+    free(c.slots);
+    free(c.len);
+    return rc;
+}
+
+// --- Reading a compressed file ---
+// Each round reads the index entries and compressed bytes of up to
+// CZ_BATCH chunks with one read each, then decompresses the chunks in
+// parallel into consecutive CZ_CHUNK slots of one buffer.
+typedef struct {
+    const uint8_t  *in;        // compressed bytes of the round
+    const uint32_t *ends;      // round-relative end of each chunk
+    uint8_t        *out;
+    uint32_t        first;     // file chunk of in[0]
+    uint32_t        count;
+    uint32_t        size;      // file size
+    uint32_t        next;      // (atomic)
+    int             failures;  // (atomic)
+} cz_get_t;
+
+static void *decompress_worker(void *arg) {
+    cz_get_t *g = arg;
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED);
+        if (i >= g->count) break;
+        uint32_t from = i ? g->ends[i-1] : 0;
+        uint32_t clen = g->ends[i] - from;
+        uint32_t raw  = chunk_raw_len(g->size, g->first + i);
+        uint8_t *dst  = g->out + (size_t)i * CZ_CHUNK;
+        if (clen == raw)
+            memcpy(dst, g->in + from, raw);
+        else if (lz_decompress(g->in + from, clen, dst, raw) != (long)raw)
+            __atomic_fetch_add(&g->failures, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int read_compressed(extent_cache_t *xc, const dir_entry_t *e, uint64_t off,
+                    uint64_t len, int nthreads, cz_sink_fn sink, void *arg)
+{
+    if (off >= e->file_size || len == 0) return 0;
+    if (len > e->file_size - off) len = e->file_size - off;
+
+    const uint32_t start = e->start_block, blocks = e->block_count;
+    uint8_t hdr[CZ_HEADER];
+    if (read_chain_range(xc, start, blocks, 0, hdr, sizeof(hdr)) != 0)
+        return -1;
+    uint32_t nchunks = get_be32(hdr + 8);
+    if (memcmp(hdr, "CZ\1\0", 4) != 0 || get_be32(hdr + 4) != CZ_CHUNK ||
+        nchunks != ((uint64_t)e->file_size + CZ_CHUNK - 1) / CZ_CHUNK)
+    {
+        errno = EIO;
+        return -1;
+    }
+    const uint64_t data_off = CZ_HEADER + 4ull * nchunks;
+
+    uint8_t raw_ends[4 * (CZ_BATCH + 1)];
+    uint32_t ends[CZ_BATCH];
+    uint32_t chunk = (uint32_t)(off / CZ_CHUNK);
+    uint32_t last  = (uint32_t)((off + len - 1) / CZ_CHUNK);
+
+    // Size the output for the largest round, so a small range costs a
+    // small buffer
+    uint32_t most = last - chunk + 1 < CZ_BATCH ? last - chunk + 1 : CZ_BATCH;
+    uint8_t *in = NULL, *out = malloc((size_t)most * CZ_CHUNK);
+    if (!out) return -1;
+
+    int rc = 0;
+    while (rc == 0 && chunk <= last) {
+        uint32_t count = last - chunk + 1;
+        if (count > CZ_BATCH) count = CZ_BATCH;
+
+        // Index entries chunk-1..chunk+count-1; chunk 0 starts at 0
+        uint32_t lead = chunk > 0;
+        rc = read_chain_range(xc, start, blocks,
+                              CZ_HEADER + 4ull * (chunk - lead), raw_ends,
+                              4 * (count + lead));
+        if (rc != 0) break;
+        uint32_t base = lead ? get_be32(raw_ends) : 0;
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t end = get_be32(raw_ends + 4 * (i + lead));
+            uint32_t prev = i ? ends[i-1] : 0;
+            if (end < base || end - base < prev ||
+                end - base - prev > chunk_raw_len(e->file_size, chunk + i))
+            {
+                errno = EIO;
+                rc = -1;
+                break;
+            }
+            ends[i] = end - base;
+        }
+        if (rc != 0) break;
+
+        uint8_t *grown = realloc(in, ends[count-1] ? ends[count-1] : 1);
+        if (!grown) { rc = -1; break; }
+        in = grown;
+        rc = read_chain_range(xc, start, blocks, data_off + base, in,
+                              ends[count-1]);
+        if (rc != 0) break;
+
+        cz_get_t g = { .in = in, .ends = ends, .out = out, .first = chunk,
+                       .count = count, .size = e->file_size };
+        uint64_t t0 = phase_begin();
+        run_pool(decompress_worker, &g, nthreads, count);
+        phase_end(PH_COPY, t0);
+        if (g.failures) {
+            errno = EIO;
+            rc = -1;
+            break;
+        }
+
+        // Hand on the part of the round inside the range
+        uint64_t round_off = (uint64_t)chunk * CZ_CHUNK;
+        uint64_t skip = off > round_off ? off - round_off : 0;
+        uint64_t have = (uint64_t)(count - 1) * CZ_CHUNK +
+                        chunk_raw_len(e->file_size, chunk + count - 1) - skip;
+        uint64_t want = off + len - (round_off + skip);
+        rc = sink(out + skip, have < want ? have : want, arg);
+        chunk += count;
+    }
+    free(in);
+    free(out);
+    return rc;
+}
@@ -0,0 +1,164 @@
+// csc360fs.c -- thread-safe library front end over fs.c and ops.c
+#define _GNU_SOURCE
+
+#include "csc360fs.h"
+#include "fs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct csc360fs {
+    volume_t         vol;
+    pthread_rwlock_t lock;  // shared for reads, exclusive for put/sync
+};
+
+// --- Handle ---
+csc360fs_t *csc360fs_open(const char *path, int mode) {
+    csc360fs_t *fs = calloc(1, sizeof(*fs));
+    if (!fs) return NULL;
+    if (open_volume(&fs->vol, path,
+                    mode == CSC360FS_RDWR ? IMG_RDWR : IMG_RDONLY) != 0)
+    {
+        int saved = errno;
+        free(fs);
+        errno = saved;
+        return NULL;
+    }
+
+    // glibc favours readers by default; a steady stream of lookups would
+    // then starve a writer forever
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    int rc = pthread_rwlock_init(&fs->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    if (rc != 0) {
+        close_volume(&fs->vol);
+        free(fs);
+        errno = rc;
+        return NULL;
+    }
+    return fs;
+}
+
+int csc360fs_close(csc360fs_t *fs) {
+    if (!fs) return 0;
+    int rc = close_volume(&fs->vol);
+    pthread_rwlock_destroy(&fs->lock);
+    free(fs);
+    return rc;
+}
+
+// --- Readers ---
+// Readers never touch the volume's directory cache (only the writer
+// does); they resolve paths by streaming directories with lookup_path()
+// and read data with read_image(), both positional and stateless.  An
+// unflushed FAT cache (from an earlier put) holds the current links.
+static const fat_cache_t *live_fat(csc360fs_t *fs) {
+    return fs->vol.fat_loaded ? &fs->vol.fat : NULL;
+}
+
+static void fill_stat(const dir_entry_t *e, csc360fs_stat_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->is_dir      = (e->status & DE_DIR) != 0;
+    st->size        = st->is_dir ? 0 : e->file_size;
+    st->start_block = e->start_block;
+    st->block_count = e->block_count;
+    memcpy(st->ctime, e->ctime, 7);
+    memcpy(st->mtime, e->mtime, 7);
+    memcpy(st->name, e->name, sizeof(st->name));
+}
+
+int csc360fs_stat(csc360fs_t *fs, const char *path, csc360fs_stat_t *st) {
+    dir_entry_t e;
+    pthread_rwlock_rdlock(&fs->lock);
+    int rc = lookup_path(&fs->vol.img, live_fat(fs), path, &e);
+    pthread_rwlock_unlock(&fs->lock);
+    if (rc == 0) fill_stat(&e, st);
+    return rc;
+}
+
+ssize_t csc360fs_read(csc360fs_t *fs, const char *path, void *buf,
+                      size_t len, uint64_t off)
+{
+    dir_entry_t e;
+    ssize_t done = -1;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    if (lookup_path(&fs->vol.img, live_fat(fs), path, &e) != 0) goto out;
+    if (e.status & DE_DIR) { errno = EISDIR; goto out; }
+
+    // Repeated reads of a file reuse its cached extent index
+    done = read_file_range(&fs->vol.xc, &e, off, buf, len);
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    return done;
+}
+
+int csc360fs_list(csc360fs_t *fs, const char *path, csc360fs_list_fn fn,
+                  void *arg)
+{
+    image_t *img = &fs->vol.img;
+    dir_entry_t dir;
+    csc360fs_stat_t *ents = NULL;
+    size_t n = 0, cap = 0;
+    int rc = -1;
+
+    // The entries are copied out under the lock and handed to fn once
+    // it is released, so fn may call back into the handle, even put
+    pthread_rwlock_rdlock(&fs->lock);
+    if (lookup_path(img, live_fat(fs), path, &dir) != 0) goto out;
+    if (!(dir.status & DE_DIR)) { errno = ENOTDIR; goto out; }
+
+    dir_iter_t it;
+    dir_iter_init(&it, img, live_fat(fs), dir.start_block, dir.block_count);
+    const uint8_t *raw;
+    rc = 0;
+    while ((raw = dir_iter_next(&it)) != NULL) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            csc360fs_stat_t *grown = realloc(ents, cap * sizeof(*grown));
+            if (!grown) { rc = -1; break; }
+            ents = grown;
+        }
+        dir_entry_t e;
+        decode_dir_entry(raw, &e);
+        fill_stat(&e, &ents[n++]);
+    }
+    if (rc == 0 && it.error) { errno = EIO; rc = -1; }
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    for (size_t i = 0; rc == 0 && i < n; i++) rc = fn(&ents[i], arg);
+    free(ents);
+    return rc;
+}
+
+// --- Writer ---
+// put_fd() is the quiet core under diskput: it reports through errno
+// only, never on the host's stdout or stderr
+int csc360fs_put(csc360fs_t *fs, const char *host_src, const char *fs_dest) {
+    if (!fs->vol.img.writable) { errno = EBADF; return -1; }
+    int fd = open(host_src, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    pthread_rwlock_wrlock(&fs->lock);
+    int rc = put_fd(&fs->vol, fd, fs_dest, PUT_REPLACE, NULL);
+    pthread_rwlock_unlock(&fs->lock);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return rc;
+}
+
+int csc360fs_sync(csc360fs_t *fs) {
+    if (!fs->vol.img.writable) return 0;
+    pthread_rwlock_wrlock(&fs->lock);
+    int rc = sync_volume(&fs->vol);
+    pthread_rwlock_unlock(&fs->lock);
+    return rc;
+}
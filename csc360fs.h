@@ -0,0 +1,63 @@
+#ifndef CSC360FS_H
+#define CSC360FS_H
+
+// libcsc360fs -- embeddable, thread-safe access to CSC360FS images.
+//
+// A handle may be shared by any number of threads.  Reads (stat, read,
+// list) take a shared lock and use only positional I/O, so they run
+// concurrently; put and sync take the lock exclusively.  Every call
+// returns 0 (or a byte count) on success and -1 with errno set on error;
+// nothing is ever printed.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__GNUC__)
+#define CSC360FS_API __attribute__((visibility("default")))
+#else
+#define CSC360FS_API
+#endif
+
+#define CSC360FS_RDONLY 0
+#define CSC360FS_RDWR   1
+
+typedef struct csc360fs csc360fs_t;
+
+typedef struct {
+    int      is_dir;
+    uint32_t size;                 // bytes; 0 for directories
+    uint32_t start_block;
+    uint32_t block_count;
+    uint8_t  ctime[7];             // YYYY(2) MM DD hh mm ss
+    uint8_t  mtime[7];
+    char     name[31];
+} csc360fs_stat_t;
+
+// Called once per entry; a non-zero return stops the listing and is
+// passed back from csc360fs_list().  The directory is read before the
+// first call and the handle is not locked during the calls, so the
+// callback may use the same handle, put and sync included; what it
+// changes does not show in the listing under way.
+typedef int (*csc360fs_list_fn)(const csc360fs_stat_t *st, void *arg);
+
+CSC360FS_API csc360fs_t *csc360fs_open(const char *path, int mode);
+CSC360FS_API int     csc360fs_close(csc360fs_t *fs);
+
+CSC360FS_API int     csc360fs_stat(csc360fs_t *fs, const char *path,
+                                   csc360fs_stat_t *st);
+// Read up to len bytes of a file starting at byte off; returns the
+// number of bytes read, 0 at or past the end
+CSC360FS_API ssize_t csc360fs_read(csc360fs_t *fs, const char *path,
+                                   void *buf, size_t len, uint64_t off);
+CSC360FS_API int     csc360fs_list(csc360fs_t *fs, const char *path,
+                                   csc360fs_list_fn fn, void *arg);
+
+// Copy a host file into the image, creating parent directories and
+// overwriting an existing file in place
+CSC360FS_API int     csc360fs_put(csc360fs_t *fs, const char *host_src,
+                                  const char *fs_dest);
+// Write cached FAT changes back to the image
+CSC360FS_API int     csc360fs_sync(csc360fs_t *fs);
+
+#endif // CSC360FS_H
@@ -0,0 +1,710 @@
+// defrag.c -- measure fragmentation and rewrite chains contiguously
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+
+#define MOVE_BUF_SIZE (1u << 20)
+
+// --- Layout accounting ---
+// Reading the whole tree in directory order (a directory, its files,
+// then its subdirectories) costs one seek whenever an extent does not
+// start where the previous one ended.
+typedef struct {
+    uint64_t objects;      // files and directories with data
+    uint64_t fragmented;   // ...in more than one extent
+    uint64_t extents;
+    uint64_t seeks;
+    uint64_t prev_end;     // block just past the last extent read
+} layout_t;
+
+static void account(layout_t *l, const extent_t *ext, int n) {
+    if (n <= 0) return;
+    l->objects++;
+    l->extents += n;
+    if (n > 1) l->fragmented++;
+    for (int i = 0; i < n; i++) {
+        if (ext[i].start != l->prev_end) l->seeks++;
+        l->prev_end = (uint64_t)ext[i].start + ext[i].count;
+    }
+}
+
+// --- The tree ---
+// Every file and directory with data, in the order a full read visits
+// them.  Object 0 is the root, which stays where the superblock says.
+typedef struct {
+    uint32_t  parent;      // directory holding its entry
+    uint32_t  slot;        // entry's slot in that directory
+    uint32_t  want;        // blocks it keeps (a file's size may need
+                           // fewer than its chain holds)
+    extent_t *ext;         // where it lives now: the whole chain until
+    int       n;           // its first move, the copy after that
+    uint8_t   is_dir;
+    uint8_t   hashed;      // probed by slot position: moves as one run
+    uint8_t   pinned;      // never moved: the root, or cross-linked
+    uint8_t   pending;     // moved in the group not yet committed
+    uint8_t   mark;        // scratch while clearing a place
+    char      name[MAX_NAME_LEN + 1];
+} object_t;
+
+// Owner of each allocatable block: an object index or one of these.  A
+// block in use with no owner (reserved, orphaned, pinned) never moves.
+#define OWN_NONE    UINT32_MAX
+#define OWN_PENDING (UINT32_MAX - 1)   // old copy, freed at the next commit
+
+// One chain queued to move with the current group
+typedef struct {
+    uint32_t  obj;
+    extent_t *old;         // the whole old chain, freed once the group
+    int       nold;        // has committed
+} move_t;
+
+typedef struct {
+    image_t     *img;
+    fat_cache_t *fc;
+    int          dry_run;
+    int          verbose;
+    FILE        *out;
+    uint8_t     *buf;
+    uint32_t    *chain;     // scratch for the blocks of a new copy
+    object_t    *obj;
+    uint32_t     nobj, cap_obj;
+    uint32_t    *owner;     // one per block below fc->nblocks
+    uint32_t    *evict;     // scratch: objects in the way
+    uint64_t    *plan;      // blocks wanted by the movable objects
+                            // before each one in walk order
+    uint32_t     frontier;  // blocks below it are packed
+    uint32_t     pack_end;  // roughly where packing will stop
+    layout_t     before, after;
+    uint64_t     moved_objects, moved_blocks;
+    uint64_t     corrupt, no_room, no_room_frag;
+    move_t      *moves;
+    size_t       nmoves, cap_moves;
+} defrag_t;
+
+// "/a/b" for object idx ("" for the root)
+static void obj_path(const defrag_t *d, uint32_t idx, char *buf, size_t cap) {
+    if (idx == 0) {
+        buf[0] = '\0';
+        return;
+    }
+    obj_path(d, d->obj[idx].parent, buf, cap);
+    size_t len = strlen(buf);
+    snprintf(buf + len, cap - len, "/%s", d->obj[idx].name);
+}
+
+// The extents holding the first `want` blocks of ext[0..n), which must
+// hold at least that many.  Returns their number, or -1.
+static int head_extents(const extent_t *ext, int n, uint32_t want,
+                        extent_t **out)
+{
+    int k = 0;
+    uint32_t got = 0;
+    while (k < n && got < want) got += ext[k++].count;
+    *out = malloc((k ? k : 1) * sizeof(extent_t));
+    if (!*out) return -1;
+    memcpy(*out, ext, k * sizeof(extent_t));
+    if (got > want) (*out)[k - 1].count -= got - want;
+    return k;
+}
+
+static void account_object(layout_t *l, const object_t *o) {
+    extent_t *head;
+    int n = head_extents(o->ext, o->n, o->want, &head);
+    account(l, head, n);
+    if (n >= 0) free(head);
+}
+
+// --- Reading the tree ---
+static int add_object(defrag_t *d, const object_t *o) {
+    if (d->nobj == d->cap_obj) {
+        uint32_t cap = d->cap_obj ? d->cap_obj * 2 : 256;
+        object_t *grown = realloc(d->obj, cap * sizeof(*grown));
+        if (!grown) return -1;
+        d->obj = grown;
+        d->cap_obj = cap;
+    }
+    d->obj[d->nobj++] = *o;
+    return 0;
+}
+
+// Describe the entry at `slot` of directory `dir` in *o.  Returns 1 if
+// it has data to move, 0 if not (or its chain is corrupt).
+static int read_entry(defrag_t *d, uint32_t dir, uint32_t slot,
+                      const uint8_t *raw, object_t *o)
+{
+    const uint32_t bs = d->img->sb.block_size;
+    memset(o, 0, sizeof(*o));
+    o->parent = dir;
+    o->slot   = slot;
+    o->is_dir = (dirent_status(raw) & DE_DIR) != 0;
+    o->hashed = (dirent_status(raw) & DE_HASHED) != 0;
+    memcpy(o->name, dirent_name(raw), MAX_NAME_LEN);
+    o->name[MAX_NAME_LEN] = '\0';
+
+    uint32_t blocks = dirent_blocks(raw);
+    o->want = blocks;
+    if (!o->is_dir && !(dirent_status(raw) & DE_COMPRESSED)) {
+        // A file's size decides how many blocks it really uses; blocks
+        // its entry counts past those are dropped if it moves
+        o->want = (uint32_t)(((uint64_t)dirent_size(raw) + bs - 1) / bs);
+        if (o->want == 0) return 0;
+    }
+    o->n = chain_extents(d->img, d->fc, dirent_start(raw),
+                         blocks > o->want ? blocks : o->want, &o->ext);
+    uint32_t got = 0;
+    for (int x = 0; x < o->n; x++) got += o->ext[x].count;
+    if (o->n <= 0 || got < o->want) {
+        char path[PATH_BUF_SIZE];
+        obj_path(d, dir, path, sizeof(path));
+        fprintf(stderr, "%s/%s: corrupt FAT chain, skipped\n", path, o->name);
+        if (o->n >= 0) free(o->ext);
+        d->corrupt++;
+        return 0;
+    }
+    return 1;
+}
+
+// Append what directory `dir` holds in walk order: its files, then each
+// subdirectory followed by its own contents
+static int scan_dir(defrag_t *d, uint32_t dir, int depth) {
+    if (depth > MAX_TREE_DEPTH) {
+        char path[PATH_BUF_SIZE];
+        obj_path(d, dir, path, sizeof(path));
+        fprintf(stderr, "%s: directory tree too deep\n", path);
+        errno = ELOOP;
+        return -1;
+    }
+
+    // Entries are gathered first so the subdirectories can follow the files
+    uint32_t start = d->obj[dir].ext[0].start;
+    object_t *kids = NULL;
+    size_t nkids = 0, cap = 0;
+    dir_iter_t it;
+    dir_iter_init(&it, d->img, d->fc, start, d->obj[dir].want);
+    const uint8_t *raw;
+    int rc = 0;
+    for (uint32_t slot = 0; rc == 0 && (raw = dir_iter_slot(&it)) != NULL;
+         slot++)
+    {
+        if (!(raw[0] & DE_IN_USE)) continue;
+        uint32_t s = dirent_start(raw);
+        if (s == start || s == FAT_EOF || dirent_blocks(raw) == 0) continue;
+        if (nkids == cap) {
+            cap = cap ? cap * 2 : 16;
+            object_t *grown = realloc(kids, cap * sizeof(*grown));
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            kids = grown;
+        }
+        nkids += read_entry(d, dir, slot, raw, &kids[nkids]);
+    }
+
+    // Pass 1: files.  Pass 2: each subdirectory, then what it holds.
+    if (rc == 0 && it.error) {
+        errno = EIO;
+        rc = -1;
+    }
+    for (int pass = 1; pass <= 2; pass++) {
+        for (size_t i = 0; i < nkids; i++) {
+            if (kids[i].is_dir != (pass == 2) || !kids[i].ext) continue;
+            if (rc == 0 && add_object(d, &kids[i]) == 0) {
+                kids[i].ext = NULL;
+                if (pass == 2) rc = scan_dir(d, d->nobj - 1, depth + 1);
+            } else {
+                rc = -1;
+            }
+        }
+    }
+    for (size_t i = 0; i < nkids; i++) free(kids[i].ext);
+    free(kids);
+    return rc;
+}
+
+// Record which object owns each block.  Chains that share blocks are
+// pinned, and with the root's their blocks are left without an owner so
+// nothing is ever moved onto or away from them.
+static void map_owners(defrag_t *d) {
+    const uint32_t nblocks = d->fc->nblocks;
+    for (uint32_t b = 0; b < nblocks; b++) d->owner[b] = OWN_NONE;
+    for (uint32_t i = 0; i < d->nobj; i++) {
+        object_t *o = &d->obj[i];
+        for (int x = 0; x < o->n; x++) {
+            for (uint32_t b = o->ext[x].start;
+                 b < o->ext[x].start + o->ext[x].count; b++)
+            {
+                if (b >= nblocks) {
+                    o->pinned = 1;
+                } else if (d->owner[b] == OWN_NONE) {
+                    d->owner[b] = i;
+                } else {
+                    d->obj[d->owner[b]].pinned = 1;
+                    o->pinned = 1;
+                }
+            }
+        }
+    }
+    for (uint32_t i = 0; i < d->nobj; i++) {
+        object_t *o = &d->obj[i];
+        if (!o->pinned) continue;
+        if (i != 0) {
+            char path[PATH_BUF_SIZE];
+            obj_path(d, i, path, sizeof(path));
+            fprintf(stderr, "%s: shares blocks with another chain, skipped\n",
+                    path);
+            d->corrupt++;
+        }
+        for (int x = 0; x < o->n; x++)
+            for (uint32_t b = o->ext[x].start;
+                 b < o->ext[x].start + o->ext[x].count && b < nblocks; b++)
+                d->owner[b] = OWN_NONE;
+    }
+}
+
+// --- Moving one chain ---
+static int copy_extents(defrag_t *d, const extent_t *src, int nsrc,
+                        const extent_t *dst, int ndst)
+{
+    const uint32_t bs = d->img->sb.block_size;
+    const uint32_t max = MOVE_BUF_SIZE / bs;
+    uint64_t t0 = phase_begin();
+    int rc = 0, i = 0, j = 0;
+    uint32_t si = 0, dj = 0;    // blocks done of src[i] and dst[j]
+    while (rc == 0 && i < nsrc && j < ndst) {
+        uint32_t n = src[i].count - si;
+        if (dst[j].count - dj < n) n = dst[j].count - dj;
+        if (n > max) n = max;
+        size_t len = (size_t)n * bs;
+        if (read_image(d->img, (uint64_t)(src[i].start + si) * bs,
+                       d->buf, len) != 0 ||
+            write_image(d->img, (uint64_t)(dst[j].start + dj) * bs,
+                        d->buf, len) != 0)
+            rc = -1;
+        if ((si += n) == src[i].count) { i++; si = 0; }
+        if ((dj += n) == dst[j].count) { j++; dj = 0; }
+    }
+    phase_end(PH_COPY, t0);
+    return rc;
+}
+
+// Claim the blocks object e is to be packed into if they are all free,
+// so it moves once instead of aside and then into place.  Packing
+// reaches them once idx fills the place ending at hi and the objects
+// between the two in walk order follow it.
+static int take_planned(defrag_t *d, uint32_t e, uint32_t idx, uint32_t hi) {
+    fat_cache_t *fc = d->fc;
+    const uint32_t n = d->obj[e].want;
+    if (e <= idx) return 0;
+    uint64_t at = hi + d->plan[e] - d->plan[idx + 1];
+    if (at + n > fc->nblocks) return 0;
+    for (uint64_t b = at; b < at + n; b++)
+        if (fat_get(fc, (uint32_t)b) != FAT_FREE) return 0;
+    fat_take_run(fc, (uint32_t)at, n, d->chain);
+    return 1;
+}
+
+// Add free blocks of [from, to) to d->chain until it holds n
+static uint32_t gather_free(defrag_t *d, uint32_t i, uint32_t n,
+                            uint32_t from, uint32_t to)
+{
+    for (uint32_t b = from; i < n; b++) {
+        if ((b = fat_next_free(d->fc, b)) == FAT_EOF || b >= to) break;
+        d->chain[i++] = b;
+    }
+    return i;
+}
+
+// Claim free blocks for a copy of n blocks that is only getting out of
+// the way of the frontier's place [lo, hi).  Past where packing will
+// stop, the frontier does not run into them again: one run there, else
+// (unless the copy must be whole, as a hashed directory's must) single
+// blocks there.  Then one run past the place, then single blocks past
+// it and in the holes below it.  The blocks are linked and left in d->chain.
+// Returns -1 if there are too few.
+static int spill_blocks(defrag_t *d, uint32_t n, int whole, uint32_t lo,
+                        uint32_t hi, uint32_t free_in_place)
+{
+    fat_cache_t *fc = d->fc;
+    const uint32_t far = d->pack_end > hi ? d->pack_end : hi;
+    uint32_t run = fat_run_from(fc, far, n), i = 0;
+    if (run == FAT_EOF && !whole &&
+        (i = gather_free(d, 0, n, far, fc->nblocks)) == n)
+        goto link;
+    if (run == FAT_EOF) run = fat_run_from(fc, hi, n);
+    if (run != FAT_EOF) {
+        fat_take_run(fc, run, n, d->chain);
+        return 0;
+    }
+    if (whole || fc->free_count - free_in_place < n) return -1;
+    i = gather_free(d, i, n, hi, far);
+    if (gather_free(d, i, n, 0, lo) < n) return -1;
+link:
+    for (i = 0; i < n; i++)
+        fat_set(fc, d->chain[i], i + 1 < n ? d->chain[i + 1] : FAT_EOF);
+    return 0;
+}
+
+static int queue_move(defrag_t *d, uint32_t obj, extent_t *old, int nold) {
+    if (d->nmoves == d->cap_moves) {
+        size_t cap = d->cap_moves ? d->cap_moves * 2 : 32;
+        move_t *grown = realloc(d->moves, cap * sizeof(*grown));
+        if (!grown) return -1;
+        d->moves = grown;
+        d->cap_moves = cap;
+    }
+    d->moves[d->nmoves++] = (move_t){ obj, old, nold };
+    return 0;
+}
+
+// Copy object idx into the chain just claimed in d->chain and queue the
+// switch.  Nothing refers to the copy until its entry is rewritten, and
+// the old blocks stay allocated until then.
+static int move_object(defrag_t *d, uint32_t idx, const char *why) {
+    object_t *o = &d->obj[idx];
+    const uint32_t want = o->want;
+    extent_t *dst = malloc(count_extents(d->chain, want) * sizeof(*dst));
+    if (!dst) return -1;
+    int nd = 0;
+    for (uint32_t i = 0; i < want; i++) {
+        if (nd && d->chain[i] == dst[nd - 1].start + dst[nd - 1].count)
+            dst[nd - 1].count++;
+        else
+            dst[nd++] = (extent_t){ d->chain[i], 1 };
+    }
+
+    extent_t *src;
+    int ns = head_extents(o->ext, o->n, want, &src);
+    if (ns < 0 || queue_move(d, idx, o->ext, o->n) != 0) {
+        if (ns >= 0) free(src);
+        free(dst);
+        return -1;
+    }
+    if (d->verbose) {
+        char path[PATH_BUF_SIZE];
+        obj_path(d, idx, path, sizeof(path));
+        fprintf(d->out, "%s: %d extent(s) at %u -> %u blocks at %u%s\n",
+                path, ns, src[0].start, want, dst[0].start, why);
+    }
+    int rc = d->dry_run ? 0 : copy_extents(d, src, ns, dst, nd);
+    free(src);
+
+    for (int x = 0; x < o->n; x++)
+        for (uint32_t b = o->ext[x].start;
+             b < o->ext[x].start + o->ext[x].count; b++)
+            d->owner[b] = OWN_PENDING;
+    for (uint32_t i = 0; i < want; i++) d->owner[d->chain[i]] = idx;
+    o->ext = dst;
+    o->n = nd;
+    o->pending = 1;
+    d->moved_objects++;
+    d->moved_blocks += want;
+    return rc;
+}
+
+// Image offset of object idx's entry, in its directory's current home
+static uint64_t entry_offset(const defrag_t *d, uint32_t idx) {
+    const uint32_t bs = d->img->sb.block_size;
+    const object_t *dir = &d->obj[d->obj[idx].parent];
+    uint64_t pos = (uint64_t)d->obj[idx].slot * DIR_ENTRY_SIZE;
+    uint64_t blk = pos / bs;
+    for (int x = 0; x < dir->n; x++) {
+        if (blk < dir->ext[x].count)
+            return (dir->ext[x].start + blk) * bs + pos % bs;
+        blk -= dir->ext[x].count;
+    }
+    return UINT64_MAX;
+}
+
+// Make the queued moves take effect.  The copied data is made durable
+// first.  With a journal, the new FAT links, the switched entries and
+// the freed old chains then go in one commit.  Without one, the links
+// are flushed and synced, then the entries are switched and synced, and
+// only then are the old chains freed: a crash at any point leaves every
+// file readable, at worst with unreferenced blocks for diskfsck -y.
+// Entries go wherever their directory lives now, so a directory that
+// moved in the same group gets them in its copy.
+static int commit_group(defrag_t *d) {
+    const int journal = d->img->sb.journal_blocks != 0;
+    int rc = 0;
+    if (d->nmoves == 0) return 0;
+    if (!d->dry_run) {
+        if ((!journal && flush_fat(d->img, d->fc) != 0) ||
+            fsync_image(d->img) != 0)
+            rc = -1;
+        for (size_t i = 0; rc == 0 && i < d->nmoves; i++) {
+            const object_t *o = &d->obj[d->moves[i].obj];
+            uint64_t off = entry_offset(d, d->moves[i].obj);
+            uint8_t be[8];
+            put_be32(be, o->ext[0].start);
+            put_be32(be + 4, o->want);
+            if (off == UINT64_MAX) {
+                errno = EIO;
+                rc = -1;
+            } else {
+                rc = write_meta(d->img, off + 1, be, 8);
+            }
+        }
+        if (rc == 0 && !journal && fsync_image(d->img) != 0) rc = -1;
+    }
+    for (size_t i = 0; i < d->nmoves; i++) {
+        const move_t *m = &d->moves[i];
+        for (int x = 0; rc == 0 && x < m->nold; x++) {
+            for (uint32_t b = m->old[x].start;
+                 b < m->old[x].start + m->old[x].count; b++)
+            {
+                fat_set(d->fc, b, FAT_FREE);
+                d->owner[b] = OWN_NONE;
+            }
+        }
+        d->obj[m->obj].pending = 0;
+        free(m->old);
+    }
+    d->nmoves = 0;
+    if (rc == 0 && !d->dry_run) {
+        rc = journal ? commit_journal(d->img, d->fc)
+                     : flush_fat(d->img, d->fc);
+    }
+    return rc;
+}
+
+// --- Packing ---
+// Leave object idx where it is for good: there is no room to move it.
+// Its blocks lose their owner, so the frontier steps over them.
+static void stay(defrag_t *d, uint32_t idx) {
+    object_t *o = &d->obj[idx];
+    d->no_room++;
+    if (o->ext[0].count < o->want) d->no_room_frag++;
+    if (d->verbose) {
+        char path[PATH_BUF_SIZE];
+        obj_path(d, idx, path, sizeof(path));
+        fprintf(d->out, "%s: no room to move it, left where it is\n", path);
+    }
+    o->pinned = 1;
+    for (int x = 0; x < o->n; x++)
+        for (uint32_t b = o->ext[x].start;
+             b < o->ext[x].start + o->ext[x].count; b++)
+            d->owner[b] = OWN_NONE;
+}
+
+// Bring object idx to the frontier.  Whatever else is in the way is
+// moved aside in one group (the object itself too, if its own blocks
+// are in the way: copies never overlap what they copy), and the place
+// is taken once that group has committed and freed it.  Anything too
+// big to move aside stays, and the frontier steps past it.
+static int place(defrag_t *d, uint32_t idx) {
+    fat_cache_t *fc = d->fc;
+    for (;;) {
+        object_t *o = &d->obj[idx];
+        const uint32_t lo = d->frontier, want = o->want;
+        if (o->ext[0].start == lo && o->ext[0].count >= want) {
+            d->frontier = lo + want;
+            return 0;
+        }
+        if ((uint64_t)lo + want > fc->nblocks) {
+            stay(d, idx);
+            return 0;
+        }
+        const uint32_t hi = lo + want;
+
+        // Blocks that never move end the place; start again past them
+        uint32_t b = hi;
+        while (b > lo && (fat_get(fc, b - 1) == FAT_FREE ||
+                          d->owner[b - 1] != OWN_NONE))
+            b--;
+        if (b > lo) {
+            d->frontier = b;
+            continue;
+        }
+
+        uint32_t free_in_place = 0, nevict = 0;
+        int wait = o->pending;
+        for (b = lo; b < hi; b++) {
+            uint32_t w = d->owner[b];
+            if (fat_get(fc, b) == FAT_FREE) {
+                free_in_place++;
+            } else if (w == OWN_PENDING || d->obj[w].pending) {
+                wait = 1;
+            } else if (!d->obj[w].mark) {
+                d->obj[w].mark = 1;
+                d->evict[nevict++] = w;
+            }
+        }
+        for (uint32_t i = 0; i < nevict; i++) d->obj[d->evict[i]].mark = 0;
+
+        // Freed blocks and twice-moved objects need the group committed
+        if (wait) {
+            if (commit_group(d) != 0) return -1;
+            continue;
+        }
+        if (nevict == 0) {
+            fat_take_run(fc, lo, want, d->chain);
+            d->frontier = hi;
+            if (move_object(d, idx, "") != 0) return -1;
+            // Keep a group's entry rewrites within one journal commit
+            return d->nmoves >= JOURNAL_BATCH ? commit_group(d) : 0;
+        }
+
+        // Whatever does not fit outside the place stays, largest first
+        uint64_t need = 0;
+        uint32_t largest = d->evict[0];
+        for (uint32_t i = 0; i < nevict; i++) {
+            need += d->obj[d->evict[i]].want;
+            if (d->obj[d->evict[i]].want > d->obj[largest].want)
+                largest = d->evict[i];
+        }
+        if (need > fc->free_count - free_in_place) {
+            stay(d, largest);
+            if (largest == idx) return 0;
+            continue;
+        }
+        for (uint32_t i = 0; i < nevict; i++) {
+            uint32_t e = d->evict[i];
+            const object_t *eo = &d->obj[e];
+            if (take_planned(d, e, idx, hi)) {
+                if (move_object(d, e, ", ahead to its place") != 0) return -1;
+            } else if (spill_blocks(d, eo->want, eo->hashed, lo, hi,
+                                    free_in_place) != 0) {
+                stay(d, e);
+                if (e == idx) return 0;
+            } else if (move_object(d, e, ", out of the way") != 0) {
+                return -1;
+            }
+            if (d->nmoves >= JOURNAL_BATCH && commit_group(d) != 0)
+                return -1;
+        }
+        if (commit_group(d) != 0) return -1;
+    }
+}
+
+static void report(FILE *out, const char *when, const layout_t *l) {
+    fprintf(out, "%-8s %llu files/dirs, %llu fragmented, %llu extents, "
+                 "%llu seeks for a full read\n",
+            when, (unsigned long long)l->objects,
+            (unsigned long long)l->fragmented,
+            (unsigned long long)l->extents, (unsigned long long)l->seeks);
+}
+
+int defrag_volume(volume_t *v, int dry_run, int verbose, FILE *out) {
+    image_t *img = &v->img;
+    const superblock_t *sb = &img->sb;
+    if (!dry_run && !img->writable) {
+        fprintf(stderr, "Image is read-only\n");
+        return -1;
+    }
+    fat_cache_t *fc = volume_fat(v);
+    if (!fc) {
+        fprintf(stderr, "Error reading FAT\n");
+        return -1;
+    }
+
+    defrag_t d;
+    memset(&d, 0, sizeof(d));
+    d.img     = img;
+    d.fc      = fc;
+    d.dry_run = dry_run;
+    d.verbose = verbose;
+    d.out     = out;
+    d.buf     = malloc(MOVE_BUF_SIZE);
+    d.owner   = malloc(((size_t)fc->nblocks + 1) * sizeof(uint32_t));
+
+    // The root stays put (the superblock points at it) but is read first
+    object_t root;
+    memset(&root, 0, sizeof(root));
+    root.want   = sb->root_blocks;
+    root.is_dir = 1;
+    root.pinned = 1;
+    root.n = chain_extents(img, fc, sb->root_start, sb->root_blocks,
+                           &root.ext);
+    int rc = 0;
+    if (!d.buf || !d.owner) {
+        fprintf(stderr, "Out of memory\n");
+        rc = -1;
+    } else if (root.n <= 0) {
+        fprintf(stderr, "Error reading root directory\n");
+        rc = -1;
+    } else if (add_object(&d, &root) != 0 || scan_dir(&d, 0, 0) != 0) {
+        fprintf(stderr, "Error reading directory tree: %s\n",
+                strerror(errno));
+        rc = -1;
+    }
+    if (rc != 0) {
+        if (root.n > 0 && d.nobj == 0) free(root.ext);
+        goto out;
+    }
+
+    // Scratch for the largest copy and for everything in one place
+    uint32_t most = 1;
+    uint64_t wanted = 0, held = 0;
+    map_owners(&d);
+    d.before.prev_end = sb->root_start;
+    for (uint32_t i = 0; i < d.nobj; i++) {
+        const object_t *o = &d.obj[i];
+        account_object(&d.before, o);
+        if (o->want > most) most = o->want;
+        if (o->pinned) continue;
+        wanted += o->want;
+        for (int x = 0; x < o->n; x++) held += o->ext[x].count;
+    }
+    d.chain = malloc((size_t)most * sizeof(uint32_t));
+    d.evict = malloc((size_t)most * sizeof(uint32_t));
+    d.plan  = malloc(((size_t)d.nobj + 1) * sizeof(uint64_t));
+    if (!d.chain || !d.evict || !d.plan) {
+        fprintf(stderr, "Out of memory\n");
+        rc = -1;
+        goto out;
+    }
+    // Packing ends past everything that stays, plus what moves
+    uint64_t end = (uint64_t)(fc->nblocks - fc->free_count) - held + wanted;
+    d.pack_end = end < fc->nblocks ? (uint32_t)end : fc->nblocks;
+    d.plan[0] = 0;
+    for (uint32_t i = 0; i < d.nobj; i++)
+        d.plan[i + 1] = d.plan[i] + (d.obj[i].pinned ? 0 : d.obj[i].want);
+
+    // Slide every chain, in walk order, to the end of the packed prefix
+    for (uint32_t i = 1; rc == 0 && i < d.nobj; i++)
+        if (!d.obj[i].pinned) rc = place(&d, i);
+    if (rc == 0) rc = commit_group(&d);
+    if (rc != 0) fprintf(stderr, "Defragmentation stopped: %s\n",
+                         errno ? strerror(errno) : "I/O error");
+
+    d.after.prev_end = sb->root_start;
+    for (uint32_t i = 0; i < d.nobj; i++) account_object(&d.after, &d.obj[i]);
+    report(out, "before:", &d.before);
+    report(out, dry_run ? "planned:" : "after:", &d.after);
+    fprintf(out, "%s %llu chain(s), %llu block(s)",
+            dry_run ? "would move" : "moved",
+            (unsigned long long)d.moved_objects,
+            (unsigned long long)d.moved_blocks);
+    if (d.before.seeks)
+        fprintf(out, "; seeks %llu -> %llu (%.1f%% fewer)",
+                (unsigned long long)d.before.seeks,
+                (unsigned long long)d.after.seeks,
+                100.0 * ((double)d.before.seeks - (double)d.after.seeks) /
+                (double)d.before.seeks);
+    fprintf(out, "\n");
+    if (d.corrupt)
+        fprintf(out, "%llu chain(s) skipped: corrupt or cross-linked "
+                     "(run diskfsck)\n", (unsigned long long)d.corrupt);
+    if (d.no_room)
+        fprintf(out, "%llu chain(s) left where they are, %llu of them "
+                     "fragmented: no free space to move them\n",
+                (unsigned long long)d.no_room,
+                (unsigned long long)d.no_room_frag);
+
+out:
+    for (size_t i = 0; i < d.nmoves; i++) free(d.moves[i].old);
+    for (uint32_t i = 0; i < d.nobj; i++) free(d.obj[i].ext);
+    free(d.obj);
+    free(d.moves);
+    free(d.owner);
+    free(d.evict);
+    free(d.plan);
+    free(d.chain);
+    free(d.buf);
+    return rc;
+}
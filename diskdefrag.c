@@ -0,0 +1,40 @@
+// diskdefrag.c -- rewrite fragmented chains contiguously
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fs.h"
+
+int main(int argc, char **argv) {
+    int stats = take_stats_option(&argc, argv);
+    int dry_run = 0, verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "nv")) != -1) {
+        if (opt == 'n') dry_run = 1;
+        else if (opt == 'v') verbose = 1;
+        else argc = 0;
+    }
+    if (stats < 0 || argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-n] [-v] [--stats[=json]] <image>\n",
+                argv[0]);
+        return 1;
+    }
+
+    volume_t vol;
+    if (open_volume(&vol, argv[optind], dry_run ? IMG_RDONLY : IMG_RDWR) != 0) {
+        perror("open_image");
+        return 1;
+    }
+    report_journal(&vol);
+
+    int rc = defrag_volume(&vol, dry_run, verbose, stdout);
+    int closed = close_volume(&vol);
+    report_journal(&vol);
+    if (closed != 0) {
+        fprintf(stderr, "Failed to write FAT\n");
+        rc = -1;
+    }
+    if (stats) print_stats(stderr, stats == STATS_JSON);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+// diskexport.c -- write the image's tree to stdout as a tar archive
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fs.h"
+
+int main(int argc, char **argv) {
+    int stats = take_stats_option(&argc, argv);
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt == 'v') verbose = 1;
+        else argc = 0;
+    }
+    int nargs = argc - optind;
+    if (stats < 0 || nargs < 1 || nargs > 2) {
+        fprintf(stderr, "Usage: %s [-v] [--stats[=json]] <image> [fs_dir]\n",
+                argv[0]);
+        return 1;
+    }
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Refusing to write an archive to a terminal\n");
+        return 1;
+    }
+
+    volume_t vol;
+    if (open_volume(&vol, argv[optind], IMG_RDONLY) != 0) {
+        perror("open_image");
+        return 1;
+    }
+    int rc = export_tree(&vol, nargs == 2 ? argv[optind + 1] : "/",
+                         STDOUT_FILENO, verbose);
+    close_volume(&vol);
+    if (stats) print_stats(stderr, stats == STATS_JSON);
+    return rc == 0 ? 0 : 1;
+}
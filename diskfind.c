@@ -0,0 +1,124 @@
+// diskfind.c -- list entries under a directory that match name, type,
+// size and modification time tests
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fs.h"
+
+// "MIN,MAX" with either side left out, or "N" for exactly N
+static int parse_size_range(const char *s, uint64_t *lo, uint64_t *hi) {
+    const char *comma = strchr(s, ',');
+    if (!comma) {
+        if (parse_size(s, lo) != 0) return -1;
+        *hi = *lo;
+        return 0;
+    }
+    char from[32];
+    size_t n = (size_t)(comma - s);
+    if (n >= sizeof(from)) return -1;
+    memcpy(from, s, n);
+    from[n] = '\0';
+    if (n > 0 && parse_size(from, lo) != 0) return -1;
+    if (comma[1] && parse_size(comma + 1, hi) != 0) return -1;
+    return *lo <= *hi ? 0 : -1;
+}
+
+// "YYYY-MM-DD[Thh:mm[:ss]]" (or a space for the T) into the on-disk
+// time form; fields left out are filled with `fill`, so 0 makes the
+// earliest moment the text covers and 0xFF the latest
+static int parse_when(const char *s, size_t len, uint8_t fill, uint8_t t[7]) {
+    char buf[32];
+    if (len >= sizeof(buf)) return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    unsigned y, mo, d, h, mi, sec;
+    char sep, end;
+    int n = sscanf(buf, "%4u-%2u-%2u%c%2u:%2u:%2u%c",
+                   &y, &mo, &d, &sep, &h, &mi, &sec, &end);
+    if (n < 3 || n == 4 || n == 5 || n == 8 ||
+        (n > 3 && sep != 'T' && sep != ' '))
+        return -1;
+    if (mo < 1 || mo > 12 || d < 1 || d > 31 ||
+        (n >= 6 && (h > 23 || mi > 59)) || (n == 7 && sec > 60))
+        return -1;
+    memset(t, fill, 7);
+    t[0] = (uint8_t)(y >> 8);
+    t[1] = (uint8_t)y;
+    t[2] = (uint8_t)mo;
+    t[3] = (uint8_t)d;
+    if (n >= 6) { t[4] = (uint8_t)h; t[5] = (uint8_t)mi; }
+    if (n == 7) t[6] = (uint8_t)sec;
+    return 0;
+}
+
+// "FROM,TO" with either side left out, or one time for all it covers
+static int parse_time_range(const char *s, find_filter_t *flt) {
+    const char *comma = strchr(s, ',');
+    if (!comma) {
+        return parse_when(s, strlen(s), 0, flt->mtime_from) == 0 &&
+               parse_when(s, strlen(s), 0xFF, flt->mtime_to) == 0 ? 0 : -1;
+    }
+    if (comma > s &&
+        parse_when(s, (size_t)(comma - s), 0, flt->mtime_from) != 0)
+        return -1;
+    if (comma[1] &&
+        parse_when(comma + 1, strlen(comma + 1), 0xFF, flt->mtime_to) != 0)
+        return -1;
+    return memcmp(flt->mtime_from, flt->mtime_to, 7) <= 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int stats = take_stats_option(&argc, argv);
+    find_filter_t flt;
+    memset(&flt, 0, sizeof(flt));
+    flt.type_mask = DE_FILE | DE_DIR;
+    flt.max_size  = UINT64_MAX;
+    memset(flt.mtime_to, 0xFF, sizeof(flt.mtime_to));
+    flt.sep = '\n';
+
+    int nthreads = 0, bad = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:n:t:s:m:0")) != -1) {
+        switch (opt) {
+        case 'j': nthreads = atoi(optarg); break;
+        case 'n': flt.name = optarg; break;
+        case 't':
+            if (strcmp(optarg, "f") == 0)      flt.type_mask = DE_FILE;
+            else if (strcmp(optarg, "d") == 0) flt.type_mask = DE_DIR;
+            else bad = 1;
+            break;
+        case 's':
+            if (parse_size_range(optarg, &flt.min_size, &flt.max_size) != 0)
+                bad = 1;
+            break;
+        case 'm':
+            if (parse_time_range(optarg, &flt) != 0) bad = 1;
+            break;
+        case '0': flt.sep = '\0'; break;
+        default:  bad = 1;
+        }
+    }
+    int nargs = argc - optind;
+    if (stats < 0 || bad || nargs < 1 || nargs > 2 || nthreads < 0) {
+        fprintf(stderr,
+                "Usage: %s [-j threads] [-n pattern] [-t f|d] [-s min,max] "
+                "[-m from,to] [-0] [--stats[=json]] <image> [fs_dir]\n",
+                argv[0]);
+        return 1;
+    }
+
+    volume_t vol;
+    if (open_volume(&vol, argv[optind], IMG_RDONLY) != 0) {
+        perror("open_image");
+        return 1;
+    }
+    int rc = find_tree(&vol, nargs == 2 ? argv[optind + 1] : "/", &flt,
+                       STDOUT_FILENO, nthreads);
+    close_volume(&vol);
+    if (stats) print_stats(stderr, stats == STATS_JSON);
+    return rc == 0 ? 0 : 1;
+}
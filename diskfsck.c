@@ -0,0 +1,48 @@
+// diskfsck.c -- check (and optionally repair) an image
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fs.h"
+
+int main(int argc, char **argv) {
+    int stats = take_stats_option(&argc, argv);
+    int repair = 0, journal = 0, nthreads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "yJj:")) != -1) {
+        if (opt == 'y') repair = 1;
+        else if (opt == 'J') journal = 1;
+        else if (opt == 'j') nthreads = atoi(optarg);
+        else argc = 0;
+    }
+    if (stats < 0 || argc - optind != 1 || nthreads < 0) {
+        fprintf(stderr,
+                "Usage: %s [-y] [-J] [-j threads] [--stats[=json]] <image>\n",
+                argv[0]);
+        return 8;
+    }
+
+    volume_t vol;
+    if (open_volume(&vol, argv[optind],
+                    repair || journal ? IMG_RDWR : IMG_RDONLY) != 0)
+    {
+        perror("open_image");
+        return 8;
+    }
+    report_journal(&vol);
+
+    int rc = check_volume(&vol, nthreads, repair, stdout);
+    // A journal goes only onto an image that checked out (or was fixed)
+    if (journal && (rc == FSCK_CLEAN || rc == FSCK_FIXED) &&
+        add_journal(&vol, stdout) != 0)
+        rc = -1;
+    int closed = close_volume(&vol);
+    report_journal(&vol);
+    if (closed != 0) {
+        fprintf(stderr, "Failed to write FAT\n");
+        rc = -1;
+    }
+    if (stats) print_stats(stderr, stats == STATS_JSON);
+    return rc < 0 ? 8 : rc;
+}
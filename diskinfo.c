@@ -2,38 +2,19 @@
 #include "fs.h"
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <image_file>\n", argv[0]);
+    int stats = take_stats_option(&argc, argv);
+    if (stats < 0 || argc != 2) {
+        fprintf(stderr, "Usage: %s [--stats[=json]] <image_file>\n", argv[0]);
         return 1;
     }
-    FILE *img = fopen(argv[1], "rb");
-    if (!img) { perror("fopen"); return 1; }
-
-    superblock_t sb;
-    if (read_superblock(img, &sb) != 0) {
-        fprintf(stderr, "Failed to read superblock\n");
-        return 1;
-    }
-
-    printf("Super block information:\n");
-    printf("Block size: %u\n", sb.block_size);
-    printf("Block count: %u\n", sb.block_count);
-    printf("FAT starts: %u\n", sb.fat_start);
-    printf("FAT blocks: %u\n", sb.fat_blocks);
-    printf("Root directory start: %u\n", sb.root_start);
-    printf("Root directory blocks: %u\n\n", sb.root_blocks);
-
-    uint32_t free_b, res_b, alloc_b;
-    if (analyze_fat(img, &sb, &free_b, &res_b, &alloc_b) != 0) {
-        fprintf(stderr, "Failed to analyze FAT\n");
+    volume_t vol;
+    if (open_volume(&vol, argv[1], IMG_RDONLY) != 0) {
+        perror("open_image");
         return 1;
     }
 
-    printf("FAT information:\n");
-    printf("Free Blocks: %u\n", free_b);
-    printf("Reserved Blocks: %u\n", res_b);
-    printf("Allocated Blocks: %u\n", alloc_b);
-
-    fclose(img);
-    return 0;
+    int rc = print_info(&vol, stdout);
+    close_volume(&vol);
+    if (stats) print_stats(stderr, stats == STATS_JSON);
+    return rc == 0 ? 0 : 1;
 }
@@ -0,0 +1,121 @@
+// diskshell.c -- run many info/list/get/put commands against one image
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fs.h"
+
+#define MAX_ARGS 4
+
+static void print_help(FILE *out) {
+    fprintf(out,
+            "Commands:\n"
+            "  info                      superblock and FAT summary\n"
+            "  list [path]               list a directory (default /)\n"
+            "  get <fs_path> <host_dest> extract a file\n"
+            "  put <host_src> <fs_dest>  insert a file, replacing one already there\n"
+            "  append <host_src> <fs_dest>\n"
+            "                            add a host file to the end of a file\n"
+            "  sync                      write cached metadata back now\n"
+            "  quit                      stop reading commands\n"
+            "Blank lines and lines starting with # are ignored.\n");
+}
+
+int main(int argc, char **argv) {
+    int stats = take_stats_option(&argc, argv);
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        if (opt == 'v') verbose = 1;
+        else argc = 0;
+    }
+    if (stats < 0 || argc - optind < 1 || argc - optind > 2) {
+        fprintf(stderr, "Usage: %s [-v] [--stats[=json]] <image> [script]\n",
+                argv[0]);
+        return 1;
+    }
+    const char *img_path = argv[optind];
+    const char *script   = argc - optind == 2 ? argv[optind + 1] : NULL;
+
+    // Fall back to read-only so list/get still work on protected images
+    volume_t vol;
+    if (open_volume(&vol, img_path, IMG_RDWR) != 0) {
+        if ((errno != EACCES && errno != EROFS && errno != EPERM) ||
+            open_volume(&vol, img_path, IMG_RDONLY) != 0)
+        {
+            perror("open_image");
+            return 1;
+        }
+    }
+    report_journal(&vol);
+
+    FILE *in = script ? fopen(script, "r") : stdin;
+    if (!in) {
+        perror("fopen");
+        close_volume(&vol);
+        return 1;
+    }
+    int interactive = !script && isatty(STDIN_FILENO);
+
+    char *line = NULL;
+    size_t cap = 0;
+    unsigned lineno = 0;
+    int failures = 0;
+    for (;;) {
+        if (interactive) { fputs("> ", stdout); fflush(stdout); }
+        if (getline(&line, &cap, in) < 0) break;
+        lineno++;
+
+        char *args[MAX_ARGS + 1];
+        int n = 0;
+        char *save = NULL;
+        for (char *tok = strtok_r(line, " \t\r\n", &save);
+             tok && n <= MAX_ARGS;
+             tok = strtok_r(NULL, " \t\r\n", &save))
+            args[n++] = tok;
+        if (n == 0 || args[0][0] == '#') continue;
+
+        const char *cmd = args[0];
+        int rc;
+        if (strcmp(cmd, "quit") == 0 || strcmp(cmd, "exit") == 0) {
+            break;
+        } else if (strcmp(cmd, "help") == 0) {
+            print_help(stdout);
+            rc = 0;
+        } else if (strcmp(cmd, "info") == 0 && n == 1) {
+            rc = print_info(&vol, stdout);
+        } else if (strcmp(cmd, "list") == 0 && n <= 2) {
+            rc = list_dir(&vol, n == 2 ? args[1] : "/", stdout);
+        } else if (strcmp(cmd, "get") == 0 && n == 3) {
+            rc = get_file(&vol, args[1], args[2]);
+        } else if (strcmp(cmd, "put") == 0 && n == 3) {
+            rc = put_file(&vol, args[1], args[2], PUT_REPLACE, verbose);
+        } else if (strcmp(cmd, "append") == 0 && n == 3) {
+            rc = put_file(&vol, args[1], args[2], PUT_APPEND, verbose);
+        } else if (strcmp(cmd, "sync") == 0 && n == 1) {
+            rc = sync_volume(&vol);
+            if (rc != 0) perror("sync");
+            report_journal(&vol);
+        } else {
+            fprintf(stderr, "line %u: bad command '%s' (try 'help')\n",
+                    lineno, cmd);
+            rc = -1;
+        }
+        if (rc != 0) failures++;
+        fflush(stdout);  // keep output in step with stderr messages
+    }
+
+    free(line);
+    if (in != stdin) fclose(in);
+    int closed = close_volume(&vol);
+    report_journal(&vol);
+    if (closed != 0) {
+        fprintf(stderr, "Failed to write FAT\n");
+        failures++;
+    }
+    if (stats) print_stats(stderr, stats == STATS_JSON);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,549 @@
+// export.c -- stream the whole tree out as a tar archive in disk order
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs.h"
+
+#define EXPORT_WINDOW  (4u << 20)    // largest single read of the image
+#define EXPORT_GAP     (64u << 10)   // unused bytes worth reading through
+#define EXPORT_HOLD    (256u << 20)  // fragmented file data held at once
+#define EXPORT_OUT     (1u << 20)    // output buffer
+#define TAR_BLOCK      512
+#define TAR_RECORD     (20 * TAR_BLOCK)
+
+// --- Plan ---
+// Every file and directory under the exported one, in tree order.  A
+// file's data is read in pieces, one per extent; a file in one extent
+// is written out as soon as its piece is read, and one in several is
+// gathered in memory until its last piece comes up.
+typedef struct {
+    char    *path;           // relative to the exported directory
+    uint8_t  status;
+    uint32_t start, blocks, size;
+    uint8_t  mtime[7];
+    int      npieces;        // extents; 0 for directories and empty files
+    int      left;           // pieces not yet read
+    int      deferred;       // read on its own after the sweep
+    uint8_t *buf;            // fragmented files: the data read so far
+} enode_t;
+
+typedef struct {
+    uint32_t start, count;   // physical extent
+    uint32_t node;
+    uint32_t file_off;       // byte offset of the extent in its file
+} piece_t;
+
+typedef struct {
+    volume_t    *v;
+    image_t     *img;
+    fat_cache_t *fc;
+    int          fd;
+    int          verbose;
+    enode_t     *nodes;
+    size_t       nnodes, cap_nodes;
+    piece_t     *pieces;
+    size_t       npieces, cap_pieces;
+    uint8_t     *win;        // read buffer when the image is not mapped
+    uint8_t     *out;
+    size_t       out_len;
+    uint64_t     written;    // bytes of archive so far
+    uint64_t     spans;      // reads of the image
+    int          errors;     // files left out
+} export_t;
+
+static int piece_cmp(const void *a, const void *b) {
+    const piece_t *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static enode_t *add_node(export_t *x, const char *path, const uint8_t *raw) {
+    if (x->nnodes == x->cap_nodes) {
+        size_t cap = x->cap_nodes ? x->cap_nodes * 2 : 64;
+        enode_t *grown = realloc(x->nodes, cap * sizeof(*grown));
+        if (!grown) return NULL;
+        x->nodes = grown;
+        x->cap_nodes = cap;
+    }
+    enode_t *n = &x->nodes[x->nnodes];
+    memset(n, 0, sizeof(*n));
+    if (!(n->path = strdup(path))) return NULL;
+    n->status = dirent_status(raw);
+    n->start  = dirent_start(raw);
+    n->blocks = dirent_blocks(raw);
+    n->size   = dirent_size(raw);
+    memcpy(n->mtime, dirent_mtime(raw), 7);
+    x->nnodes++;
+    return n;
+}
+
+static int add_piece(export_t *x, const extent_t *e, uint32_t node,
+                     uint32_t file_off)
+{
+    if (x->npieces == x->cap_pieces) {
+        size_t cap = x->cap_pieces ? x->cap_pieces * 2 : 256;
+        piece_t *grown = realloc(x->pieces, cap * sizeof(*grown));
+        if (!grown) return -1;
+        x->pieces = grown;
+        x->cap_pieces = cap;
+    }
+    x->pieces[x->npieces++] = (piece_t){ e->start, e->count, node, file_off };
+    return 0;
+}
+
+// Resolve the chain of file node i into pieces; compressed files are
+// decoded through the extent cache after the sweep instead
+static int plan_file(export_t *x, uint32_t i) {
+    enode_t *n = &x->nodes[i];
+    const uint32_t bs = x->img->sb.block_size;
+    if (n->status & DE_COMPRESSED) {
+        n->deferred = 1;
+        return 0;
+    }
+    uint32_t want = (uint32_t)(((uint64_t)n->size + bs - 1) / bs);
+    if (want == 0) return 0;
+
+    extent_t *ext = NULL;
+    int cnt = chain_extents(x->img, x->fc, n->start, want, &ext);
+    uint32_t got = 0;
+    for (int k = 0; k < cnt; k++) got += ext[k].count;
+    if (cnt <= 0 || got != want) {
+        fprintf(stderr, "%s: corrupt FAT chain, skipped\n", n->path);
+        free(ext);
+        n->size = 0;
+        x->errors++;
+        return 0;
+    }
+    uint32_t off = 0;
+    for (int k = 0; k < cnt; k++) {
+        if (add_piece(x, &ext[k], i, off) != 0) {
+            free(ext);
+            return -1;
+        }
+        off += ext[k].count * bs;
+    }
+    n->npieces = n->left = cnt;
+    free(ext);
+    return 0;
+}
+
+static int plan_dir(export_t *x, uint32_t start, uint32_t blocks,
+                    const char *path, int depth)
+{
+    if (depth > MAX_TREE_DEPTH) {
+        fprintf(stderr, "%s: directory tree too deep\n", path);
+        return -1;
+    }
+    size_t first = x->nnodes;
+    dir_iter_t it;
+    dir_iter_init(&it, x->img, x->fc, start, blocks);
+    const uint8_t *raw;
+    while ((raw = dir_iter_next(&it)) != NULL) {
+        const char *name = dirent_name(raw);
+        if (!(dirent_status(raw) & (DE_FILE | DE_DIR)) || name[0] == '\0' ||
+            strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            dirent_start(raw) == start)
+            continue;
+        char cpath[PATH_BUF_SIZE];
+        int len = snprintf(cpath, sizeof(cpath), "%s%s%.*s", path,
+                           *path ? "/" : "", MAX_NAME_LEN, name);
+        if (len < 0 || (size_t)len >= sizeof(cpath)) {
+            fprintf(stderr, "%s: path too long, skipped\n", path);
+            x->errors++;
+            continue;
+        }
+        if (!add_node(x, cpath, raw)) return -1;
+    }
+    if (it.error) {
+        fprintf(stderr, "%s: error reading directory entries\n",
+                *path ? path : "/");
+        errno = EIO;
+        return -1;
+    }
+
+    // Files first, then each subdirectory's own entries (x->nodes may
+    // move as it grows, so go by index)
+    size_t last = x->nnodes;
+    for (size_t i = first; i < last; i++)
+        if (!(x->nodes[i].status & DE_DIR) && plan_file(x, (uint32_t)i) != 0)
+            return -1;
+    for (size_t i = first; i < last; i++) {
+        if (!(x->nodes[i].status & DE_DIR)) continue;
+        char cpath[PATH_BUF_SIZE];
+        strcpy(cpath, x->nodes[i].path);
+        if (plan_dir(x, x->nodes[i].start, x->nodes[i].blocks, cpath,
+                     depth + 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Fragmented files are held whole until their last piece is read.  In
+// sweep order, any file that would push the bytes held past EXPORT_HOLD
+// is read on its own at the end instead.
+static void limit_held(export_t *x) {
+    uint64_t held = 0;
+    for (size_t p = 0; p < x->npieces; p++) {
+        enode_t *n = &x->nodes[x->pieces[p].node];
+        if (n->npieces < 2 || n->deferred) continue;
+        if (n->left == n->npieces) {
+            if (held + n->size > EXPORT_HOLD) {
+                n->deferred = 1;
+                continue;
+            }
+            held += n->size;
+        }
+        if (--n->left == 0) held -= n->size;
+    }
+    for (size_t i = 0; i < x->nnodes; i++)
+        x->nodes[i].left = x->nodes[i].npieces;
+}
+
+// --- Output ---
+static int flush_out(export_t *x) {
+    if (x->out_len && write_full(x->fd, x->out, x->out_len) != 0) return -1;
+    x->out_len = 0;
+    return 0;
+}
+
+// Small writes gather in the output buffer; large ones go straight out
+static int emit(export_t *x, const void *p, size_t len) {
+    x->written += len;
+    if (x->out_len + len <= EXPORT_OUT) {
+        memcpy(x->out + x->out_len, p, len);
+        x->out_len += len;
+        return 0;
+    }
+    if (flush_out(x) != 0) return -1;
+    if (len >= EXPORT_OUT) return write_full(x->fd, p, len);
+    memcpy(x->out, p, len);
+    x->out_len = len;
+    return 0;
+}
+
+static int emit_zeros(export_t *x, size_t len) {
+    static const uint8_t zero[TAR_BLOCK];
+    while (len > 0) {
+        size_t n = len < sizeof(zero) ? len : sizeof(zero);
+        if (emit(x, zero, n) != 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// --- ustar headers ---
+static void tar_octal(uint8_t *dst, size_t width, uint64_t v) {
+    snprintf((char *)dst, width, "%0*llo", (int)width - 1,
+             (unsigned long long)v);
+}
+
+static time_t entry_time(const uint8_t t[7]) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year  = ((t[0] << 8) | t[1]) - 1900;
+    tm.tm_mon   = t[2] - 1;
+    tm.tm_mday  = t[3];
+    tm.tm_hour  = t[4];
+    tm.tm_min   = t[5];
+    tm.tm_sec   = t[6];
+    tm.tm_isdst = -1;
+    time_t when = mktime(&tm);
+    return when == (time_t)-1 ? 0 : when;
+}
+
+static int put_header(export_t *x, const char *name, char type,
+                      uint64_t size, time_t mtime, size_t name_len,
+                      const char *prefix, size_t prefix_len)
+{
+    uint8_t h[TAR_BLOCK];
+    memset(h, 0, sizeof(h));
+    memcpy(h, name, name_len);
+    tar_octal(h + 100, 8, type == '5' ? 0755 : 0644);
+    tar_octal(h + 108, 8, 0);
+    tar_octal(h + 116, 8, 0);
+    tar_octal(h + 124, 12, size);
+    tar_octal(h + 136, 12, mtime < 0 ? 0 : (uint64_t)mtime);
+    h[156] = (uint8_t)type;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memcpy(h + 345, prefix, prefix_len);
+
+    memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(h); i++) sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    return emit(x, h, sizeof(h));
+}
+
+// Header for node n.  Paths over the 100 bytes of the name field are
+// split across the prefix field; past that a pax record carries them.
+static int tar_header(export_t *x, const enode_t *n) {
+    int is_dir = (n->status & DE_DIR) != 0;
+    char path[PATH_BUF_SIZE + 2];
+    size_t len = (size_t)snprintf(path, sizeof(path), "%s%s", n->path,
+                                  is_dir ? "/" : "");
+    uint64_t size = is_dir ? 0 : n->size;
+    time_t mtime = entry_time(n->mtime);
+    char type = is_dir ? '5' : '0';
+    if (x->verbose) fprintf(stderr, "%s\n", path);
+
+    if (len <= 100) return put_header(x, path, type, size, mtime, len, "", 0);
+    for (size_t cut = len - 1; cut > 0; cut--) {
+        if (path[cut] != '/' || cut > 155 || cut == len - 1) continue;
+        if (len - cut - 1 > 100) break;
+        return put_header(x, path + cut + 1, type, size, mtime,
+                          len - cut - 1, path, cut);
+    }
+
+    // "<len> path=<path>\n", where <len> counts its own digits
+    size_t body = len + 7, rec = body + 1;
+    while (rec != body + (size_t)snprintf(NULL, 0, "%zu", rec))
+        rec = body + (size_t)snprintf(NULL, 0, "%zu", rec);
+    char *pax = malloc(rec + 1);
+    if (!pax) return -1;
+    snprintf(pax, rec + 1, "%zu path=%s\n", rec, path);
+    int rc = put_header(x, "././@PaxHeader", 'x', rec, mtime, 14, "", 0);
+    if (rc == 0) rc = emit(x, pax, rec);
+    if (rc == 0) rc = emit_zeros(x, (TAR_BLOCK - rec % TAR_BLOCK) % TAR_BLOCK);
+    free(pax);
+    if (rc == 0) rc = put_header(x, path, type, size, mtime, 100, "", 0);
+    return rc;
+}
+
+static int pad_member(export_t *x, uint64_t size) {
+    return emit_zeros(x, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+}
+
+// --- Sweep ---
+// Image bytes [off, off+len): in place when mapped, else one read
+static const uint8_t *load_span(export_t *x, uint64_t off, size_t len) {
+    image_t *img = x->img;
+    x->spans++;
+    if (img->map && off + len <= img->size && !image_staged(img, off, len)) {
+        stats_access(off, len, 0);
+        return img->map + off;
+    }
+    return read_image(img, off, x->win, len) == 0 ? x->win : NULL;
+}
+
+// Write out a fragmented file once its last piece is in
+static int finish_file(export_t *x, enode_t *n) {
+    int rc = tar_header(x, n) || emit(x, n->buf, n->size) ||
+             pad_member(x, n->size) ? -1 : 0;
+    free(n->buf);
+    n->buf = NULL;
+    return rc;
+}
+
+// Bytes of piece p that hold file data (the last block may not be full)
+static uint64_t piece_len(const export_t *x, const piece_t *p) {
+    uint64_t len = (uint64_t)p->count * x->img->sb.block_size;
+    uint32_t left = x->nodes[p->node].size - p->file_off;
+    return len < left ? len : left;
+}
+
+// Hand one piece's bytes to its file: straight out for a file in one
+// extent, else into its buffer, writing it out with the last piece
+static int take_piece(export_t *x, const piece_t *p, const uint8_t *data) {
+    enode_t *n = &x->nodes[p->node];
+    uint64_t len = piece_len(x, p);
+    if (n->npieces == 1)
+        return tar_header(x, n) || emit(x, data, len) ||
+               pad_member(x, n->size) ? -1 : 0;
+    if (!n->buf && !(n->buf = malloc(n->size))) return -1;
+    memcpy(n->buf + p->file_off, data, len);
+    return --n->left > 0 ? 0 : finish_file(x, n);
+}
+
+// The same for a piece too large for the window, a window at a time
+static int take_large_piece(export_t *x, const piece_t *p) {
+    enode_t *n = &x->nodes[p->node];
+    const uint64_t off = (uint64_t)p->start * x->img->sb.block_size;
+    const uint64_t len = piece_len(x, p);
+    if (n->npieces == 1 ? tar_header(x, n) != 0
+                        : !n->buf && !(n->buf = malloc(n->size)))
+        return -1;
+    for (uint64_t done = 0; done < len; ) {
+        size_t chunk = len - done < EXPORT_WINDOW ? len - done : EXPORT_WINDOW;
+        const uint8_t *data = load_span(x, off + done, chunk);
+        if (!data) return -1;
+        if (n->npieces > 1)
+            memcpy(n->buf + p->file_off + done, data, chunk);
+        else if (emit(x, data, chunk) != 0)
+            return -1;
+        done += chunk;
+    }
+    if (n->npieces == 1) return pad_member(x, n->size);
+    return --n->left > 0 ? 0 : finish_file(x, n);
+}
+
+// Walk the pieces in block order, reading runs of them that lie close
+// together with one read each
+static int sweep(export_t *x) {
+    const uint64_t bs = x->img->sb.block_size;
+    size_t p = 0;
+    while (p < x->npieces) {
+        const piece_t *first = &x->pieces[p];
+        if (x->nodes[first->node].deferred) { p++; continue; }
+        if ((uint64_t)first->count * bs > EXPORT_WINDOW) {
+            if (take_large_piece(x, first) != 0) return -1;
+            p++;
+            continue;
+        }
+
+        // Extend the span while the next piece starts within EXPORT_GAP
+        // of its end and the whole still fits the window
+        uint64_t from = first->start, to = from + first->count;
+        size_t q = p + 1;
+        for (; q < x->npieces; q++) {
+            const piece_t *nx = &x->pieces[q];
+            if (x->nodes[nx->node].deferred) continue;
+            uint64_t end = (uint64_t)nx->start + nx->count;
+            if (end < to) end = to;
+            if (nx->start > to && (nx->start - to) * bs > EXPORT_GAP) break;
+            if ((end - from) * bs > EXPORT_WINDOW) break;
+            to = end;
+        }
+        const uint8_t *span = load_span(x, from * bs, (size_t)((to - from) * bs));
+        if (!span) return -1;
+        for (size_t i = p; i < q; i++) {
+            const piece_t *pc = &x->pieces[i];
+            if (x->nodes[pc->node].deferred) continue;
+            if (take_piece(x, pc, span + (pc->start - from) * bs) != 0)
+                return -1;
+        }
+        p = q;
+    }
+    return 0;
+}
+
+// Forward the decoded bytes of a deferred file to the archive
+static int deferred_sink(const void *buf, size_t len, void *arg) {
+    return emit(arg, buf, len);
+}
+
+// Files left out of the sweep, in order of their first block
+static int export_deferred(export_t *x) {
+    const uint32_t bs = x->img->sb.block_size;
+    for (size_t i = 0; i < x->nnodes; i++) {
+        enode_t *n = &x->nodes[i];
+        if (!n->deferred) continue;
+        if (tar_header(x, n) != 0) return -1;
+        dir_entry_t e;
+        memset(&e, 0, sizeof(e));
+        e.status      = n->status;
+        e.start_block = n->start;
+        e.block_count = n->blocks;
+        e.file_size   = n->size;
+        int rc;
+        if (n->status & DE_COMPRESSED) {
+            rc = read_compressed(&x->v->xc, &e, 0, n->size, 0,
+                                 deferred_sink, x);
+        } else {
+            rc = 0;
+            for (uint64_t done = 0; rc == 0 && done < n->size; ) {
+                size_t chunk = n->size - done < EXPORT_WINDOW
+                             ? n->size - done : EXPORT_WINDOW;
+                rc = read_chain_range(&x->v->xc, n->start,
+                                      (n->size + bs - 1) / bs, done,
+                                      x->win, chunk);
+                if (rc == 0) rc = emit(x, x->win, chunk);
+                done += chunk;
+            }
+        }
+        // The header promised n->size bytes; a failure here cannot be
+        // papered over
+        if (rc != 0) {
+            fprintf(stderr, "%s: read failed, archive truncated\n", n->path);
+            return -1;
+        }
+        if (pad_member(x, n->size) != 0) return -1;
+    }
+    return 0;
+}
+
+static int node_first_block(const void *a, const void *b) {
+    const enode_t *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+int export_tree(volume_t *v, const char *fs_dir, int out_fd, int verbose) {
+    image_t *img = &v->img;
+    fat_cache_t *fc = volume_fat(v);
+    if (!fc) {
+        fprintf(stderr, "Error reading FAT\n");
+        return -1;
+    }
+
+    export_t x;
+    memset(&x, 0, sizeof(x));
+    x.v = v;
+    x.img = img;
+    x.fc = fc;
+    x.fd = out_fd;
+    x.verbose = verbose;
+    x.out = malloc(EXPORT_OUT);
+    x.win = malloc(EXPORT_WINDOW);
+    int rc = -1;
+    if (!x.out || !x.win) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    // 1) Resolve the tree and every chain before reading any data
+    dir_entry_t top;
+    uint64_t t0 = phase_begin();
+    int found = lookup_path(img, fc, fs_dir, &top);
+    phase_end(PH_RESOLVE, t0);
+    if (found != 0 || !(top.status & DE_DIR)) {
+        fprintf(stderr, "Directory not found.\n");
+        goto out;
+    }
+    t0 = phase_begin();
+    rc = plan_dir(&x, top.start_block, top.block_count, "", 0);
+    phase_end(PH_RESOLVE, t0);
+    if (rc != 0) goto out;
+    qsort(x.pieces, x.npieces, sizeof(*x.pieces), piece_cmp);
+    limit_held(&x);
+
+    // 2) Directories and empty files carry no data and go first (parents
+    //    precede children), then the sweep, then what it left out
+    t0 = phase_begin();
+    for (size_t i = 0; rc == 0 && i < x.nnodes; i++) {
+        const enode_t *n = &x.nodes[i];
+        if ((n->status & DE_DIR) || (n->npieces == 0 && !n->deferred))
+            rc = tar_header(&x, n);
+    }
+    if (rc == 0) rc = sweep(&x);
+    if (rc == 0) {
+        qsort(x.nodes, x.nnodes, sizeof(*x.nodes), node_first_block);
+        rc = export_deferred(&x);
+    }
+
+    // 3) Two zero blocks end the archive, padded to a whole record
+    if (rc == 0) rc = emit_zeros(&x, 2 * TAR_BLOCK);
+    if (rc == 0) rc = emit_zeros(&x, (TAR_RECORD - x.written % TAR_RECORD)
+                                     % TAR_RECORD);
+    if (rc == 0) rc = flush_out(&x);
+    phase_end(PH_COPY, t0);
+    if (rc != 0) perror("export");
+    if (rc == 0 && verbose)
+        fprintf(stderr, "%zu entries, %llu archive bytes, %llu image reads\n",
+                x.nnodes, (unsigned long long)x.written,
+                (unsigned long long)x.spans);
+    if (rc == 0 && x.errors) rc = -1;
+out:
+    for (size_t i = 0; i < x.nnodes; i++) {
+        free(x.nodes[i].path);
+        free(x.nodes[i].buf);
+    }
+    free(x.nodes);
+    free(x.pieces);
+    free(x.out);
+    free(x.win);
+    return rc;
+}
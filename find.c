@@ -0,0 +1,323 @@
+// find.c -- parallel search of the directory tree behind diskfind
+#define _POSIX_C_SOURCE 200809L
+
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fs.h"
+
+#define FIND_OUT       (256u << 10)  // output buffer per worker
+
+// --- Work-stealing queues ---
+// Every worker owns a queue of directories still to scan.  It pushes the
+// subdirectories it finds onto the back of its own queue and pops them
+// from there, going depth-first through what it has just read; an idle
+// worker steals from the front of someone else's queue, where the oldest
+// (and usually largest) subtrees wait.
+typedef struct {
+    uint32_t start, blocks;
+    int      depth;
+    char    *path;           // "" for the root
+} find_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    find_job_t     *jobs;
+    size_t          head, tail, cap;
+} find_queue_t;
+
+typedef struct {
+    image_t             *img;
+    const find_filter_t *flt;
+    int                  fd;
+    int                  nqueues;
+    find_queue_t        *queues;
+    int                  next_id;   // queue for the next worker to start
+    size_t               pending;   // jobs queued or being scanned
+    size_t               idle;      // workers waiting for a job
+
+    pthread_mutex_t      lock;      // sleeping workers wait on `more`
+    pthread_cond_t       more;
+    pthread_mutex_t      out_lock;  // one worker's buffer goes out at a time
+    int                  failed;    // unreadable directory or bad output
+} find_t;
+
+static int push_job(find_queue_t *q, const find_job_t *job) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->jobs, q->jobs + q->head,
+                    (q->tail - q->head) * sizeof(*q->jobs));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            size_t cap = q->cap ? q->cap * 2 : 64;
+            find_job_t *grown = realloc(q->jobs, cap * sizeof(*grown));
+            if (!grown) {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+            q->jobs = grown;
+            q->cap = cap;
+        }
+    }
+    q->jobs[q->tail++] = *job;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Back of our own queue (steal == 0) or front of another's
+static int pop_job(find_queue_t *q, int steal, find_job_t *job) {
+    pthread_mutex_lock(&q->lock);
+    int got = q->head < q->tail;
+    if (got) *job = steal ? q->jobs[q->head++] : q->jobs[--q->tail];
+    if (q->head == q->tail) q->head = q->tail = 0;
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+static int take_job(find_t *f, int self, find_job_t *job) {
+    if (pop_job(&f->queues[self], 0, job)) return 1;
+    for (int k = 1; k < f->nqueues; k++)
+        if (pop_job(&f->queues[(self + k) % f->nqueues], 1, job)) return 1;
+    return 0;
+}
+
+// Queue a directory on our own queue and wake a sleeper if there is one.
+// The sleeper bumps `idle` before its last look at the queues and we
+// look at `idle` after pushing, so one of us always sees the other.
+static int add_job(find_t *f, int self, const find_job_t *job) {
+    __atomic_add_fetch(&f->pending, 1, __ATOMIC_SEQ_CST);
+    if (push_job(&f->queues[self], job) != 0) {
+        __atomic_sub_fetch(&f->pending, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&f->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&f->lock);
+        pthread_cond_signal(&f->more);
+        pthread_mutex_unlock(&f->lock);
+    }
+    return 0;
+}
+
+// Next directory to scan; 0 once every queue is empty and no worker is
+// scanning, since nothing can be added after that
+static int next_job(find_t *f, int self, find_job_t *job) {
+    if (take_job(f, self, job)) return 1;
+    pthread_mutex_lock(&f->lock);
+    __atomic_add_fetch(&f->idle, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int got;
+    while (!(got = take_job(f, self, job)) &&
+           __atomic_load_n(&f->pending, __ATOMIC_SEQ_CST) > 0)
+        pthread_cond_wait(&f->more, &f->lock);
+    __atomic_sub_fetch(&f->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&f->lock);
+    return got;
+}
+
+static void set_failed(find_t *f) {
+    __atomic_store_n(&f->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void finish_job(find_t *f) {
+    if (__atomic_sub_fetch(&f->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&f->lock);
+        pthread_cond_broadcast(&f->more);
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+// --- Output ---
+// Each worker fills its own buffer and writes it out whole, so lines
+// from different workers never interleave
+typedef struct {
+    uint8_t *buf;
+    size_t   len;
+} find_out_t;
+
+static void flush_out(find_t *f, find_out_t *o) {
+    if (o->len == 0) return;
+    pthread_mutex_lock(&f->out_lock);
+    if (!__atomic_load_n(&f->failed, __ATOMIC_RELAXED) &&
+        write_full(f->fd, o->buf, o->len) != 0)
+    {
+        perror("write");
+        set_failed(f);
+    }
+    pthread_mutex_unlock(&f->out_lock);
+    o->len = 0;
+}
+
+static void emit(find_t *f, find_out_t *o, const char *dir, size_t dlen,
+                 const char *name, size_t nlen)
+{
+    if (o->len + dlen + nlen + 2 > FIND_OUT) flush_out(f, o);
+    uint8_t *p = o->buf + o->len;
+    memcpy(p, dir, dlen);
+    p[dlen] = '/';
+    memcpy(p + dlen + 1, name, nlen);
+    p[dlen + 1 + nlen] = (uint8_t)f->flt->sep;
+    o->len += dlen + nlen + 2;
+}
+
+// --- Scan ---
+// Tests go cheapest first, straight off the raw slot; the name pattern
+// comes last
+static int matches(const find_filter_t *flt, const uint8_t *raw,
+                   const char *name)
+{
+    uint8_t status = dirent_status(raw);
+    if (!(status & flt->type_mask)) return 0;
+    if (flt->min_size > 0 || flt->max_size < UINT64_MAX) {
+        if (status & DE_DIR) return 0;
+        uint32_t size = dirent_size(raw);
+        if (size < flt->min_size || size > flt->max_size) return 0;
+    }
+    if (memcmp(dirent_mtime(raw), flt->mtime_from, 7) < 0 ||
+        memcmp(dirent_mtime(raw), flt->mtime_to, 7) > 0)
+        return 0;
+    return !flt->name || fnmatch(flt->name, name, 0) == 0;
+}
+
+static void scan_dir(find_t *f, int self, const find_job_t *job,
+                     find_out_t *o)
+{
+    size_t dlen = strlen(job->path);
+    dir_iter_t it;
+    dir_iter_init(&it, f->img, NULL, job->start, job->blocks);
+    const uint8_t *raw;
+    while ((raw = dir_iter_next(&it)) != NULL) {
+        uint8_t status = dirent_status(raw);
+        if (!(status & (DE_FILE | DE_DIR))) continue;
+        char name[MAX_NAME_LEN + 1];
+        memcpy(name, dirent_name(raw), MAX_NAME_LEN);
+        name[MAX_NAME_LEN] = '\0';
+        size_t nlen = strlen(name);
+        // The root's "." points back at the root itself
+        if (nlen == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            dirent_start(raw) == job->start)
+            continue;
+        if (dlen + 1 + nlen >= PATH_BUF_SIZE) {
+            fprintf(stderr, "%s: path too long, skipped\n", job->path);
+            continue;
+        }
+
+        if (matches(f->flt, raw, name)) emit(f, o, job->path, dlen, name, nlen);
+        if (!(status & DE_DIR)) continue;
+        if (job->depth >= MAX_TREE_DEPTH) {
+            fprintf(stderr, "%s/%s: directory tree too deep\n",
+                    job->path, name);
+            set_failed(f);
+            continue;
+        }
+        find_job_t sub = { dirent_start(raw), dirent_blocks(raw),
+                           job->depth + 1, malloc(dlen + nlen + 2) };
+        if (sub.path) {
+            memcpy(sub.path, job->path, dlen);
+            sub.path[dlen] = '/';
+            memcpy(sub.path + dlen + 1, name, nlen + 1);
+        }
+        if (!sub.path || add_job(f, self, &sub) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            free(sub.path);
+            set_failed(f);
+        }
+    }
+    if (it.error) {
+        fprintf(stderr, "%s: error reading directory entries\n",
+                *job->path ? job->path : "/");
+        set_failed(f);
+    }
+}
+
+static void *find_worker(void *arg) {
+    find_t *f = arg;
+    int self = __atomic_fetch_add(&f->next_id, 1, __ATOMIC_RELAXED);
+    find_out_t o = { malloc(FIND_OUT), 0 };
+    if (!o.buf) {
+        // Take no jobs and leave the tree to the other workers; anything
+        // still queued when they are done is freed by find_tree()
+        fprintf(stderr, "Out of memory\n");
+        set_failed(f);
+        return NULL;
+    }
+    find_job_t job;
+    while (next_job(f, self, &job)) {
+        if (!__atomic_load_n(&f->failed, __ATOMIC_RELAXED))
+            scan_dir(f, self, &job, &o);
+        free(job.path);
+        finish_job(f);
+    }
+    flush_out(f, &o);
+    free(o.buf);
+    return NULL;
+}
+
+int find_tree(volume_t *v, const char *fs_dir, const find_filter_t *flt,
+              int out_fd, int nthreads)
+{
+    dir_entry_t dir;
+    if (lookup_path(&v->img, NULL, fs_dir, &dir) != 0 ||
+        !(dir.status & DE_DIR))
+    {
+        fprintf(stderr, "Directory not found.\n");
+        return -1;
+    }
+    if (nthreads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (int)cpus : 1;
+    }
+
+    find_t f;
+    memset(&f, 0, sizeof(f));
+    f.img     = &v->img;
+    f.flt     = flt;
+    f.fd      = out_fd;
+    f.nqueues = nthreads;
+    f.queues  = calloc(nthreads, sizeof(*f.queues));
+
+    // Matches are printed under the path as given, less trailing slashes
+    size_t len = strlen(fs_dir);
+    while (len > 0 && fs_dir[len - 1] == '/') len--;
+    find_job_t root = { dir.start_block, dir.block_count, 0,
+                        strndup(fs_dir, len) };
+    if (!f.queues || !root.path) {
+        fprintf(stderr, "Out of memory\n");
+        free(f.queues);
+        free(root.path);
+        return -1;
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_init(&f.queues[i].lock, NULL);
+    pthread_mutex_init(&f.lock, NULL);
+    pthread_cond_init(&f.more, NULL);
+    pthread_mutex_init(&f.out_lock, NULL);
+
+    f.pending = 1;
+    int rc = push_job(&f.queues[0], &root);
+    if (rc == 0) {
+        run_pool(find_worker, &f, nthreads, SIZE_MAX);
+    } else {
+        fprintf(stderr, "Out of memory\n");
+        free(root.path);
+    }
+    if (f.failed) rc = -1;
+
+    // Jobs are left over only when no worker could get a buffer
+    for (int i = 0; i < nthreads; i++) {
+        find_queue_t *q = &f.queues[i];
+        for (size_t j = q->head; j < q->tail; j++) free(q->jobs[j].path);
+        free(q->jobs);
+        pthread_mutex_destroy(&q->lock);
+    }
+    free(f.queues);
+    pthread_mutex_destroy(&f.lock);
+    pthread_cond_destroy(&f.more);
+    pthread_mutex_destroy(&f.out_lock);
+    return rc;
+}
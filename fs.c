@@ -1,39 +1,1023 @@
+#define _GNU_SOURCE
+
 #include "fs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
-// --- Superblock reader ---
-int read_superblock(FILE *fp, superblock_t *sb) {
-    if (fseek(fp, 0, SEEK_SET) != 0) return -1;
-    if (fread(sb->fs_id, 1, FS_ID_LEN, fp) != FS_ID_LEN) return -1;
+#define COPY_BUF_SIZE (1u << 20)
+
+// --- Statistics ---
+fs_stats_t fs_stats;
+static _Thread_local int phase_depth;
+
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t phase_begin(void) {
+    return phase_depth++ ? 0 : stats_clock();
+}
+
+void phase_end(int phase, uint64_t t0) {
+    if (--phase_depth == 0)
+        STAT_ADD(phase_ns[phase], stats_clock() - t0);
+}
+
+void stats_access(uint64_t off, uint64_t len, int write) {
+    uint64_t prev = __atomic_exchange_n(&fs_stats.last_end, off + len,
+                                        __ATOMIC_RELAXED);
+    if (prev != off) STAT_ADD(seeks, 1);
+    if (write) STAT_ADD(bytes_written, len);
+    else       STAT_ADD(bytes_read, len);
+}
+
+void print_stats(FILE *out, int json) {
+    static const char *phase_names[PH_COUNT] = {
+        "superblock", "resolve", "fat", "copy", "commit"
+    };
+    const fs_stats_t *st = &fs_stats;
+    double wall_ms = st->start_ns ? (stats_clock() - st->start_ns) / 1e6 : 0;
+    const struct { const char *key, *label; uint64_t v; } rows[] = {
+        { "seeks",         "seeks",         st->seeks },
+        { "read_calls",    "read calls",    st->read_calls },
+        { "write_calls",   "write calls",   st->write_calls },
+        { "copy_calls",    "copy calls",    st->copy_calls },
+        { "bytes_read",    "bytes read",    st->bytes_read },
+        { "bytes_written", "bytes written", st->bytes_written },
+        { "fat_entries",   "FAT entries",   st->fat_entries },
+        { "dir_regions",   "dir regions",   st->dir_regions },
+        { "allocations",   "allocations",   st->allocations },
+        { "alloc_blocks",  "alloc blocks",  st->alloc_blocks },
+    };
+    size_t nrows = sizeof(rows) / sizeof(rows[0]);
+    fflush(stdout);  // keep the report after the tool's own output
+
+    if (json) {
+        fprintf(out, "{\"wall_ms\":%.3f", wall_ms);
+        for (size_t i = 0; i < nrows; i++)
+            fprintf(out, ",\"%s\":%llu", rows[i].key,
+                    (unsigned long long)rows[i].v);
+        fprintf(out, ",\"phase_ms\":{");
+        for (int p = 0; p < PH_COUNT; p++)
+            fprintf(out, "%s\"%s\":%.3f", p ? "," : "", phase_names[p],
+                    st->phase_ns[p] / 1e6);
+        fprintf(out, "}}\n");
+        return;
+    }
+    fprintf(out, "--- stats ---\n");
+    fprintf(out, "%-18s %12.3f ms\n", "wall time", wall_ms);
+    for (size_t i = 0; i < nrows; i++)
+        fprintf(out, "%-18s %12llu\n", rows[i].label,
+                (unsigned long long)rows[i].v);
+    for (int p = 0; p < PH_COUNT; p++)
+        fprintf(out, "phase %-12s %12.3f ms\n", phase_names[p],
+                st->phase_ns[p] / 1e6);
+}
+
+// --- Low-level I/O helpers (fallback path) ---
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        STAT_ADD(read_calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) { errno = EIO; return -1; }
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        STAT_ADD(write_calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        STAT_ADD(write_calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+// Decode the fixed superblock fields from their on-disk layout
+static void decode_superblock(const uint8_t *raw, superblock_t *sb) {
+    memcpy(sb->fs_id, raw, FS_ID_LEN);
     sb->fs_id[FS_ID_LEN] = '\0';
+    sb->block_size  = ntohs(*(const uint16_t*)(raw + 8));
+    sb->block_count = ntohl(*(const uint32_t*)(raw + 10));
+    sb->fat_start   = ntohl(*(const uint32_t*)(raw + 14));
+    sb->fat_blocks  = ntohl(*(const uint32_t*)(raw + 18));
+    sb->root_start  = ntohl(*(const uint32_t*)(raw + 22));
+    sb->root_blocks = ntohl(*(const uint32_t*)(raw + 26));
+    sb->journal_start  = ntohl(*(const uint32_t*)(raw + 30));
+    sb->journal_blocks = ntohl(*(const uint32_t*)(raw + 34));
+}
 
-    uint16_t be16;
-    uint32_t be32;
-    if (fread(&be16, 2, 1, fp) != 1) return -1;
-    sb->block_size = ntohs(be16);
+// --- Image handle ---
+int open_image(image_t *img, const char *path, int mode) {
+    // Every exit closes the phase that is timing at that point
+    int phase = PH_SUPERBLOCK;
+    uint64_t t0 = phase_begin();
+    memset(img, 0, sizeof(*img));
+    img->writable = (mode == IMG_RDWR);
+    img->fd = open(path, img->writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) goto fail;
 
-    if (fread(&be32, 4, 1, fp) != 1) return -1;
-    sb->block_count = ntohl(be32);
+    struct stat st;
+    if (fstat(img->fd, &st) != 0) goto fail;
+    if (st.st_size < SUPERBLOCK_SIZE) { errno = EINVAL; goto fail; }
+    img->size = (size_t)st.st_size;
 
-    if (fread(&be32, 4, 1, fp) != 1) return -1;
-    sb->fat_start = ntohl(be32);
+    if (!getenv("CSC360FS_NO_MMAP")) {
+        int prot = PROT_READ | (img->writable ? PROT_WRITE : 0);
+        void *m = mmap(NULL, img->size, prot, MAP_SHARED, img->fd, 0);
+        if (m != MAP_FAILED) img->map = m;
+    }
 
-    if (fread(&be32, 4, 1, fp) != 1) return -1;
-    sb->fat_blocks = ntohl(be32);
+    if (img->map) {
+        img->raw_sb = img->map;
+    } else {
+        img->raw_sb = malloc(SUPERBLOCK_SIZE);
+        if (!img->raw_sb) goto fail;
+        if (pread_full(img->fd, img->raw_sb, SUPERBLOCK_SIZE, 0) != 0)
+            goto fail;
+    }
+    decode_superblock(img->raw_sb, &img->sb);
+    stats_access(0, SUPERBLOCK_SIZE, 0);
+
+    // Sanity-check the geometry before handing out pointers into it
+    const superblock_t *sb = &img->sb;
+    uint64_t fat_off = (uint64_t)sb->fat_start * sb->block_size;
+    uint64_t fat_len = (uint64_t)sb->fat_blocks * sb->block_size;
+    if (sb->block_size < 64 || sb->block_size % 64 != 0 ||
+        fat_off + fat_len > img->size)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+    img->fat_entries = (uint32_t)(fat_len / 4);
+
+    // A journal region that does not lie clear of the FAT, inside the
+    // image, is not one this code wrote; leave it alone
+    uint64_t jn_end = (uint64_t)sb->journal_start + sb->journal_blocks;
+    if (sb->journal_blocks < 2 ||
+        sb->journal_start < sb->fat_start + sb->fat_blocks ||
+        jn_end > sb->block_count || jn_end * sb->block_size > img->size)
+        img->sb.journal_start = img->sb.journal_blocks = 0;
+    phase_end(phase, t0);
 
-    if (fread(&be32, 4, 1, fp) != 1) return -1;
-    sb->root_start = ntohl(be32);
+    phase = PH_FAT;
+    t0 = phase_begin();
+    if (img->map) {
+        img->fat = img->map + fat_off;
+    } else {
+        img->fat = malloc(fat_len);
+        if (!img->fat) goto fail;
+        if (pread_full(img->fd, img->fat, fat_len, fat_off) != 0)
+            goto fail;
+        stats_access(fat_off, fat_len, 0);
+    }
+    phase_end(phase, t0);
 
-    if (fread(&be32, 4, 1, fp) != 1) return -1;
-    sb->root_blocks = ntohl(be32);
+    // Finish (or overlay) a commit a crash cut short
+    phase = PH_COMMIT;
+    t0 = phase_begin();
+    int applied = open_journal(img);
+    if (applied < 0) goto fail;
+    if (applied) decode_superblock(img->raw_sb, &img->sb);
+    phase_end(phase, t0);
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        close_image(img);
+        errno = saved;
+    }
+    phase_end(phase, t0);
+    return -1;
+}
+
+// Write back anything held outside the mapping.  With a MAP_SHARED
+// mapping, stores are already visible through the page cache.
+int sync_image(image_t *img) {
+    if (img->map || !img->writable || !img->fat_dirty) return 0;
+    uint64_t fat_off = (uint64_t)img->sb.fat_start * img->sb.block_size;
+    if (pwrite_full(img->fd, img->fat, (size_t)img->fat_entries * 4,
+                    fat_off) != 0)
+        return -1;
+    stats_access(fat_off, (uint64_t)img->fat_entries * 4, 1);
+    img->fat_dirty = 0;
+    return 0;
+}
+
+int close_image(image_t *img) {
+    int rc = 0;
+    if (img->fd >= 0 && close_journal(img) != 0) rc = -1;
+    if (img->fd >= 0 && sync_image(img) != 0) rc = -1;
+    if (img->map) munmap(img->map, img->size);
+    if (!img->map || img->meta_copied) {
+        free(img->raw_sb);
+        free(img->fat);
+    }
+    if (img->fd >= 0 && close(img->fd) != 0) rc = -1;
+    img->map = NULL;
+    img->raw_sb = NULL;
+    img->fat = NULL;
+    img->fd = -1;
+    return rc;
+}
 
+int read_image(image_t *img, uint64_t off, void *buf, size_t len) {
+    if (off > img->size || len > img->size - off) {
+        errno = EINVAL;
+        return -1;
+    }
+    stats_access(off, len, 0);
+    if (img->map) memcpy(buf, img->map + off, len);
+    else if (pread_full(img->fd, buf, len, off) != 0) return -1;
+    if (img->jn.count) staged_read(img, off, buf, len);
+    return 0;
+}
+
+int write_image(image_t *img, uint64_t off, const void *buf, size_t len) {
+    if (!img->writable) { errno = EBADF; return -1; }
+    if (off > img->size || len > img->size - off) {
+        errno = EINVAL;
+        return -1;
+    }
+    stats_access(off, len, 1);
+    // A staged block freed and reused (say, for file data) must not
+    // have its old contents copied home over these
+    if (img->jn.count) staged_write(img, off, buf, len);
+    if (img->map) {
+        memcpy(img->map + off, buf, len);
+        return 0;
+    }
+    return pwrite_full(img->fd, buf, len, off);
+}
+
+int fsync_image(image_t *img) {
+    if (img->map && msync(img->map, img->size, MS_SYNC) != 0) return -1;
+    if (sync_image(img) != 0) return -1;
+    return fsync(img->fd);
+}
+
+uint8_t *block_ptr(image_t *img, uint32_t block) {
+    uint64_t off = (uint64_t)block * img->sb.block_size;
+    if (!img->map || off + img->sb.block_size > img->size) return NULL;
+    return img->map + off;
+}
+
+uint32_t get_fat_entry(const image_t *img, uint32_t idx) {
+    return ntohl(((const uint32_t*)img->fat)[idx]);
+}
+
+void set_fat_entry(image_t *img, uint32_t idx, uint32_t val) {
+    ((uint32_t*)img->fat)[idx] = htonl(val);
+    img->fat_dirty = 1;
+}
+
+// --- In-memory FAT cache ---
+// Never hand out blocks that lie past the image or the superblock's
+// block count, even if the FAT has room for them.
+static uint32_t usable_blocks(const image_t *img) {
+    const superblock_t *sb = &img->sb;
+    uint64_t in_image = img->size / sb->block_size;
+    uint32_t n = img->fat_entries;
+    if (sb->block_count < n) n = sb->block_count;
+    if (in_image < n) n = (uint32_t)in_image;
+    return n;
+}
+
+// Smallest region size (at least one bitmap word) that covers nblocks
+// with SUMMARY_REGIONS regions
+static uint32_t region_shift(uint32_t nblocks) {
+    uint32_t shift = 6;
+    while ((((uint64_t)nblocks + (1ULL << shift) - 1) >> shift) >
+           SUMMARY_REGIONS)
+        shift++;
+    return shift;
+}
+
+static void check_summary(const image_t *img, fat_cache_t *fc);
+
+int load_fat(image_t *img, fat_cache_t *fc) {
+    uint64_t t0 = phase_begin();
+    const superblock_t *sb = &img->sb;
+    memset(fc, 0, sizeof(*fc));
+    fc->nentries   = img->fat_entries;
+    fc->per_block  = sb->block_size / 4;
+    fc->fat_blocks = sb->fat_blocks;
+    fc->nblocks    = usable_blocks(img);
+
+    size_t words = (fc->nblocks + 63) / 64;
+    fc->entries  = malloc((size_t)fc->nentries * 4 + 1);
+    fc->free_map = calloc(words + 1, sizeof(uint64_t));
+    fc->dirty    = calloc(fc->fat_blocks + 1, 1);
+    if (!fc->entries || !fc->free_map || !fc->dirty) {
+        free_fat(fc);
+        phase_end(PH_FAT, t0);
+        return -1;
+    }
+
+    // img->fat is either the mapping or the bulk copy made at open time
+    const uint32_t *raw = (const uint32_t*)img->fat;
+    if (img->map)
+        stats_access((uint64_t)sb->fat_start * sb->block_size,
+                     (uint64_t)fc->nentries * 4, 0);
+    for (uint32_t i = 0; i < fc->nentries; i++) {
+        uint32_t v = ntohl(raw[i]);
+        fc->entries[i] = v;
+        if (v == FAT_FREE) {
+            fc->n_free++;
+            if (i < fc->nblocks) {
+                fc->free_map[i / 64] |= 1ULL << (i % 64);
+                fc->free_count++;
+            }
+        } else if (v == FAT_RESERVED) {
+            fc->n_reserved++;
+        } else {
+            fc->n_alloc++;
+        }
+    }
+    STAT_ADD(fat_entries, fc->nentries);
+
+    fc->region_shift = region_shift(fc->nblocks);
+    for (size_t w = 0; w < words; w++)
+        fc->region_free[w >> (fc->region_shift - 6)] +=
+            (uint32_t)__builtin_popcountll(fc->free_map[w]);
+    check_summary(img, fc);
+    phase_end(PH_FAT, t0);
+    return 0;
+}
+
+uint32_t fat_get(const fat_cache_t *fc, uint32_t idx) {
+    return idx < fc->nentries ? fc->entries[idx] : FAT_EOF;
+}
+
+void fat_set(fat_cache_t *fc, uint32_t idx, uint32_t val) {
+    if (idx >= fc->nentries) return;
+    uint32_t old = fc->entries[idx];
+    fc->entries[idx] = val;
+
+    uint32_t *hist[3] = { &fc->n_free, &fc->n_reserved, &fc->n_alloc };
+    (*hist[old < 2 ? old : 2])--;
+    (*hist[val < 2 ? val : 2])++;
+    if (idx < fc->nblocks && (old == FAT_FREE) != (val == FAT_FREE)) {
+        if (val == FAT_FREE) {
+            fc->free_map[idx / 64] |= 1ULL << (idx % 64);
+            fc->free_count++;
+            fc->region_free[idx >> fc->region_shift]++;
+            if (idx < fc->next_free) fc->next_free = idx;
+        } else {
+            fc->free_map[idx / 64] &= ~(1ULL << (idx % 64));
+            fc->free_count--;
+            fc->region_free[idx >> fc->region_shift]--;
+        }
+    }
+    fc->dirty[idx / fc->per_block] = 1;
+    STAT_ADD(fat_entries, 1);
+}
+
+// First index >= from whose free bit equals want_free, or nblocks
+static uint32_t scan_bits(const fat_cache_t *fc, uint32_t from, int want_free) {
+    if (from >= fc->nblocks) return fc->nblocks;
+    size_t words = (fc->nblocks + 63) / 64;
+    size_t w = from / 64;
+    const uint32_t word_shift = fc->region_shift - 6;  // words per region
+    const size_t region_mask = ((size_t)1 << word_shift) - 1;
+    uint64_t bits = want_free ? fc->free_map[w] : ~fc->free_map[w];
+    bits &= ~0ULL << (from % 64);
+    for (;;) {
+        if (bits) {
+            uint32_t i = (uint32_t)(w * 64 + __builtin_ctzll(bits));
+            return i < fc->nblocks ? i : fc->nblocks;
+        }
+        if (++w >= words) return fc->nblocks;
+        // Regions with nothing free are skipped whole
+        if (want_free && (w & region_mask) == 0) {
+            while (w < words && fc->region_free[w >> word_shift] == 0)
+                w += region_mask + 1;
+            if (w >= words) return fc->nblocks;
+        }
+        bits = want_free ? fc->free_map[w] : ~fc->free_map[w];
+    }
+}
+
+// First free block at or after `from`, wrapping around once
+static uint32_t find_free(const fat_cache_t *fc, uint32_t from) {
+    if (fc->free_count == 0) return FAT_EOF;
+    uint32_t b = scan_bits(fc, from, 1);
+    if (b == fc->nblocks) b = scan_bits(fc, 0, 1);
+    return b < fc->nblocks ? b : FAT_EOF;
+}
+
+static uint32_t alloc_one(fat_cache_t *fc) {
+    uint32_t b = find_free(fc, fc->next_free);
+    if (b == FAT_EOF) return FAT_EOF;
+    fat_set(fc, b, FAT_EOF);
+    fc->next_free = b + 1;
+    return b;
+}
+
+uint32_t fat_alloc(fat_cache_t *fc) {
+    uint32_t b = alloc_one(fc);
+    STAT_ADD(allocations, 1);
+    if (b != FAT_EOF) STAT_ADD(alloc_blocks, 1);
+    return b;
+}
+
+// Smallest run of free blocks that holds n (lowest address on ties).
+// Returns the run start, or FAT_EOF if no single run is big enough.
+static uint32_t best_fit_run(const fat_cache_t *fc, uint32_t n) {
+    uint32_t best = FAT_EOF, best_len = UINT32_MAX;
+    uint32_t b = scan_bits(fc, 0, 1);
+    while (b < fc->nblocks) {
+        uint32_t e = scan_bits(fc, b, 0);
+        uint32_t len = e - b;
+        if (len >= n && len < best_len) {
+            best = b;
+            best_len = len;
+            if (len == n) break;
+        }
+        b = scan_bits(fc, e, 1);
+    }
+    return best;
+}
+
+// Claim blocks run..run+n-1 as one linked chain
+static void take_run(fat_cache_t *fc, uint32_t run, uint32_t n,
+                     uint32_t *chain)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        chain[i] = run + i;
+        fat_set(fc, chain[i], i + 1 < n ? run + i + 1 : FAT_EOF);
+    }
+    fc->next_free = run + n;
+}
+
+uint32_t fat_first_run(const fat_cache_t *fc, uint32_t n) {
+    return fat_run_from(fc, 0, n);
+}
+
+uint32_t fat_run_from(const fat_cache_t *fc, uint32_t from, uint32_t n) {
+    if (n == 0 || n > fc->free_count) return FAT_EOF;
+    uint32_t b = scan_bits(fc, from, 1);
+    while (b < fc->nblocks) {
+        uint32_t e = scan_bits(fc, b, 0);
+        if (e - b >= n) return b;
+        b = scan_bits(fc, e, 1);
+    }
+    return FAT_EOF;
+}
+
+uint32_t fat_next_free(const fat_cache_t *fc, uint32_t from) {
+    uint32_t b = scan_bits(fc, from, 1);
+    return b < fc->nblocks ? b : FAT_EOF;
+}
+
+uint32_t fat_largest_run(const fat_cache_t *fc, uint32_t *len) {
+    uint32_t best = FAT_EOF, best_len = 0;
+    uint32_t b = scan_bits(fc, 0, 1);
+    while (b < fc->nblocks) {
+        uint32_t e = scan_bits(fc, b, 0);
+        if (e - b > best_len) {
+            best = b;
+            best_len = e - b;
+        }
+        b = scan_bits(fc, e, 1);
+    }
+    *len = best_len;
+    return best;
+}
+
+uint32_t fat_free_run(const fat_cache_t *fc, uint32_t from) {
+    if (from >= fc->nblocks || fat_get(fc, from) != FAT_FREE) return 0;
+    return scan_bits(fc, from, 0) - from;
+}
+
+void fat_take_run(fat_cache_t *fc, uint32_t run, uint32_t n, uint32_t *chain) {
+    STAT_ADD(allocations, 1);
+    STAT_ADD(alloc_blocks, n);
+    take_run(fc, run, n, chain);
+}
+
+int fat_alloc_chain(fat_cache_t *fc, uint32_t n, uint32_t *chain) {
+    STAT_ADD(allocations, 1);
+    if (n > fc->free_count) { errno = ENOSPC; return -1; }
+    if (n == 0) return 0;
+    STAT_ADD(alloc_blocks, n);
+
+    // Prefer one contiguous extent; first-fit from the cursor otherwise
+    uint32_t run = best_fit_run(fc, n);
+    if (run != FAT_EOF) {
+        take_run(fc, run, n, chain);
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        chain[i] = alloc_one(fc);
+        if (i > 0) fat_set(fc, chain[i-1], chain[i]);
+    }
+    return 0;
+}
+
+int fat_alloc_run(fat_cache_t *fc, uint32_t n, uint32_t *chain) {
+    STAT_ADD(allocations, 1);
+    if (n == 0) return 0;
+    uint32_t run = n <= fc->free_count ? best_fit_run(fc, n) : FAT_EOF;
+    if (run == FAT_EOF) { errno = ENOSPC; return -1; }
+    STAT_ADD(alloc_blocks, n);
+    take_run(fc, run, n, chain);
+    return 0;
+}
+
+int fat_extend_chain(fat_cache_t *fc, uint32_t last, uint32_t n,
+                     uint32_t *chain)
+{
+    if (n == 0) return 0;
+    if (last + 1 < fc->nblocks && fat_get(fc, last + 1) == FAT_FREE &&
+        scan_bits(fc, last + 1, 0) - (last + 1) >= n)
+        fat_take_run(fc, last + 1, n, chain);
+    else if (fat_alloc_chain(fc, n, chain) != 0)
+        return -1;
+    fat_set(fc, last, chain[0]);
+    return 0;
+}
+
+uint32_t count_extents(const uint32_t *chain, uint32_t n) {
+    uint32_t extents = n ? 1 : 0;
+    for (uint32_t i = 1; i < n; i++)
+        if (chain[i] != chain[i-1] + 1) extents++;
+    return extents;
+}
+
+// Write back dirty FAT blocks, coalescing adjacent ones into one write,
+// and the free-space summary after them
+int flush_fat(image_t *img, fat_cache_t *fc) {
+    if (!img->writable) { errno = EBADF; return -1; }
+    uint64_t t0 = phase_begin();
+    int rc = 0;
+    uint32_t *raw = (uint32_t*)img->fat;
+    size_t bs = img->sb.block_size;
+    uint64_t fat_off = (uint64_t)img->sb.fat_start * bs;
+
+    uint32_t b = 0;
+    while (b < fc->fat_blocks && !fc->dirty[b]) b++;
+    if (b == fc->fat_blocks && fc->summary == SUMMARY_OK) {
+        phase_end(PH_COMMIT, t0);
+        return 0;
+    }
+    if (b < fc->fat_blocks && clear_space_summary(img) != 0) rc = -1;
+
+    while (rc == 0 && b < fc->fat_blocks) {
+        if (!fc->dirty[b]) { b++; continue; }
+        uint32_t run = b;
+        while (run < fc->fat_blocks && fc->dirty[run]) {
+            uint32_t first = run * fc->per_block;
+            for (uint32_t i = first; i < first + fc->per_block; i++)
+                raw[i] = htonl(fc->entries[i]);
+            fc->dirty[run++] = 0;
+        }
+        STAT_ADD(fat_entries, (uint64_t)(run - b) * fc->per_block);
+        stats_access(fat_off + (uint64_t)b * bs, (uint64_t)(run - b) * bs, 1);
+        if (!img->map &&
+            pwrite_full(img->fd, img->fat + (size_t)b * bs,
+                        (size_t)(run - b) * bs, fat_off + (uint64_t)b * bs) != 0)
+        {
+            rc = -1;
+            break;
+        }
+        b = run;
+    }
+    if (rc == 0) rc = write_space_summary(img, fc, 0);
+    phase_end(PH_COMMIT, t0);
+    return rc;
+}
+
+void free_fat(fat_cache_t *fc) {
+    free(fc->entries);
+    free(fc->free_map);
+    free(fc->dirty);
+    memset(fc, 0, sizeof(*fc));
+}
+
+// --- Free-space summary ---
+#define SUMMARY_MAGIC "FSUM"
+
+// FNV-1a over the geometry the summary depends on and the summary
+// itself past its checksum
+static uint32_t summary_sum(const uint8_t *raw_sb, const uint8_t *sum) {
+    uint32_t h = 2166136261u;
+    for (int i = 8; i < 26; i++) h = (h ^ raw_sb[i]) * 16777619u;
+    for (int i = 8; i < SUMMARY_LEN; i++) h = (h ^ sum[i]) * 16777619u;
+    return h;
+}
+
+// Small blocks can put the FAT or root inside the superblock's 512
+// bytes; such images keep no summary
+static int summary_fits(const image_t *img) {
+    const superblock_t *sb = &img->sb;
+    uint32_t first = sb->fat_start < sb->root_start ? sb->fat_start
+                                                    : sb->root_start;
+    if (sb->journal_blocks && sb->journal_start < first)
+        first = sb->journal_start;
+    return (uint64_t)first * sb->block_size >= SUMMARY_OFF + SUMMARY_LEN;
+}
+
+// Decode and sanity-check the summary without looking at the FAT
+static int decode_summary(const image_t *img, space_summary_t *out) {
+    if (!img->raw_sb || !summary_fits(img)) return -1;
+    const uint8_t *p = img->raw_sb + SUMMARY_OFF;
+    if (memcmp(p, SUMMARY_MAGIC, 4) != 0 ||
+        get_be32(p + 4) != summary_sum(img->raw_sb, p))
+        return -1;
+    out->n_free        = get_be32(p + 8);
+    out->n_reserved    = get_be32(p + 12);
+    out->n_alloc       = get_be32(p + 16);
+    out->next_free     = get_be32(p + 20);
+    out->first_free    = get_be32(p + 24);
+    out->region_blocks = get_be32(p + 28);
+
+    // The counts must add up, and the map must be the one this image's
+    // geometry gives
+    uint64_t total = (uint64_t)out->n_free + out->n_reserved + out->n_alloc;
+    if (total != img->fat_entries ||
+        out->region_blocks != 1u << region_shift(usable_blocks(img)))
+        return -1;
+    uint64_t mapped = 0;
+    for (int r = 0; r < SUMMARY_REGIONS; r++) {
+        out->region_free[r] = get_be32(p + 32 + 4 * r);
+        if (out->region_free[r] > out->region_blocks) return -1;
+        mapped += out->region_free[r];
+    }
+    return mapped <= out->n_free ? 0 : -1;
+}
+
+int read_space_summary(const image_t *img, space_summary_t *out) {
+    if (decode_summary(img, out) != 0) return -1;
+
+    // A writer that skipped the summary and allocated first-fit took the
+    // lowest free entry; one FAT word tells whether that happened
+    if (out->first_free == FAT_EOF) return out->n_free == 0 ? 0 : -1;
+    if (!img->fat || out->first_free >= img->fat_entries ||
+        out->n_free == 0)
+        return -1;
+    const uint32_t *raw = (const uint32_t*)img->fat;
+    return ntohl(raw[out->first_free]) == FAT_FREE ? 0 : -1;
+}
+
+// Lowest free FAT entry, or FAT_EOF; entries past the usable blocks are
+// outside the free map and few, so they are looked at one by one
+static uint32_t lowest_free(const fat_cache_t *fc) {
+    uint32_t b = scan_bits(fc, 0, 1);
+    if (b < fc->nblocks) return b;
+    for (uint32_t i = fc->nblocks; i < fc->nentries; i++)
+        if (fc->entries[i] == FAT_FREE) return i;
+    return FAT_EOF;
+}
+
+// Compare the image's summary with the FAT just loaded, and resume
+// allocating where the last writer stopped if they agree
+static void check_summary(const image_t *img, fat_cache_t *fc) {
+    space_summary_t s;
+    if (decode_summary(img, &s) != 0) {
+        fc->summary = SUMMARY_MISSING;
+        return;
+    }
+    if (s.n_free != fc->n_free || s.n_reserved != fc->n_reserved ||
+        s.n_alloc != fc->n_alloc || s.first_free != lowest_free(fc) ||
+        memcmp(s.region_free, fc->region_free, sizeof(s.region_free)) != 0)
+    {
+        fc->summary = SUMMARY_STALE;
+        return;
+    }
+    fc->summary = SUMMARY_OK;
+    if (s.next_free < fc->nblocks) fc->next_free = s.next_free;
+}
+
+static int put_summary(image_t *img, const uint8_t *buf, size_t len,
+                       int staged)
+{
+    int rc = staged ? write_meta(img, SUMMARY_OFF, buf, len)
+                    : write_image(img, SUMMARY_OFF, buf, len);
+    if (rc == 0 && !img->map) memcpy(img->raw_sb + SUMMARY_OFF, buf, len);
+    return rc;
+}
+
+int write_space_summary(image_t *img, fat_cache_t *fc, int staged) {
+    if (!summary_fits(img)) return 0;
+    uint8_t buf[SUMMARY_LEN];
+    memcpy(buf, SUMMARY_MAGIC, 4);
+    put_be32(buf + 8, fc->n_free);
+    put_be32(buf + 12, fc->n_reserved);
+    put_be32(buf + 16, fc->n_alloc);
+    put_be32(buf + 20, fc->next_free);
+    put_be32(buf + 24, lowest_free(fc));
+    put_be32(buf + 28, 1u << fc->region_shift);
+    for (int r = 0; r < SUMMARY_REGIONS; r++)
+        put_be32(buf + 32 + 4 * r, fc->region_free[r]);
+    put_be32(buf + 4, summary_sum(img->raw_sb, buf));
+    if (put_summary(img, buf, sizeof(buf), staged) != 0) return -1;
+    fc->summary = SUMMARY_OK;
+    return 0;
+}
+
+int clear_space_summary(image_t *img) {
+    static const uint8_t none[4];
+    if (!summary_fits(img)) return 0;
+    return put_summary(img, none, sizeof(none), 0);
+}
+
+// --- Extents ---
+static uint32_t fat_link(const image_t *img, const fat_cache_t *fc,
+                         uint32_t block)
+{
+    return fc ? fat_get(fc, block) : get_fat_entry(img, block);
+}
+
+int chain_extents(image_t *img, const fat_cache_t *fc,
+                  uint32_t start, uint32_t max_blocks, extent_t **out)
+{
+    *out = NULL;
+    if (max_blocks == 0) return 0;
+
+    int cap = 8, n = 0;
+    extent_t *ext = malloc(cap * sizeof(extent_t));
+    if (!ext) return -1;
+
+    uint32_t block = start;
+    for (uint32_t i = 0; i < max_blocks; i++) {
+        // Free and reserved links would walk into the superblock
+        if (block <= FAT_RESERVED || block >= img->fat_entries ||
+            block >= img->sb.block_count)
+        {
+            free(ext);
+            errno = EIO;
+            return -1;
+        }
+        if (n > 0 && ext[n-1].start + ext[n-1].count == block) {
+            ext[n-1].count++;
+        } else {
+            if (n == cap) {
+                extent_t *grown = realloc(ext, 2 * cap * sizeof(extent_t));
+                if (!grown) { free(ext); return -1; }
+                ext = grown;
+                cap *= 2;
+            }
+            ext[n].start = block;
+            ext[n].count = 1;
+            n++;
+        }
+        block = fat_link(img, fc, block);
+        STAT_ADD(fat_entries, 1);
+        if (block == FAT_EOF) break;
+    }
+    *out = ext;
+    return n;
+}
+
+int copy_image_range(image_t *img, uint64_t off, uint64_t len, int out_fd) {
+    if (off > img->size || len > img->size - off) {
+        errno = EINVAL;
+        return -1;
+    }
+    stats_access(off, len, 0);
+#ifdef __linux__
+    // In-kernel copies; either may be unsupported for this pair of
+    // files, in which case we drop to the next method for the rest.
+    loff_t in_off = (loff_t)off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(img->fd, &in_off, out_fd, NULL, len, 0);
+        STAT_ADD(copy_calls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= n;
+    }
+    off_t sf_off = (off_t)in_off;
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, img->fd, &sf_off, len);
+        STAT_ADD(copy_calls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= n;
+    }
+    off = (uint64_t)sf_off;
+#endif
+    if (len == 0) return 0;
+    if (img->map) return write_full(out_fd, img->map + off, len);
+
+    uint8_t *buf = malloc(len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE);
+    if (!buf) return -1;
+    while (len > 0) {
+        size_t chunk = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+        if (pread_full(img->fd, buf, chunk, off) != 0 ||
+            write_full(out_fd, buf, chunk) != 0)
+        {
+            free(buf);
+            return -1;
+        }
+        off += chunk;
+        len -= chunk;
+    }
+    free(buf);
+    return 0;
+}
+
+// --- Superblock reader ---
+int read_superblock(image_t *img, superblock_t *sb) {
+    if (!img->raw_sb) return -1;
+    *sb = img->sb;
+    return 0;
+}
+
+int set_root_blocks(image_t *img, uint32_t blocks) {
+    uint8_t be[4] = { blocks >> 24, blocks >> 16, blocks >> 8, (uint8_t)blocks };
+    if (write_meta(img, 26, be, sizeof(be)) != 0) return -1;
+    if (!img->map) memcpy(img->raw_sb + 26, be, sizeof(be));
+    img->sb.root_blocks = blocks;
     return 0;
 }
 
 // --- FAT analyzer ---
-int analyze_fat(FILE *fp,
+// Entries are compared in on-disk (big-endian) form against 0 and the
+// big-endian encoding of 1, so no per-entry byte swap is needed.  The
+// widest kernel the CPU supports is picked once at runtime; large FATs
+// are split across threads and the per-thread counts summed.
+#define FAT_MT_MIN_ENTRIES (1u << 22)
+#define FAT_MT_MAX_THREADS 16
+
+typedef void (*fat_count_fn)(const uint32_t *fat, size_t n,
+                             uint64_t *free_c, uint64_t *res_c);
+
+static void count_fat_scalar(const uint32_t *fat, size_t n,
+                             uint64_t *free_c, uint64_t *res_c)
+{
+    const uint32_t one_be = htonl(FAT_RESERVED);
+    uint64_t f = 0, r = 0;
+    for (size_t i = 0; i < n; i++) {
+        f += (fat[i] == 0);
+        r += (fat[i] == one_be);
+    }
+    *free_c = f;
+    *res_c  = r;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void count_fat_avx2(const uint32_t *fat, size_t n,
+                           uint64_t *free_c, uint64_t *res_c)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one  = _mm256_set1_epi32((int)htonl(FAT_RESERVED));
+    __m256i acc_f = zero, acc_r = zero;
+    size_t i = 0;
+
+    // Matching lanes compare to -1, so subtracting counts them; a lane
+    // sees at most n/8 < 2^32 hits.
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(fat + i));
+        acc_f = _mm256_sub_epi32(acc_f, _mm256_cmpeq_epi32(v, zero));
+        acc_r = _mm256_sub_epi32(acc_r, _mm256_cmpeq_epi32(v, one));
+    }
+
+    uint32_t lf[8], lr[8];
+    _mm256_storeu_si256((__m256i*)lf, acc_f);
+    _mm256_storeu_si256((__m256i*)lr, acc_r);
+    uint64_t f = 0, r = 0;
+    for (int k = 0; k < 8; k++) { f += lf[k]; r += lr[k]; }
+
+    uint64_t tf, tr;
+    count_fat_scalar(fat + i, n - i, &tf, &tr);
+    *free_c = f + tf;
+    *res_c  = r + tr;
+}
+
+__attribute__((target("avx512f")))
+static void count_fat_avx512(const uint32_t *fat, size_t n,
+                             uint64_t *free_c, uint64_t *res_c)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one  = _mm512_set1_epi32((int)htonl(FAT_RESERVED));
+    uint64_t f = 0, r = 0;
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_loadu_si512((const void*)(fat + i));
+        f += __builtin_popcount(_mm512_cmpeq_epi32_mask(v, zero));
+        r += __builtin_popcount(_mm512_cmpeq_epi32_mask(v, one));
+    }
+
+    uint64_t tf, tr;
+    count_fat_scalar(fat + i, n - i, &tf, &tr);
+    *free_c = f + tf;
+    *res_c  = r + tr;
+}
+#endif
+
+static fat_count_fn count_fat_kernel;
+static pthread_once_t count_fat_once = PTHREAD_ONCE_INIT;
+
+static void pick_count_fat_kernel(void) {
+    count_fat_kernel = count_fat_scalar;
+    if (getenv("CSC360FS_NO_SIMD")) return;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        count_fat_kernel = count_fat_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        count_fat_kernel = count_fat_avx2;
+#endif
+}
+
+typedef struct {
+    const uint32_t *fat;
+    size_t          n;
+    uint64_t        free_c;
+    uint64_t        res_c;
+} fat_count_job_t;
+
+static void *count_fat_worker(void *arg) {
+    fat_count_job_t *job = arg;
+    count_fat_kernel(job->fat, job->n, &job->free_c, &job->res_c);
+    return NULL;
+}
+
+static void count_fat(const uint32_t *fat, size_t n,
+                      uint64_t *free_c, uint64_t *res_c)
+{
+    pthread_once(&count_fat_once, pick_count_fat_kernel);
+
+    // Each thread gets at least a quarter of the threshold
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = cpus > 0 ? (size_t)cpus : 1;
+    if (nthreads > FAT_MT_MAX_THREADS) nthreads = FAT_MT_MAX_THREADS;
+    if (nthreads > n / (FAT_MT_MIN_ENTRIES / 4))
+        nthreads = n / (FAT_MT_MIN_ENTRIES / 4);
+    if (n < FAT_MT_MIN_ENTRIES || nthreads < 2) {
+        count_fat_kernel(fat, n, free_c, res_c);
+        return;
+    }
+
+    fat_count_job_t jobs[FAT_MT_MAX_THREADS];
+    pthread_t tids[FAT_MT_MAX_THREADS];
+    int started[FAT_MT_MAX_THREADS] = {0};
+    size_t slice = (n / nthreads + 15) & ~(size_t)15;
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t lo = t * slice < n ? t * slice : n;
+        size_t hi = (t + 1 == nthreads || lo + slice > n) ? n : lo + slice;
+        jobs[t] = (fat_count_job_t){ fat + lo, hi - lo, 0, 0 };
+        // The calling thread takes the last slice itself
+        if (t + 1 < nthreads &&
+            pthread_create(&tids[t], NULL, count_fat_worker, &jobs[t]) == 0)
+            started[t] = 1;
+        else
+            count_fat_worker(&jobs[t]);
+    }
+
+    *free_c = *res_c = 0;
+    for (size_t t = 0; t < nthreads; t++) {
+        if (started[t]) pthread_join(tids[t], NULL);
+        *free_c += jobs[t].free_c;
+        *res_c  += jobs[t].res_c;
+    }
+}
+
+int analyze_fat(image_t *img,
                 const superblock_t *sb,
                 uint32_t *free_cnt,
                 uint32_t *reserved_cnt,
@@ -42,63 +1026,689 @@ int analyze_fat(FILE *fp,
     *free_cnt = *reserved_cnt = *alloc_cnt = 0;
     uint32_t entries_per_block = sb->block_size / 4;
     uint32_t total_entries     = entries_per_block * sb->fat_blocks;
+    if (!img->fat || total_entries > img->fat_entries) return -1;
 
-    if (fseek(fp, (long)sb->fat_start * sb->block_size, SEEK_SET) != 0)
-        return -1;
+    uint64_t t0 = phase_begin();
+    if (img->map)
+        stats_access((uint64_t)sb->fat_start * sb->block_size,
+                     (uint64_t)total_entries * 4, 0);
+    uint64_t free_c, res_c;
+    count_fat((const uint32_t*)img->fat, total_entries, &free_c, &res_c);
+    *free_cnt     = (uint32_t)free_c;
+    *reserved_cnt = (uint32_t)res_c;
+    *alloc_cnt    = total_entries - *free_cnt - *reserved_cnt;
+    STAT_ADD(fat_entries, total_entries);
+    phase_end(PH_FAT, t0);
+    return 0;
+}
 
-    for (uint32_t i = 0; i < total_entries; i++) {
-        uint32_t val_be;
-        if (fread(&val_be, 4, 1, fp) != 1) return -1;
-        uint32_t val = ntohl(val_be);
-        if (val == 0x00000000)
-            (*free_cnt)++;
-        else if (val == 0x00000001)
-            (*reserved_cnt)++;
-        else
-            (*alloc_cnt)++;
+// --- Directory‐entry codec ---
+void decode_dir_entry(const uint8_t raw[DIR_ENTRY_SIZE], dir_entry_t *e) {
+    e->status      = raw[0];
+    e->start_block = ntohl(*(const uint32_t*)(raw + 1));
+    e->block_count = ntohl(*(const uint32_t*)(raw + 5));
+    e->file_size   = ntohl(*(const uint32_t*)(raw + 9));
+    memcpy(e->ctime, raw + 13, 7);
+    memcpy(e->mtime, raw + 20, 7);
+    memcpy(e->name,  raw + 27, MAX_NAME_LEN);
+    e->name[MAX_NAME_LEN] = '\0';
+}
+
+void encode_dir_entry(const dir_entry_t *e, uint8_t raw[DIR_ENTRY_SIZE]) {
+    memset(raw, 0xFF, DIR_ENTRY_SIZE);
+    raw[0] = e->status;
+    *(uint32_t*)(raw + 1) = htonl(e->start_block);
+    *(uint32_t*)(raw + 5) = htonl(e->block_count);
+    *(uint32_t*)(raw + 9) = htonl(e->file_size);
+    memcpy(raw + 13, e->ctime, 7);
+    memcpy(raw + 20, e->mtime, 7);
+    size_t nlen = strnlen(e->name, MAX_NAME_LEN);
+    memcpy(raw + 27, e->name, nlen);
+    raw[27 + nlen] = '\0';
+}
+
+// --- Directory iterator ---
+void dir_iter_init(dir_iter_t *it, image_t *img, const fat_cache_t *fc,
+                   uint32_t dir_start, uint32_t dir_blocks)
+{
+    it->img       = img;
+    it->fc        = fc;
+    it->next      = dir_start;
+    it->left      = dir_blocks;
+    it->base      = 0;
+    it->nslots    = 0;
+    it->slot      = 0;
+    it->win       = NULL;
+    it->win_first = 0;
+    it->win_count = 0;
+    it->error     = 0;
+}
+
+// Move on to the next run of consecutive blocks in the chain; 0 at the
+// end of the directory or if the chain leaves the image
+static int next_extent(dir_iter_t *it) {
+    image_t *img = it->img;
+    uint32_t first = it->next, n = 0;
+    if (it->error || it->left == 0 || first == FAT_EOF) return 0;
+    for (uint32_t b = first; ; b++) {
+        if (b <= FAT_RESERVED || b >= img->fat_entries ||
+            b >= img->sb.block_count)
+        {
+            it->error = 1;
+            return 0;
+        }
+        uint32_t link = fat_link(img, it->fc, b);
+        STAT_ADD(fat_entries, 1);
+        n++;
+        if (--it->left == 0 || link == FAT_EOF) {
+            it->next = FAT_EOF;
+            break;
+        }
+        if (link != b + 1) {
+            it->next = link;
+            break;
+        }
+    }
+
+    const uint32_t bs = img->sb.block_size;
+    it->base      = (uint64_t)first * bs;
+    it->nslots    = (uint32_t)((uint64_t)n * bs / DIR_ENTRY_SIZE);
+    it->slot      = 0;
+    it->win       = NULL;
+    it->win_first = 0;
+    it->win_count = 0;
+
+    STAT_ADD(dir_regions, 1);
+    uint64_t len = (uint64_t)it->nslots * DIR_ENTRY_SIZE;
+    if (it->base > img->size || len > img->size - it->base) {
+        it->error = 1;
+        return 0;
+    }
+    if (img->map && !image_staged(img, it->base, len)) {
+        it->win       = img->map + it->base;
+        it->win_count = it->nslots;
+        stats_access(it->base, len, 0);
+    }
+    return 1;
+}
+
+const uint8_t *dir_iter_slot(dir_iter_t *it) {
+    while (it->slot >= it->nslots)
+        if (!next_extent(it)) return NULL;
+    if (it->slot >= it->win_first + it->win_count) {
+        uint32_t n = it->nslots - it->slot;
+        if (n > DIR_ITER_WINDOW / DIR_ENTRY_SIZE)
+            n = DIR_ITER_WINDOW / DIR_ENTRY_SIZE;
+        if (read_image(it->img, it->base + (uint64_t)it->slot * DIR_ENTRY_SIZE,
+                       it->buf, (size_t)n * DIR_ENTRY_SIZE) != 0)
+        {
+            it->error = 1;
+            it->nslots = it->slot;
+            it->left = 0;
+            return NULL;
+        }
+        it->win       = it->buf;
+        it->win_first = it->slot;
+        it->win_count = n;
+    }
+    const uint8_t *raw = it->win + (size_t)(it->slot - it->win_first)
+                                   * DIR_ENTRY_SIZE;
+    it->slot++;
+    return raw;
+}
+
+const uint8_t *dir_iter_next(dir_iter_t *it) {
+    const uint8_t *raw;
+    while ((raw = dir_iter_slot(it)) != NULL)
+        if (raw[0] & DE_IN_USE) return raw;
+    return NULL;
+}
+
+uint64_t dir_iter_offset(const dir_iter_t *it) {
+    return it->base + (uint64_t)(it->slot - 1) * DIR_ENTRY_SIZE;
+}
+
+int dirent_name_is(const uint8_t *raw, const char *name, size_t len) {
+    if (len > MAX_NAME_LEN) return 0;
+    const char *stored = dirent_name(raw);
+    return memcmp(stored, name, len) == 0 &&
+           (len == MAX_NAME_LEN || stored[len] == '\0');
+}
+
+// --- Hashed directories ---
+uint32_t dir_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint8_t *dir_hash_slot(uint8_t *table, uint32_t nslots,
+                       const char *name, size_t len)
+{
+    if (nslots == 0) return NULL;
+    uint32_t k = dir_hash(name, len) % nslots;
+    for (uint32_t i = 0; i < nslots; i++) {
+        uint8_t *raw = table + (size_t)k * DIR_ENTRY_SIZE;
+        if (!(raw[0] & DE_IN_USE)) return raw;
+        if (++k == nslots) k = 0;
     }
+    return NULL;
+}
+
+int probe_hashed(image_t *img, const fat_cache_t *fc, const dir_entry_t *dir,
+                 const char *name, size_t len, uint8_t type_mask,
+                 uint32_t max_probe, uint8_t *raw, uint64_t *off)
+{
+    const uint32_t bs = img->sb.block_size;
+    const uint32_t per_block = bs / DIR_ENTRY_SIZE;
+    uint32_t nslots = (uint32_t)((uint64_t)dir->block_count * per_block);
+    if (nslots == 0) return -1;
+    if (max_probe > nslots) max_probe = nslots;
+
+    uint8_t slot[DIR_ENTRY_SIZE];
+    if (!raw) raw = slot;
+    uint32_t k = dir_hash(name, len) % nslots;
+    uint32_t checked = UINT32_MAX;   // block index last found in the run
+    for (uint32_t i = 0; i < max_probe; i++) {
+        // Slot k sits at a fixed offset as long as the chain is one run;
+        // the FAT link of each block touched is checked to be sure
+        uint32_t bi = k / per_block;
+        uint64_t block = (uint64_t)dir->start_block + bi;
+        if (bi != checked) {
+            if (block <= FAT_RESERVED || block >= img->fat_entries ||
+                block >= img->sb.block_count)
+                return -1;
+            uint32_t want = bi + 1 < dir->block_count ? (uint32_t)block + 1
+                                                      : FAT_EOF;
+            STAT_ADD(fat_entries, 1);
+            if (fat_link(img, fc, (uint32_t)block) != want) return -1;
+            checked = bi;
+        }
+        uint64_t at = block * bs + (uint64_t)(k % per_block) * DIR_ENTRY_SIZE;
+        if (read_image(img, at, raw, DIR_ENTRY_SIZE) != 0) return -1;
+        if (!(dirent_status(raw) & DE_IN_USE)) {
+            *off = at;
+            return 0;
+        }
+        if ((dirent_status(raw) & type_mask) && dirent_name_is(raw, name, len)) {
+            *off = at;
+            return 1;
+        }
+        if (++k == nslots) k = 0;
+    }
+    *off = UINT64_MAX;
     return 0;
 }
 
-// --- Directory‐entry reader ---
-int read_dir_entries(FILE *fp,
-                     const superblock_t *sb,
-                     uint32_t dir_start,
-                     uint32_t dir_blocks,
-                     dir_entry_t **out_entries)
+// --- Lookups ---
+void root_dir_entry(const image_t *img, dir_entry_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->status      = DE_IN_USE | DE_DIR;
+    out->start_block = img->sb.root_start;
+    out->block_count = img->sb.root_blocks;
+    strcpy(out->name, "/");
+}
+
+static int find_in_dir_n(image_t *img, const fat_cache_t *fc,
+                         const dir_entry_t *dir, const char *name, size_t len,
+                         uint8_t type_mask, dir_entry_t *out, uint64_t *out_off)
 {
-    size_t buf_size = (size_t)sb->block_size * dir_blocks;
-    uint8_t *buf = malloc(buf_size);
-    if (!buf) return -1;
+    uint64_t t0 = phase_begin();
+    uint8_t slot[DIR_ENTRY_SIZE];
+    const uint8_t *raw = NULL;
+    uint64_t off = 0;
+    int err = ENOENT;
 
-    if (fseek(fp, (long)dir_start * sb->block_size, SEEK_SET) != 0 ||
-        fread(buf, 1, buf_size, fp) != buf_size)
-    {
-        free(buf);
-        return -1;
+    int hit = -1;
+    if (dir->status & DE_HASHED)
+        hit = probe_hashed(img, fc, dir, name, len, type_mask, UINT32_MAX,
+                           slot, &off);
+    if (hit == 1) {
+        raw = slot;
+    } else if (hit < 0) {
+        // Plain directory, or a hashed one that is no longer one run
+        dir_iter_t it;
+        dir_iter_init(&it, img, fc, dir->start_block, dir->block_count);
+        while ((raw = dir_iter_next(&it)) != NULL) {
+            if ((dirent_status(raw) & type_mask) &&
+                dirent_name_is(raw, name, len))
+            {
+                off = dir_iter_offset(&it);
+                break;
+            }
+        }
+        if (it.error) err = EIO;
+    }
+
+    int rc = -1;
+    if (raw) {
+        decode_dir_entry(raw, out);
+        if (out_off) *out_off = off;
+        rc = 0;
+    } else {
+        errno = err;
+    }
+    phase_end(PH_RESOLVE, t0);
+    return rc;
+}
+
+int find_in_dir(image_t *img, const fat_cache_t *fc, const dir_entry_t *dir,
+                const char *name, uint8_t type_mask, dir_entry_t *out,
+                uint64_t *out_off)
+{
+    return find_in_dir_n(img, fc, dir, name, strlen(name), type_mask, out,
+                         out_off);
+}
+
+int lookup_path(image_t *img, const fat_cache_t *fc, const char *path,
+                dir_entry_t *out)
+{
+    root_dir_entry(img, out);
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') p++;
+        if (*p == '\0') return 0;
+        if (!(out->status & DE_DIR)) { errno = ENOTDIR; return -1; }
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        if (len > MAX_NAME_LEN) { errno = ENOENT; return -1; }
+        dir_entry_t dir = *out;
+        if (find_in_dir_n(img, fc, &dir, p, len, DE_FILE | DE_DIR, out,
+                          NULL) != 0)
+            return -1;
+        p += len;
     }
+}
+
+// --- Directory cache and path resolution ---
+static uint32_t hash_block(uint32_t b) {
+    b ^= b >> 16;
+    b *= 0x45d9f3bu;
+    b ^= b >> 16;
+    return b;
+}
 
-    int max_entries = buf_size / 64;
-    dir_entry_t *entries = calloc(max_entries, sizeof(dir_entry_t));
-    if (!entries) { free(buf); return -1; }
+void init_dir_cache(dir_cache_t *dc, image_t *img) {
+    memset(dc, 0, sizeof(*dc));
+    dc->img = img;
+}
+
+static void free_cached_dir(cached_dir_t *d) {
+    if (!d) return;
+    free(d->entries);
+    free(d->offsets);
+    free(d->index);
+    free(d);
+}
 
-    int count = 0;
-    for (int i = 0; i < max_entries; i++) {
-        uint8_t *e = buf + i*64;
-        if (e[0] & 0x1) {  // in‐use
-            entries[count].status      = e[0];
-            entries[count].start_block = ntohl(*(uint32_t*)(e + 1));
-            entries[count].block_count = ntohl(*(uint32_t*)(e + 5));
-            entries[count].file_size   = ntohl(*(uint32_t*)(e + 9));
-            memcpy(entries[count].ctime, e + 13, 7);
-            memcpy(entries[count].mtime, e + 20, 7);
-            memcpy(entries[count].name,  e + 27, MAX_NAME_LEN);
-            entries[count].name[MAX_NAME_LEN] = '\0';
-            count++;
+void free_dir_cache(dir_cache_t *dc) {
+    for (uint32_t i = 0; i < dc->nslots; i++)
+        free_cached_dir(dc->slots[i]);
+    free(dc->slots);
+    dc->slots = NULL;
+    dc->nslots = dc->used = 0;
+}
+
+static cached_dir_t *decode_dir(image_t *img, const fat_cache_t *fc,
+                                uint32_t start, uint32_t blocks)
+{
+    cached_dir_t *d = calloc(1, sizeof(*d));
+    if (!d) return NULL;
+    d->start  = start;
+    d->blocks = blocks;
+
+    // Grow the entry array with the number actually in use, rather than
+    // sizing it for every slot in the region
+    int cap = 0;
+    dir_iter_t it;
+    dir_iter_init(&it, img, fc, start, blocks);
+    const uint8_t *raw;
+    while ((raw = dir_iter_next(&it)) != NULL) {
+        if (d->count == cap) {
+            cap = cap ? cap * 2 : 16;
+            dir_entry_t *grown = realloc(d->entries, cap * sizeof(dir_entry_t));
+            if (!grown) { free_cached_dir(d); return NULL; }
+            d->entries = grown;
+            uint64_t *offs = realloc(d->offsets, cap * sizeof(uint64_t));
+            if (!offs) { free_cached_dir(d); return NULL; }
+            d->offsets = offs;
         }
+        d->offsets[d->count] = dir_iter_offset(&it);
+        decode_dir_entry(raw, &d->entries[d->count++]);
     }
+    if (it.error) { free_cached_dir(d); errno = EIO; return NULL; }
 
-    free(buf);
-    *out_entries = entries;
-    return count;
+    // Index at no more than half load
+    uint32_t size = 8;
+    while (size < (uint32_t)d->count * 2) size <<= 1;
+    d->index = malloc(size * sizeof(int32_t));
+    if (!d->index) { free_cached_dir(d); return NULL; }
+    memset(d->index, 0xFF, size * sizeof(int32_t));
+    d->index_mask = size - 1;
+
+    for (int i = 0; i < d->count; i++) {
+        const char *nm = d->entries[i].name;
+        uint32_t h = dir_hash(nm, strlen(nm)) & d->index_mask;
+        while (d->index[h] >= 0) h = (h + 1) & d->index_mask;
+        d->index[h] = i;
+    }
+    return d;
+}
+
+// Slot holding `start`, or the empty slot where it would go
+static uint32_t dir_slot(const dir_cache_t *dc, uint32_t start) {
+    uint32_t mask = dc->nslots - 1;
+    uint32_t h = hash_block(start) & mask;
+    while (dc->slots[h] && dc->slots[h]->start != start)
+        h = (h + 1) & mask;
+    return h;
+}
+
+static int grow_dir_cache(dir_cache_t *dc) {
+    uint32_t old_n = dc->nslots;
+    cached_dir_t **old = dc->slots;
+    uint32_t n = old_n ? old_n * 2 : 16;
+    dc->slots = calloc(n, sizeof(*dc->slots));
+    if (!dc->slots) { dc->slots = old; return -1; }
+    dc->nslots = n;
+    for (uint32_t i = 0; i < old_n; i++)
+        if (old[i]) dc->slots[dir_slot(dc, old[i]->start)] = old[i];
+    free(old);
+    return 0;
+}
+
+const cached_dir_t *get_dir(dir_cache_t *dc, uint32_t start, uint32_t blocks) {
+    if (dc->nslots) {
+        cached_dir_t *d = dc->slots[dir_slot(dc, start)];
+        if (d && d->blocks == blocks) return d;
+        if (d) invalidate_dir(dc, start);
+    }
+    if ((dc->used + 1) * 2 > dc->nslots && grow_dir_cache(dc) != 0)
+        return NULL;
+
+    cached_dir_t *d = decode_dir(dc->img, dc->fc, start, blocks);
+    if (!d) return NULL;
+    dc->slots[dir_slot(dc, start)] = d;
+    dc->used++;
+    return d;
+}
+
+void invalidate_dir(dir_cache_t *dc, uint32_t start) {
+    if (!dc->nslots) return;
+    uint32_t mask = dc->nslots - 1;
+    uint32_t h = dir_slot(dc, start);
+    if (!dc->slots[h]) return;
+    free_cached_dir(dc->slots[h]);
+    dc->slots[h] = NULL;
+    dc->used--;
+
+    // Re-seat the rest of the probe run so lookups stay correct
+    for (uint32_t i = (h + 1) & mask; dc->slots[i]; i = (i + 1) & mask) {
+        cached_dir_t *d = dc->slots[i];
+        dc->slots[i] = NULL;
+        dc->slots[dir_slot(dc, d->start)] = d;
+    }
+}
+
+static const dir_entry_t *find_entry_n(const cached_dir_t *dir,
+                                       const char *name, size_t len,
+                                       uint8_t type_mask)
+{
+    uint32_t h = dir_hash(name, len) & dir->index_mask;
+    for (; dir->index[h] >= 0; h = (h + 1) & dir->index_mask) {
+        const dir_entry_t *e = &dir->entries[dir->index[h]];
+        if ((e->status & type_mask) &&
+            strncmp(e->name, name, len) == 0 && e->name[len] == '\0')
+            return e;
+    }
+    return NULL;
+}
+
+const dir_entry_t *find_entry(const cached_dir_t *dir, const char *name,
+                              uint8_t type_mask)
+{
+    return find_entry_n(dir, name, strlen(name), type_mask);
+}
+
+int resolve_dir(dir_cache_t *dc, const char *path, dir_ref_t *out) {
+    uint64_t t0 = phase_begin();
+    dir_ref_t cur = { .entry_off = 0, .parent = 0 };
+    root_dir_entry(dc->img, &cur.ent);
+
+    int rc = 0;
+    const char *p = path;
+    for (;;) {
+        while (*p == '/') p++;
+        if (*p == '\0') break;
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        const cached_dir_t *dir = get_dir(dc, cur.ent.start_block,
+                                          cur.ent.block_count);
+        if (!dir) { rc = -1; break; }
+        const dir_entry_t *e = len <= MAX_NAME_LEN
+                             ? find_entry_n(dir, p, len, DE_DIR) : NULL;
+        if (!e) { errno = ENOENT; rc = -1; break; }
+        cur.parent    = cur.ent.start_block;
+        cur.ent       = *e;
+        cur.entry_off = dir->offsets[e - dir->entries];
+        p += len;
+    }
+
+    if (rc == 0) *out = cur;
+    phase_end(PH_RESOLVE, t0);
+    return rc;
+}
+
+// --- File extent index ---
+void init_extent_cache(extent_cache_t *xc, image_t *img) {
+    memset(xc, 0, sizeof(*xc));
+    xc->img = img;
+    pthread_mutex_init(&xc->lock, NULL);
+}
+
+static void drop_extents(file_extents_t *fx) {
+    if (!fx || --fx->refs > 0) return;
+    free(fx->ext);
+    free(fx->first);
+    free(fx);
+}
+
+void free_extent_cache(extent_cache_t *xc) {
+    if (xc->slots)
+        for (uint32_t i = 0; i < EXTENT_CACHE_SLOTS; i++)
+            drop_extents(xc->slots[i]);
+    free(xc->slots);
+    xc->slots = NULL;
+    pthread_mutex_destroy(&xc->lock);
+}
+
+static file_extents_t *build_extents(image_t *img, const fat_cache_t *fc,
+                                     uint32_t start, uint32_t blocks)
+{
+    file_extents_t *fx = calloc(1, sizeof(*fx));
+    if (!fx) return NULL;
+    fx->start  = start;
+    fx->blocks = blocks;
+    fx->refs   = 1;
+    fx->count  = chain_extents(img, fc, start, blocks, &fx->ext);
+    if (fx->count < 0) {
+        free(fx);
+        errno = EIO;
+        return NULL;
+    }
+    fx->first = malloc((fx->count + 1) * sizeof(uint32_t));
+    if (!fx->first) {
+        free(fx->ext);
+        free(fx);
+        return NULL;
+    }
+    uint32_t b = 0;
+    for (int i = 0; i < fx->count; i++) {
+        fx->first[i] = b;
+        b += fx->ext[i].count;
+    }
+    if (b < blocks) {  // chain ends before the file does
+        drop_extents(fx);
+        errno = EIO;
+        return NULL;
+    }
+    return fx;
+}
+
+file_extents_t *get_file_extents(extent_cache_t *xc, uint32_t start,
+                                 uint32_t blocks)
+{
+    if (blocks == 0) {
+        // Nothing to index (or cache): empty files own no blocks
+        file_extents_t *fx = calloc(1, sizeof(*fx));
+        if (fx) fx->refs = 1;
+        return fx;
+    }
+    uint32_t h = hash_block(start) & (EXTENT_CACHE_SLOTS - 1);
+    pthread_mutex_lock(&xc->lock);
+    file_extents_t *fx = xc->slots ? xc->slots[h] : NULL;
+    if (fx && fx->start == start && fx->blocks == blocks) {
+        fx->refs++;
+        pthread_mutex_unlock(&xc->lock);
+        return fx;
+    }
+    const fat_cache_t *fc = xc->fc;
+    pthread_mutex_unlock(&xc->lock);
+
+    // Walk the chain without holding the lock; if another reader built
+    // the same index meanwhile, the later one simply replaces it
+    fx = build_extents(xc->img, fc, start, blocks);
+    if (!fx) return NULL;
+
+    pthread_mutex_lock(&xc->lock);
+    if (!xc->slots) xc->slots = calloc(EXTENT_CACHE_SLOTS, sizeof(*xc->slots));
+    if (xc->slots) {
+        drop_extents(xc->slots[h]);
+        xc->slots[h] = fx;
+        fx->refs++;
+    }
+    pthread_mutex_unlock(&xc->lock);
+    return fx;
+}
+
+void put_file_extents(extent_cache_t *xc, file_extents_t *fx) {
+    pthread_mutex_lock(&xc->lock);
+    drop_extents(fx);
+    pthread_mutex_unlock(&xc->lock);
+}
+
+void invalidate_extents(extent_cache_t *xc, uint32_t start) {
+    uint32_t h = hash_block(start) & (EXTENT_CACHE_SLOTS - 1);
+    pthread_mutex_lock(&xc->lock);
+    if (xc->slots && xc->slots[h] && xc->slots[h]->start == start) {
+        drop_extents(xc->slots[h]);
+        xc->slots[h] = NULL;
+    }
+    pthread_mutex_unlock(&xc->lock);
+}
+
+int find_extent(const file_extents_t *fx, uint32_t fblock) {
+    if (fblock >= fx->blocks) return -1;
+    int lo = 0, hi = fx->count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (fx->first[mid] <= fblock) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+// Visit the image ranges behind bytes off..off+len of the chain from
+// start holding `size` bytes (clamped to it), one call per extent; stops
+// at the first non-zero return
+typedef int (*span_fn)(image_t *img, uint64_t img_off, uint64_t len,
+                       void *arg);
+
+static int for_each_span(extent_cache_t *xc, uint32_t start, uint64_t size,
+                         uint64_t off, uint64_t len, span_fn fn, void *arg)
+{
+    const uint32_t bs = xc->img->sb.block_size;
+    if (off >= size || len == 0) return 0;
+    if (len > size - off) len = size - off;
+
+    uint32_t blocks = (uint32_t)((size + bs - 1) / bs);
+    file_extents_t *fx = get_file_extents(xc, start, blocks);
+    if (!fx) return -1;
+
+    int rc = 0;
+    for (int i = find_extent(fx, (uint32_t)(off / bs));
+         i >= 0 && i < fx->count && len > 0 && rc == 0; i++)
+    {
+        uint64_t skip  = off - (uint64_t)fx->first[i] * bs;
+        uint64_t chunk = (uint64_t)fx->ext[i].count * bs - skip;
+        if (chunk > len) chunk = len;
+        rc = fn(xc->img, (uint64_t)fx->ext[i].start * bs + skip, chunk, arg);
+        off += chunk;
+        len -= chunk;
+    }
+    put_file_extents(xc, fx);
+    return rc;
+}
+
+static int read_span(image_t *img, uint64_t img_off, uint64_t len,
+                     void *arg)
+{
+    uint8_t **p = arg;
+    if (read_image(img, img_off, *p, len) != 0) return -1;
+    *p += len;
+    return 0;
+}
+
+int read_chain_range(extent_cache_t *xc, uint32_t start, uint32_t blocks,
+                     uint64_t off, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    uint64_t size = (uint64_t)blocks * xc->img->sb.block_size;
+    if (off > size || len > size - off) {
+        errno = EIO;
+        return -1;
+    }
+    return for_each_span(xc, start, size, off, len, read_span, &p);
+}
+
+// Sinks for read_compressed(): append to a buffer, or write to an fd
+static int sink_buffer(const void *buf, size_t len, void *arg) {
+    uint8_t **p = arg;
+    memcpy(*p, buf, len);
+    *p += len;
+    return 0;
+}
+
+static int sink_fd(const void *buf, size_t len, void *arg) {
+    return write_full(*(int *)arg, buf, len);
+}
+
+ssize_t read_file_range(extent_cache_t *xc, const dir_entry_t *e,
+                        uint64_t off, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    int rc = (e->status & DE_COMPRESSED)
+        ? read_compressed(xc, e, off, len, 1, sink_buffer, &p)
+        : for_each_span(xc, e->start_block, e->file_size, off, len,
+                        read_span, &p);
+    return rc != 0 ? -1 : p - (uint8_t *)buf;
+}
+
+static int copy_span(image_t *img, uint64_t img_off, uint64_t len,
+                     void *arg)
+{
+    return copy_image_range(img, img_off, len, *(int *)arg);
+}
+
+int copy_file_span(extent_cache_t *xc, const dir_entry_t *e, uint64_t off,
+                   uint64_t len, int out_fd, int nthreads)
+{
+    if (e->status & DE_COMPRESSED)
+        return read_compressed(xc, e, off, len, nthreads, sink_fd, &out_fd);
+    return for_each_span(xc, e->start_block, e->file_size, off, len,
+                         copy_span, &out_fd);
 }
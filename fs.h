@@ -1,11 +1,17 @@
 #ifndef FS_H
 #define FS_H
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define FS_ID_LEN     8
 #define MAX_NAME_LEN 30
+#define SUPERBLOCK_SIZE 512
+#define PATH_BUF_SIZE  4096  // host and image paths built by the tree walks
+#define MAX_TREE_DEPTH 256   // deeper trees are refused as likely loops
 
 // --- Superblock structure ---
 typedef struct {
@@ -16,17 +22,248 @@ typedef struct {
     uint32_t fat_blocks;
     uint32_t root_start;
     uint32_t root_blocks;
+    uint32_t journal_start;        // bytes 30..37; both 0 without a journal
+    uint32_t journal_blocks;
 } superblock_t;
 
+// --- Journal staging ---
+// Directory, superblock and FAT blocks changed since the last commit,
+// held in memory (sorted by block) until commit_journal() puts them in
+// the on-image journal and then in place.  Reads through the image see
+// them; see the Journal section below.
+typedef struct {
+    uint32_t  seq;             // sequence number of the last commit
+    uint32_t  count;           // blocks staged
+    uint32_t  cap;
+    uint32_t *home;            // block number of each, ascending
+    uint8_t **data;            // block_size bytes each
+    int       pending;         // written in place but not yet fsync'd
+} journal_t;
+
+// --- Image handle ---
+// The image is opened once and mapped with mmap when possible, so the
+// superblock, the FAT and every data block are plain memory.  If the
+// mapping fails (or CSC360FS_NO_MMAP is set in the environment) the
+// superblock and FAT are read into heap buffers with one pread each and
+// data blocks go through pread/pwrite.
+#define IMG_RDONLY 0
+#define IMG_RDWR   1
+
+typedef struct {
+    int           fd;
+    int           writable;
+    uint8_t      *map;         // whole image, or NULL in fallback mode
+    size_t        size;        // image size in bytes
+    superblock_t  sb;          // decoded superblock
+    uint8_t      *raw_sb;      // on-disk superblock bytes
+    uint8_t      *fat;         // on-disk (big-endian) FAT
+    uint32_t      fat_entries;
+    int           fat_dirty;   // fallback mode: FAT needs writing back
+    int           meta_copied; // raw_sb and fat are heap copies while mapped
+    journal_t     jn;
+    uint32_t      replayed;    // blocks open_image() copied home from a journal
+    uint32_t      in_place;    // blocks the last commit too large for it held
+} image_t;
+
+// Open/close an image.  Returns 0 on success, -1 on error (errno set).
+int  open_image(image_t *img, const char *path, int mode);
+int  sync_image(image_t *img);
+int  close_image(image_t *img);
+
+// Byte-addressed access to the image
+int  read_image(image_t *img, uint64_t off, void *buf, size_t len);
+int  write_image(image_t *img, uint64_t off, const void *buf, size_t len);
+// Make everything written so far durable (msync and fsync)
+int  fsync_image(image_t *img);
+
+// Direct pointer to a data block; NULL in fallback mode or out of range
+uint8_t *block_ptr(image_t *img, uint32_t block);
+
+// Host-endian FAT entry access
+uint32_t get_fat_entry(const image_t *img, uint32_t idx);
+void     set_fat_entry(image_t *img, uint32_t idx, uint32_t val);
+
+// --- FAT entry values ---
+#define FAT_FREE     0x00000000u
+#define FAT_RESERVED 0x00000001u
+#define FAT_EOF      0xFFFFFFFFu
+
+// --- In-memory FAT cache ---
+// Loaded with one bulk read and kept in host byte order.  A bitmap of
+// free blocks and a next-free cursor make allocation cheap; only the FAT
+// blocks that were modified are written back by flush_fat().  The blocks
+// are also split into at most SUMMARY_REGIONS power-of-two regions with
+// a free count each, so scans for free blocks skip full regions whole.
+#define SUMMARY_REGIONS 96
+
+typedef struct {
+    uint32_t *entries;      // host-endian copy of the whole FAT
+    uint32_t  nentries;     // FAT capacity in entries
+    uint32_t  nblocks;      // allocatable blocks (within image and FAT)
+    uint64_t *free_map;     // bit set => block is free
+    uint32_t  free_count;
+    uint32_t  next_free;    // allocation cursor
+    uint32_t  per_block;    // FAT entries per FAT block
+    uint32_t  fat_blocks;
+    uint8_t  *dirty;        // one flag per FAT block
+    uint32_t  n_free;       // histogram over the whole FAT, kept
+    uint32_t  n_reserved;   //   current by fat_set()
+    uint32_t  n_alloc;
+    uint32_t  region_shift; // log2 of the blocks per region
+    uint32_t  region_free[SUMMARY_REGIONS];
+    int       summary;      // SUMMARY_* state of the image's summary
+} fat_cache_t;
+
+int      load_fat(image_t *img, fat_cache_t *fc);
+uint32_t fat_get(const fat_cache_t *fc, uint32_t idx);
+void     fat_set(fat_cache_t *fc, uint32_t idx, uint32_t val);
+// Allocate one block and mark it end-of-chain; returns FAT_EOF when full
+uint32_t fat_alloc(fat_cache_t *fc);
+// Allocate n blocks, link them into a chain ending in FAT_EOF and store
+// them in chain[].  Uses the best-fitting single run of free blocks and
+// falls back to first-fit from the cursor when free space is fragmented.
+// Returns 0, or -1 (nothing allocated) if space is short.
+int      fat_alloc_chain(fat_cache_t *fc, uint32_t n, uint32_t *chain);
+// Like fat_alloc_chain() but only ever one contiguous run (directories
+// are read as contiguous regions); -1 if no free run is long enough.
+int      fat_alloc_run(fat_cache_t *fc, uint32_t n, uint32_t *chain);
+// Lowest-addressed run of at least n free blocks, or FAT_EOF
+uint32_t fat_first_run(const fat_cache_t *fc, uint32_t n);
+// As fat_first_run(), but the run must start at or after `from`
+uint32_t fat_run_from(const fat_cache_t *fc, uint32_t from, uint32_t n);
+// Lowest free block at or after `from` (no wrap), or FAT_EOF
+uint32_t fat_next_free(const fat_cache_t *fc, uint32_t from);
+// Longest run of free blocks (the lowest-addressed on a tie), storing
+// its length in *len; FAT_EOF when nothing is free
+uint32_t fat_largest_run(const fat_cache_t *fc, uint32_t *len);
+// Number of free blocks starting at `from` (0 if it is in use)
+uint32_t fat_free_run(const fat_cache_t *fc, uint32_t from);
+// Claim free blocks run..run+n-1 as a chain (as fat_alloc_run() does)
+void     fat_take_run(fat_cache_t *fc, uint32_t run, uint32_t n,
+                      uint32_t *chain);
+// Allocate n blocks and link them after `last`, the end of an existing
+// chain.  The blocks right after it are used when free, so the chain
+// stays one extent; otherwise as fat_alloc_chain().  -1 if space is short.
+int      fat_extend_chain(fat_cache_t *fc, uint32_t last, uint32_t n,
+                          uint32_t *chain);
+// Number of contiguous runs in a block chain
+uint32_t count_extents(const uint32_t *chain, uint32_t n);
+int      flush_fat(image_t *img, fat_cache_t *fc);
+void     free_fat(fat_cache_t *fc);
+
+// --- Free-space summary ---
+// Superblock bytes 38..453 may hold the FAT's free, reserved and
+// allocated counts, the allocation cursor, the lowest free entry and the
+// free count of every region, behind the magic "FSUM" and a checksum that
+// also covers the geometry (bytes 8..25).  Whoever writes FAT blocks
+// rewrites it with them: in the same journal commit, or in place after
+// clearing the magic first, so the magic doubles as a dirty flag and a
+// crash between the two leaves no summary rather than a wrong one.
+// Writers that know nothing of it are caught by the lowest free entry:
+// a first-fit allocator takes that block before any other, so a summary
+// whose lowest free entry is no longer free is not believed.  diskinfo
+// reads it instead of scanning the FAT; load_fat() checks it against the
+// FAT it loads and starts allocating at its cursor, and a missing or
+// stale one is rewritten at the next flush.
+#define SUMMARY_OFF 38
+#define SUMMARY_LEN (32 + 4 * SUMMARY_REGIONS)
+
+#define SUMMARY_OK      0   // present and matching the FAT
+#define SUMMARY_MISSING 1   // absent, torn or for another geometry
+#define SUMMARY_STALE   2   // well-formed but not what the FAT says
+
+typedef struct {
+    uint32_t n_free;        // over the whole FAT, as analyze_fat()
+    uint32_t n_reserved;
+    uint32_t n_alloc;
+    uint32_t next_free;     // allocation cursor when written
+    uint32_t first_free;    // lowest free FAT entry, FAT_EOF if none
+    uint32_t region_blocks;
+    uint32_t region_free[SUMMARY_REGIONS];
+} space_summary_t;
+
+// Decode the image's summary.  Returns 0, or -1 if it is missing, torn,
+// does not fit the image's geometry or its lowest free entry has since
+// been taken.
+int read_space_summary(const image_t *img, space_summary_t *out);
+// Write fc's summary: through write_meta() when staged is set, else in
+// place.  clear_space_summary() marks it absent in place.
+int write_space_summary(image_t *img, fat_cache_t *fc, int staged);
+int clear_space_summary(image_t *img);
+
+// --- Extents ---
+// A run of physically consecutive blocks in a FAT chain
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} extent_t;
+
+// Follow the FAT chain from `start` for at most max_blocks blocks and
+// merge consecutive blocks into extents.  Caller must free *out.
+// Returns the number of extents, or -1 (errno EIO) if the chain leaves
+// the data area.
+// Links come from fc when given (so unflushed changes are seen), else
+// from the image's FAT.
+int chain_extents(image_t *img, const fat_cache_t *fc,
+                  uint32_t start, uint32_t max_blocks, extent_t **out);
+
+// Copy len bytes at image offset off to out_fd: copy_file_range, then
+// sendfile, then large read/write as the last resort.
+int copy_image_range(image_t *img, uint64_t off, uint64_t len, int out_fd);
+// All len bytes of buf to fd, retrying short writes; 0 or -1
+int write_full(int fd, const void *buf, size_t len);
+
+// --- Journal (journal.c) ---
+// An image whose superblock names a journal region (a contiguous run of
+// FAT_RESERVED blocks) never changes directory, superblock or FAT blocks
+// in place straight away.  write_meta() stages such writes, and
+// read_image() and the directory iterator see staged blocks in place of
+// the image's.  commit_journal() adds the FAT cache's dirty blocks,
+// writes everything to the region behind a header holding their block
+// numbers and a checksum, makes that durable with one fsync, and only
+// then copies the blocks home.  A commit covers every operation since
+// the last one, so a batch pays for a single fsync.  open_image() replays
+// a complete journal left by a crash (or, read-only, overlays it) and
+// ignores a torn one; close_image() syncs the last copy home and marks
+// the journal empty.  Images without a journal write in place as before.
+#define JOURNAL_DIR_BLOCKS 64   // room beyond the FAT in a new journal
+#define JOURNAL_BATCH      32   // entry rewrites per commit, to stay inside it
+
+// Write bytes of a directory or the superblock: staged when the image
+// has a journal, else as write_image()
+int  write_meta(image_t *img, uint64_t off, const void *buf, size_t len);
+// Whether any staged block overlaps [off, off+len)
+int  image_staged(const image_t *img, uint64_t off, uint64_t len);
+// Copy staged bytes over buf (read) or buf over staged bytes (write)
+void staged_read(const image_t *img, uint64_t off, void *buf, size_t len);
+void staged_write(image_t *img, uint64_t off, const void *buf, size_t len);
+// Commit the staged blocks and fc's dirty FAT blocks (fc may be NULL).
+// A transaction too large for the region is written in place unprotected
+// and its size kept in img->in_place for the tools to report.
+int  commit_journal(image_t *img, fat_cache_t *fc);
+// Called by open_image()/close_image(); 1 if a journal was applied (its
+// block count is kept in img->replayed)
+int  open_journal(image_t *img);
+int  close_journal(image_t *img);
+
 // Read/inspect superblock and FAT
-int read_superblock(FILE *fp, superblock_t *sb);
-int analyze_fat(FILE *fp,
+int read_superblock(image_t *img, superblock_t *sb);
+// Record a new root directory length in the superblock
+int set_root_blocks(image_t *img, uint32_t blocks);
+int analyze_fat(image_t *img,
                 const superblock_t *sb,
                 uint32_t *free_cnt,
                 uint32_t *reserved_cnt,
                 uint32_t *alloc_cnt);
 
 // --- Directory‐entry structure (64 bytes on‐disk) ---
+#define DIR_ENTRY_SIZE 64
+#define DE_IN_USE 0x1
+#define DE_FILE   0x2
+#define DE_DIR    0x4
+#define DE_HASHED 0x8   // directory: entries placed by name hash (below)
+#define DE_COMPRESSED 0x10  // file: stored as compressed chunks (below)
+
 typedef struct {
     uint8_t  status;               // bit0=in‐use, bit1=file, bit2=dir
     uint32_t start_block;          // big‐endian on‐disk
@@ -37,13 +274,416 @@ typedef struct {
     char     name[MAX_NAME_LEN+1]; // null-terminated
 } dir_entry_t;
 
-// Read all in‐use entries in a directory region
-// Caller must free *out_entries.
-// Returns number of entries or -1 on error.
-int read_dir_entries(FILE *fp,
-                     const superblock_t *sb,
-                     uint32_t dir_start,
-                     uint32_t dir_blocks,
-                     dir_entry_t **out_entries);
+// Convert between the 64-byte on-disk form and dir_entry_t
+void decode_dir_entry(const uint8_t raw[DIR_ENTRY_SIZE], dir_entry_t *e);
+void encode_dir_entry(const dir_entry_t *e, uint8_t raw[DIR_ENTRY_SIZE]);
+
+// --- Directory iterator ---
+// Walks a directory's raw 64-byte slots without allocating: mapped images
+// are read in place, otherwise through a small window in the iterator.
+// Fields are decoded only when asked for with the dirent_* accessors.
+// Directories grow by extending their FAT chain, so the chain is
+// followed one extent at a time; links come from fc when given (so
+// unflushed changes are seen), else from the image's FAT.
+#define DIR_ITER_WINDOW 4096
+
+typedef struct {
+    image_t           *img;
+    const fat_cache_t *fc;
+    uint32_t       next;       // first block of the next extent, or FAT_EOF
+    uint32_t       left;       // blocks of the directory not yet reached
+    uint64_t       base;       // image offset of the current extent
+    uint32_t       nslots;     // slots in the current extent
+    uint32_t       slot;       // next slot to visit in it
+    const uint8_t *win;        // slots win_first .. win_first+win_count-1
+    uint32_t       win_first;
+    uint32_t       win_count;
+    int            error;      // set if a read failed or the chain is bad
+    uint8_t        buf[DIR_ITER_WINDOW];
+} dir_iter_t;
+
+void dir_iter_init(dir_iter_t *it, image_t *img, const fat_cache_t *fc,
+                   uint32_t dir_start, uint32_t dir_blocks);
+// Next slot, in use or not; NULL at the end (or on error)
+const uint8_t *dir_iter_slot(dir_iter_t *it);
+// Next in-use entry; NULL at the end (or on error)
+const uint8_t *dir_iter_next(dir_iter_t *it);
+// Image offset of the slot returned last
+uint64_t dir_iter_offset(const dir_iter_t *it);
+
+// On-disk integers are big-endian and need not be aligned
+static inline uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+static inline void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = (uint8_t)v;
+}
+static inline uint8_t  dirent_status(const uint8_t *raw) { return raw[0]; }
+static inline uint32_t dirent_start(const uint8_t *raw)  { return get_be32(raw + 1); }
+static inline uint32_t dirent_blocks(const uint8_t *raw) { return get_be32(raw + 5); }
+static inline uint32_t dirent_size(const uint8_t *raw)   { return get_be32(raw + 9); }
+static inline const uint8_t *dirent_ctime(const uint8_t *raw) { return raw + 13; }
+static inline const uint8_t *dirent_mtime(const uint8_t *raw) { return raw + 20; }
+static inline const char    *dirent_name(const uint8_t *raw)  { return (const char*)raw + 27; }
+// Compare the stored name with name[0..len) without copying it
+int dirent_name_is(const uint8_t *raw, const char *name, size_t len);
+
+// --- Hashed directories ---
+// A directory whose entry has DE_HASHED set keeps each entry in slot
+// dir_hash(name) % nslots or, if that is taken, the next free slot after
+// it (wrapping), so a lookup stops at the first free slot it meets.  Its
+// blocks form one contiguous run, making any slot one read away.  The
+// root is always a plain directory: it has no entry to carry the bit.
+#define HASH_MAX_PROBE 16   // longer insert probes rebuild at twice the size
+
+uint32_t dir_hash(const char *name, size_t len);   // FNV-1a
+// Free slot for name in an in-memory table of nslots slots, NULL if full
+uint8_t *dir_hash_slot(uint8_t *table, uint32_t nslots,
+                       const char *name, size_t len);
+// Follow name's probe sequence for at most max_probe slots.  Returns 1
+// with *off (and raw, if given) at a matching entry; 0 with *off at the
+// first free slot, or UINT64_MAX if none came up; -1 if the directory
+// cannot be probed (not one run, or unreadable) and must be scanned.
+int probe_hashed(image_t *img, const fat_cache_t *fc, const dir_entry_t *dir,
+                 const char *name, size_t len, uint8_t type_mask,
+                 uint32_t max_probe, uint8_t *raw, uint64_t *off);
+
+// The root described as an entry (it has none of its own)
+void root_dir_entry(const image_t *img, dir_entry_t *out);
+// Find an in-use entry by name in the directory `dir` among those whose
+// status has any bit of type_mask: by hash in a hashed directory, else
+// by a scan that stops at the first match.  Returns 0, decodes it into
+// *out and stores its image offset in *out_off (if given), or -1 if
+// absent (errno = ENOENT) or unreadable.
+int find_in_dir(image_t *img, const fat_cache_t *fc, const dir_entry_t *dir,
+                const char *name, uint8_t type_mask, dir_entry_t *out,
+                uint64_t *out_off);
+// Resolve an absolute path to its entry, streaming each directory on
+// the way instead of going through a dir_cache_t, so it is safe to call
+// from many threads at once.  "/" yields an entry describing the root.
+// Returns 0, or -1 with errno ENOENT, ENOTDIR or EIO.
+int lookup_path(image_t *img, const fat_cache_t *fc, const char *path,
+                dir_entry_t *out);
+
+// --- Directory cache and path resolution ---
+// Each directory is decoded at most once per run and cached by its start
+// block.  Cached directories carry an open-addressed hash index over the
+// entry names, so a path component costs one hash probe.
+typedef struct {
+    uint32_t     start;        // first block; the cache key
+    uint32_t     blocks;
+    dir_entry_t *entries;      // in-use entries only
+    uint64_t    *offsets;      // image offset of each entry
+    int          count;
+    int32_t     *index;        // entry number per slot, -1 when empty
+    uint32_t     index_mask;
+} cached_dir_t;
+
+typedef struct {
+    image_t           *img;
+    const fat_cache_t *fc;     // the volume's FAT cache once loaded
+    cached_dir_t **slots;      // keyed by start block
+    uint32_t       nslots;
+    uint32_t       used;
+} dir_cache_t;
+
+void init_dir_cache(dir_cache_t *dc, image_t *img);
+void free_dir_cache(dir_cache_t *dc);
+// Decode (or fetch from the cache) the directory at start/blocks
+const cached_dir_t *get_dir(dir_cache_t *dc, uint32_t start, uint32_t blocks);
+// Drop a cached directory after its on-disk entries change
+void invalidate_dir(dir_cache_t *dc, uint32_t start);
+// Find an in-use entry by name whose status has any of the bits in
+// type_mask (DE_FILE, DE_DIR, or both).  Returns NULL if absent.
+const dir_entry_t *find_entry(const cached_dir_t *dir, const char *name,
+                              uint8_t type_mask);
+// A directory found by resolve_dir(): its entry, and where that entry
+// lives so it can be updated (both 0 for the root, which the superblock
+// and its "." entry describe instead)
+typedef struct {
+    dir_entry_t ent;
+    uint64_t    entry_off;     // image offset of the entry
+    uint32_t    parent;        // start block of the directory holding it
+} dir_ref_t;
+
+// Resolve "/", "/a" or "/a/b" to a directory.  Returns 0, or -1 if a
+// component is missing (errno = ENOENT).
+int resolve_dir(dir_cache_t *dc, const char *path, dir_ref_t *out);
+
+// --- File extent index ---
+// A file's chain resolved once into extents, each tagged with the file
+// block it begins at, so the block behind any offset is found by binary
+// search instead of a walk from the start block.  Indexes are cached by
+// start block in a fixed direct-mapped table (a newer index takes the
+// slot) and shared by reader threads: get_file_extents() pins one and
+// put_file_extents() unpins it, and an evicted index is freed by its last
+// user.
+typedef struct {
+    uint32_t  start;           // first block; the cache key
+    uint32_t  blocks;          // blocks indexed
+    int       count;
+    extent_t *ext;
+    uint32_t *first;           // file block where ext[i] begins
+    int       refs;            // pins, plus one while cached
+} file_extents_t;
+
+#define EXTENT_CACHE_SLOTS 256
+
+typedef struct {
+    image_t           *img;
+    const fat_cache_t *fc;     // the volume's FAT cache once loaded
+    pthread_mutex_t    lock;
+    file_extents_t   **slots;  // EXTENT_CACHE_SLOTS, allocated on first use
+} extent_cache_t;
+
+void init_extent_cache(extent_cache_t *xc, image_t *img);
+void free_extent_cache(extent_cache_t *xc);
+// Index of the chain from start covering `blocks` blocks, built on first
+// use.  NULL with errno = EIO if the chain leaves the image or ends early.
+file_extents_t *get_file_extents(extent_cache_t *xc, uint32_t start,
+                                 uint32_t blocks);
+void put_file_extents(extent_cache_t *xc, file_extents_t *fx);
+// Drop a cached index after the chain from start changes
+void invalidate_extents(extent_cache_t *xc, uint32_t start);
+// Extent holding file block fblock, or -1 past the end
+int  find_extent(const file_extents_t *fx, uint32_t fblock);
+
+// Read len bytes at byte off of the chain from start, `blocks` long.
+// Returns 0, or -1 (errno = EIO if the range or chain runs short).
+int read_chain_range(extent_cache_t *xc, uint32_t start, uint32_t blocks,
+                     uint64_t off, void *buf, size_t len);
+// Read up to len bytes of file e from byte off into buf, decompressing
+// if need be.  Returns the bytes read (0 at or past the end), or -1.
+ssize_t read_file_range(extent_cache_t *xc, const dir_entry_t *e,
+                        uint64_t off, void *buf, size_t len);
+// Copy up to len bytes of file e from byte off to out_fd: one
+// copy_image_range() per extent, or for a compressed file its chunks
+// decompressed on nthreads workers (0 = one per CPU).  Returns 0, or -1
+// (errno = EIO for a corrupt chain or chunk).
+int copy_file_span(extent_cache_t *xc, const dir_entry_t *e, uint64_t off,
+                   uint64_t len, int out_fd, int nthreads);
+
+// --- Compressed files (compress.c) ---
+// A file whose entry has DE_COMPRESSED set keeps, in its chain, a 12-byte
+// header ("CZ", version 1, a zero byte, the chunk size and the chunk
+// count), then one big-endian u32 per chunk saying where its compressed
+// bytes end (counted from the end of this index), then the chunks.  Each
+// chunk holds CZ_CHUNK bytes of the file (the last one fewer) compressed
+// on its own with the LZ codec, or stored as is when that would not make
+// it smaller.  file_size is the uncompressed size and block_count the
+// stored one, so a byte range reads two index entries per chunk it
+// touches and nothing else.
+#define CZ_CHUNK   (64u << 10)
+#define CZ_HEADER  12
+
+// LZ77 in the LZ4 block style: byte-aligned literal runs and matches
+// within 64 KiB, no entropy stage.  lz_compress() returns the compressed
+// size, or 0 if it would not fit in cap bytes; lz_decompress() returns
+// the decoded size, or -1 for corrupt input or output beyond cap.
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+long   lz_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+                     size_t cap);
+
+// Build the stored form of the first size bytes of file fd, reading and
+// compressing a batch of chunks at a time on nthreads workers (0 = one
+// per CPU).  Each piece goes to store with its offset in the stored
+// form: the chunks in order, then the header and index at offset 0.
+// Returns 0 with *out_len the stored length, 1 (having stopped early) if
+// it would exceed limit bytes, or -1 if a read, memory or store fails.
+typedef int (*cz_store_fn)(uint64_t off, const void *buf, size_t len,
+                           void *arg);
+int compress_file_data(int fd, uint32_t size, int nthreads, uint64_t limit,
+                       cz_store_fn store, void *arg, uint32_t *out_len);
+
+// Pass bytes off..off+len of compressed file e (clamped to its size) to
+// sink in order, decompressing a batch of chunks at a time on nthreads
+// workers.  Returns 0, the sink's non-zero return, or -1 (errno = EIO
+// for a malformed header, index or chunk).
+typedef int (*cz_sink_fn)(const void *buf, size_t len, void *arg);
+int read_compressed(extent_cache_t *xc, const dir_entry_t *e, uint64_t off,
+                    uint64_t len, int nthreads, cz_sink_fn sink, void *arg);
+
+// --- Volume: an open image plus its warm metadata ---
+// The FAT cache is loaded on first use and written back by sync_volume()
+// (and close_volume() for writable volumes), so a batch of operations
+// pays for one FAT load and one FAT flush, or one journal commit when
+// the image has a journal.
+typedef struct {
+    image_t        img;
+    fat_cache_t    fat;
+    int            fat_loaded;
+    dir_cache_t    dc;
+    extent_cache_t xc;
+    int            hashed_dirs;   // create new directories with DE_HASHED
+    int            compress_files; // store new files with DE_COMPRESSED
+} volume_t;
+
+int          open_volume(volume_t *v, const char *path, int mode);
+fat_cache_t *volume_fat(volume_t *v);
+int          sync_volume(volume_t *v);
+int          close_volume(volume_t *v);
+
+// --- Statistics (--stats) ---
+// Process-wide I/O counters and per-phase timings, always collected.
+// Counters are bumped with relaxed atomics so worker threads can share
+// them; phase times are summed over threads, and a phase entered while
+// another is open on the same thread is charged to the outer one.
+enum {
+    PH_SUPERBLOCK,      // open, map, decode and check the superblock
+    PH_RESOLVE,         // path and name lookups
+    PH_FAT,             // FAT load and scans
+    PH_COPY,            // file data in or out
+    PH_COMMIT,          // directory entries, FAT write-back, sync
+    PH_COUNT
+};
+
+typedef struct {
+    uint64_t seeks;         // image accesses not continuing the last one
+    uint64_t read_calls;    // read()/pread() system calls
+    uint64_t write_calls;   // write()/pwrite() system calls
+    uint64_t copy_calls;    // copy_file_range()/sendfile() system calls
+    uint64_t bytes_read;    // image bytes read, mapped or not
+    uint64_t bytes_written; // image bytes written, mapped or not
+    uint64_t fat_entries;   // FAT entries loaded, scanned, followed or set
+    uint64_t dir_regions;   // directory regions walked
+    uint64_t allocations;   // block allocation requests...
+    uint64_t alloc_blocks;  //   ...and the blocks they handed out
+    uint64_t phase_ns[PH_COUNT];
+    uint64_t last_end;      // image offset just past the last access
+    uint64_t start_ns;
+} fs_stats_t;
+
+extern fs_stats_t fs_stats;
+
+#define STAT_ADD(field, n) \
+    __atomic_fetch_add(&fs_stats.field, (uint64_t)(n), __ATOMIC_RELAXED)
+
+uint64_t stats_clock(void);                 // monotonic ns
+uint64_t phase_begin(void);
+void     phase_end(int phase, uint64_t t0);
+// Record an access to [off, off+len) of the image
+void     stats_access(uint64_t off, uint64_t len, int write);
+// Summary on out: aligned text, or one JSON object when json is set
+void     print_stats(FILE *out, int json);
+
+// Reserve a journal big enough for the whole FAT plus JOURNAL_DIR_BLOCKS
+// in the lowest free run and record it in the superblock
+int add_journal(volume_t *v, FILE *out);
+
+// --- Tool operations (ops.c) ---
+// Shared by the single-shot tools and diskshell.  Each prints the same
+// messages the tools always have and returns 0, or -1 on failure.  The
+// library goes through the quiet calls below them instead.
+int print_info(volume_t *v, FILE *out);
+// List a directory (list.c): as text in the assignment's layout, as TSV
+// with a header line, or as one JSON object per line, the latter two
+// giving full paths and both times.  With recursive set, the whole tree
+// under it follows, each directory after its parent (text puts a
+// "path:" line over each).  Lines are formatted by hand into one large
+// buffer that goes to out in a few big writes.  list_dir() is the
+// plain text listing of one directory.
+#define LIST_TEXT 0
+#define LIST_TSV  1
+#define LIST_JSON 2
+int list_tree(volume_t *v, const char *path, int format, int recursive,
+              FILE *out);
+int list_dir(volume_t *v, const char *path, FILE *out);
+int get_file(volume_t *v, const char *fs_path, const char *host_dest);
+// Like get_file() for bytes off..off+len only (clamped to the file)
+int get_file_range(volume_t *v, const char *fs_path, const char *host_dest,
+                   uint64_t off, uint64_t len);
+// Copy a host file ("-" for stdin) to fs_dest.  An existing file keeps
+// its chain: PUT_REPLACE overwrites it, PUT_APPEND adds to its end, and
+// PUT_SYNC skips it when size and mtime match the host file's and
+// otherwise rewrites only the blocks whose contents differ.
+#define PUT_REPLACE 0
+#define PUT_APPEND  1
+#define PUT_SYNC    2
+int put_file(volume_t *v, const char *host_src, const char *fs_dest,
+             int mode, int verbose);
+
+// The quiet core of put_file(): stores what fd holds (read to its end
+// when it is not a regular file) and prints nothing.  Returns 0, or -1
+// with errno set: ENOSPC when the image is full, EINVAL for an empty
+// name, ENAMETOOLONG, EISDIR, EOPNOTSUPP for an append to a compressed
+// file, EFBIG, EROFS, EIO for corrupt metadata, or what I/O reported.
+// info (may be NULL) receives what -v prints.
+typedef struct {
+    uint32_t blocks;
+    uint32_t extents;
+    uint32_t changed;     // blocks a sync rewrote; UINT32_MAX if no sync
+    int      compressed;
+    int      unchanged;   // a sync found size and mtime the same
+} put_info_t;
+int put_fd(volume_t *v, int fd, const char *fs_dest, int mode,
+           put_info_t *info);
+// Print (and clear) the journal events the core only counts: a replay
+// when the image was opened, a commit written in place
+void report_journal(volume_t *v);
+// Import the host tree under host_dir into fs_dir with one metadata
+// commit at the end, copying file data on nthreads workers
+int put_tree(volume_t *v, const char *host_dir, const char *fs_dir,
+             int nthreads, int verbose);
+// Recreate the tree under fs_dir in host_dir, copying files on nthreads
+// workers (0 = one per CPU)
+int get_tree(volume_t *v, const char *fs_dir, const char *host_dir,
+             int nthreads);
+
+// Run fn(arg) on nthreads threads (0 = one per CPU), never more than
+// njobs.  The calling thread is one of them.
+void run_pool(void *(*fn)(void *), void *arg, int nthreads, size_t njobs);
+
+// Check every directory and FAT chain on nthreads workers (0 = one per
+// CPU), reporting problems on out and fixing them when repair is set.
+// Returns FSCK_CLEAN, FSCK_FIXED or FSCK_ERRORS, or -1 if the check
+// itself could not run.
+#define FSCK_CLEAN  0
+#define FSCK_FIXED  1
+#define FSCK_ERRORS 4
+int check_volume(volume_t *v, int nthreads, int repair, FILE *out);
+
+// Rewrite fragmented file and directory chains into contiguous runs,
+// packed towards the front of the image in directory order, and report
+// the fragmentation before and after on out.  With dry_run set nothing
+// is written; the report shows what a real run would achieve.
+int defrag_volume(volume_t *v, int dry_run, int verbose, FILE *out);
+
+// Write the tree under fs_dir to out_fd as a ustar archive (export.c).
+// Every chain is resolved first; file data is then read in ascending
+// block order, runs of nearby extents in one read, with files written
+// out as they complete.  verbose lists members on stderr.  Returns 0,
+// or -1 if the archive could not be written or a file was left out.
+int export_tree(volume_t *v, const char *fs_dir, int out_fd, int verbose);
+
+// Search the tree under fs_dir (find.c): one walk from its first block,
+// with directories spread over nthreads workers (0 = one per CPU) that
+// steal from each other's queues.  Every entry passing all the tests in
+// flt is written to out_fd as its full path followed by flt->sep, in no
+// particular order.  Returns 0, or -1 if fs_dir is not a directory, a
+// directory could not be read or the output failed.
+typedef struct {
+    const char *name;          // fnmatch() pattern for the name, or NULL
+    uint8_t     type_mask;     // DE_FILE, DE_DIR or both
+    uint64_t    min_size;      // a narrower range than 0..UINT64_MAX
+    uint64_t    max_size;      //   matches files only
+    uint8_t     mtime_from[7]; // inclusive bounds in the on-disk time
+    uint8_t     mtime_to[7];   //   form, compared as bytes
+    char        sep;           // '\n', or '\0' for xargs -0
+} find_filter_t;
+
+int find_tree(volume_t *v, const char *fs_dir, const find_filter_t *flt,
+              int out_fd, int nthreads);
+
+// Remove --stats / --stats=json / --stats=text from argv, shifting the
+// rest down.  Returns STATS_OFF, STATS_TEXT or STATS_JSON, or -1 for an
+// unknown --stats= value.
+#define STATS_OFF  0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+int take_stats_option(int *argc, char **argv);
+
+// Parse a byte count with an optional K, M or G suffix; -1 if malformed
+int parse_size(const char *s, uint64_t *out);
 
 #endif // FS_H
@@ -0,0 +1,463 @@
+// fsck.c -- cross-check directory entries against the FAT
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+
+#define ORPHAN_CHUNK (1u << 16)   // blocks per orphan-scan job
+
+// --- Chain walking ---
+// Every block carries the id of the entry whose chain reached it first;
+// ids are handed out as entries are found and claims are atomic, so
+// workers can walk chains concurrently.  A claim that hits a block with
+// our own id is a cycle, anyone else's a cross-link.
+enum { F_NONE, F_RANGE, F_UNALLOC, F_CROSS, F_CYCLE };
+
+typedef struct {
+    uint32_t len;     // blocks claimed before any fault
+    uint32_t last;    // last claimed block
+    int      fault;
+    uint32_t at;      // block where the fault was found
+} walk_t;
+
+typedef struct {
+    char    *path;
+    uint64_t entry_off;   // image offset of the entry; 0 for the root
+    uint32_t id;
+    int      is_dir;
+    int      compressed;  // file stored as compressed chunks
+    uint32_t start, block_count, size;
+    walk_t   w;
+} issue_t;
+
+typedef struct {
+    uint32_t start;
+    uint32_t blocks;      // good blocks in the directory's chain
+    char    *path;
+} dir_job_t;
+
+typedef struct {
+    image_t         *img;
+    fat_cache_t     *fc;
+    uint32_t         meta_end;    // superblock and FAT lie below this
+    uint32_t        *owner;       // per block; 0 = unclaimed
+    uint32_t         next_id;
+
+    pthread_mutex_t  lock;        // guards everything below
+    pthread_cond_t   more;
+    dir_job_t       *jobs;
+    size_t           njobs, cap_jobs;
+    size_t           active;      // jobs queued or being scanned
+    issue_t         *issues;
+    size_t           nissues, cap_issues;
+    int              failed;      // out of memory or unreadable directory
+
+    uint64_t         n_dirs, n_files, n_blocks;
+    uint32_t         scan_next;   // orphan scan: next chunk
+    uint64_t         n_orphans;
+} fsck_t;
+
+static void walk_chain(fsck_t *f, uint32_t id, uint32_t start, walk_t *w) {
+    memset(w, 0, sizeof(*w));
+    w->last = FAT_EOF;
+    for (uint32_t b = start; b != FAT_EOF; ) {
+        w->at = b;
+        if (b < f->meta_end || b >= f->fc->nblocks) { w->fault = F_RANGE; break; }
+        uint32_t next = fat_get(f->fc, b);
+        if (next == FAT_FREE || next == FAT_RESERVED) {
+            w->fault = F_UNALLOC;
+            break;
+        }
+        uint32_t prev = 0;
+        if (!__atomic_compare_exchange_n(&f->owner[b], &prev, id, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            w->fault = prev == id ? F_CYCLE : F_CROSS;
+            break;
+        }
+        w->len++;
+        w->last = b;
+        b = next;
+    }
+    STAT_ADD(fat_entries, w->len + (w->fault != F_NONE));
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t a = strlen(dir), b = strlen(name);
+    char *p = malloc(a + b + 2);
+    if (!p) return NULL;
+    memcpy(p, dir, a);
+    p[a] = '/';
+    memcpy(p + a + 1, name, b + 1);
+    return p;
+}
+
+// --- Shared state (under f->lock) ---
+static int push_dir(fsck_t *f, uint32_t start, uint32_t blocks, char *path) {
+    pthread_mutex_lock(&f->lock);
+    if (f->njobs == f->cap_jobs) {
+        size_t cap = f->cap_jobs ? f->cap_jobs * 2 : 64;
+        dir_job_t *grown = realloc(f->jobs, cap * sizeof(*grown));
+        if (!grown) {
+            f->failed = 1;
+            pthread_mutex_unlock(&f->lock);
+            return -1;
+        }
+        f->jobs = grown;
+        f->cap_jobs = cap;
+    }
+    f->jobs[f->njobs++] = (dir_job_t){ start, blocks, path };
+    f->active++;
+    pthread_cond_signal(&f->more);
+    pthread_mutex_unlock(&f->lock);
+    return 0;
+}
+
+static void add_issue(fsck_t *f, const issue_t *is) {
+    pthread_mutex_lock(&f->lock);
+    if (f->nissues == f->cap_issues) {
+        size_t cap = f->cap_issues ? f->cap_issues * 2 : 16;
+        issue_t *grown = realloc(f->issues, cap * sizeof(*grown));
+        if (!grown) {
+            f->failed = 1;
+            pthread_mutex_unlock(&f->lock);
+            free(is->path);
+            return;
+        }
+        f->issues = grown;
+        f->cap_issues = cap;
+    }
+    f->issues[f->nissues++] = *is;
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Whether the entry's block_count, and a file's size, match its chain
+// (a compressed file's size is its uncompressed length)
+static int sizes_agree(const fsck_t *f, const issue_t *is) {
+    if (is->block_count != is->w.len) return 0;
+    if (is->is_dir || is->compressed) return 1;
+    uint32_t bs = f->img->sb.block_size;
+    return (uint64_t)is->w.len == ((uint64_t)is->size + bs - 1) / bs;
+}
+
+static int entry_ok(const fsck_t *f, const issue_t *is) {
+    return is->w.fault == F_NONE && sizes_agree(f, is);
+}
+
+// --- Directory walk ---
+static void scan_dir(fsck_t *f, const dir_job_t *job) {
+    dir_iter_t it;
+    dir_iter_init(&it, f->img, f->fc, job->start, job->blocks);
+    const uint8_t *raw;
+    while ((raw = dir_iter_next(&it)) != NULL) {
+        uint8_t st = dirent_status(raw);
+        uint32_t start = dirent_start(raw);
+        char name[MAX_NAME_LEN + 1];
+        memcpy(name, dirent_name(raw), MAX_NAME_LEN);
+        name[MAX_NAME_LEN] = '\0';
+
+        // The root's "." points back at the root itself
+        if (start == job->start || strcmp(name, ".") == 0 ||
+            strcmp(name, "..") == 0)
+            continue;
+
+        issue_t is;
+        memset(&is, 0, sizeof(is));
+        is.entry_off   = dir_iter_offset(&it);
+        is.is_dir      = (st & DE_DIR) != 0;
+        is.compressed  = !is.is_dir && (st & DE_COMPRESSED) != 0;
+        is.start       = start;
+        is.block_count = dirent_blocks(raw);
+        is.size        = dirent_size(raw);
+        is.id          = __atomic_add_fetch(&f->next_id, 1, __ATOMIC_RELAXED);
+        if (start == FAT_EOF) {
+            is.w.last = FAT_EOF;          // empty file: owns nothing
+        } else {
+            walk_chain(f, is.id, start, &is.w);
+        }
+        __atomic_add_fetch(&f->n_blocks, is.w.len, __ATOMIC_RELAXED);
+        __atomic_add_fetch(is.is_dir ? &f->n_dirs : &f->n_files, 1,
+                           __ATOMIC_RELAXED);
+
+        int ok = entry_ok(f, &is);
+        int descend = is.is_dir && is.w.len > 0;
+        if (!ok || descend) {
+            char *path = join_path(job->path, name);
+            if (!path) {
+                pthread_mutex_lock(&f->lock);
+                f->failed = 1;
+                pthread_mutex_unlock(&f->lock);
+                continue;
+            }
+            if (descend) {
+                char *dpath = ok ? path : strdup(path);
+                if (dpath && push_dir(f, start, is.w.len, dpath) != 0)
+                    free(dpath);
+            }
+            if (!ok) {
+                is.path = path;
+                add_issue(f, &is);
+            }
+        }
+    }
+    if (it.error) {
+        pthread_mutex_lock(&f->lock);
+        f->failed = 1;
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+static void *dir_worker(void *arg) {
+    fsck_t *f = arg;
+    pthread_mutex_lock(&f->lock);
+    for (;;) {
+        while (f->njobs == 0 && f->active > 0)
+            pthread_cond_wait(&f->more, &f->lock);
+        if (f->njobs == 0) break;           // nothing queued or running
+        dir_job_t job = f->jobs[--f->njobs];
+        pthread_mutex_unlock(&f->lock);
+
+        scan_dir(f, &job);
+        free(job.path);
+
+        pthread_mutex_lock(&f->lock);
+        if (--f->active == 0) pthread_cond_broadcast(&f->more);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return NULL;
+}
+
+// --- Orphans ---
+// Allocated in the FAT but reached by no chain
+static void *orphan_worker(void *arg) {
+    fsck_t *f = arg;
+    uint64_t found = 0;
+    for (;;) {
+        uint32_t chunk = __atomic_fetch_add(&f->scan_next, 1, __ATOMIC_RELAXED);
+        uint64_t lo = (uint64_t)chunk * ORPHAN_CHUNK;
+        if (lo >= f->fc->nblocks) break;
+        uint64_t hi = lo + ORPHAN_CHUNK;
+        if (hi > f->fc->nblocks) hi = f->fc->nblocks;
+        if (lo < f->meta_end) lo = f->meta_end;
+        for (uint64_t b = lo; b < hi; b++) {
+            uint32_t v = f->fc->entries[b];
+            if (v != FAT_FREE && v != FAT_RESERVED && f->owner[b] == 0)
+                found++;
+        }
+    }
+    __atomic_add_fetch(&f->n_orphans, found, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// --- Repair ---
+// Cut the chain at the first fault, then to the length its size needs,
+// and make the entry agree with what is left
+static int repair_issue(fsck_t *f, issue_t *is) {
+    fat_cache_t *fc = f->fc;
+    uint32_t bs = f->img->sb.block_size;
+    uint32_t len = is->w.len;
+
+    if (is->w.fault != F_NONE) {
+        if (len > 0) fat_set(fc, is->w.last, FAT_EOF);
+        else         is->start = FAT_EOF;
+    }
+    if (!is->is_dir) {
+        uint64_t need = is->compressed ? is->block_count
+                                       : ((uint64_t)is->size + bs - 1) / bs;
+        if (len > need) {
+            // Keep the first `need` blocks and free the rest
+            uint32_t b = is->start, tail;
+            if (need == 0) {
+                tail = b;
+                is->start = FAT_EOF;
+            } else {
+                for (uint64_t i = 1; i < need; i++) b = fat_get(fc, b);
+                tail = fat_get(fc, b);
+                fat_set(fc, b, FAT_EOF);
+            }
+            for (uint32_t i = need; i < len && tail != FAT_EOF; i++) {
+                uint32_t next = fat_get(fc, tail);
+                f->owner[tail] = 0;
+                fat_set(fc, tail, FAT_FREE);
+                tail = next;
+            }
+            len = (uint32_t)need;
+        }
+        if (!is->compressed && (uint64_t)is->size > (uint64_t)len * bs)
+            is->size = len * bs;
+    }
+    is->block_count = len;
+
+    // The entry is staged with the FAT changes, so a journalled image
+    // takes the whole repair in one commit
+    uint8_t raw[DIR_ENTRY_SIZE];
+    if (read_image(f->img, is->entry_off, raw, sizeof(raw)) != 0) return -1;
+    // A hashed directory cut short would have its entries placed for
+    // the old size; plain scans find them wherever they are
+    if (is->is_dir) raw[0] &= ~DE_HASHED;
+    put_be32(raw + 1, is->start);
+    put_be32(raw + 5, is->block_count);
+    put_be32(raw + 9, is->size);
+    return write_meta(f->img, is->entry_off, raw, sizeof(raw));
+}
+
+static void describe(FILE *out, const fsck_t *f, const issue_t *is) {
+    const char *what = is->is_dir ? "directory" : "file";
+    switch (is->w.fault) {
+    case F_RANGE:
+        fprintf(out, "%s: %s chain leaves the data area at block %u\n",
+                is->path, what, is->w.at);
+        break;
+    case F_UNALLOC:
+        fprintf(out, "%s: %s chain runs into unallocated block %u\n",
+                is->path, what, is->w.at);
+        break;
+    case F_CROSS:
+        fprintf(out, "%s: %s is cross-linked at block %u\n",
+                is->path, what, is->w.at);
+        break;
+    case F_CYCLE:
+        fprintf(out, "%s: %s chain loops back to block %u\n",
+                is->path, what, is->w.at);
+        break;
+    }
+    if (!sizes_agree(f, is))
+        fprintf(out, "%s: entry says %u blocks, %u bytes; chain has %u blocks\n",
+                is->path, is->block_count, is->size, is->w.len);
+}
+
+static int by_path(const void *a, const void *b) {
+    return strcmp(((const issue_t *)a)->path, ((const issue_t *)b)->path);
+}
+
+int check_volume(volume_t *v, int nthreads, int repair, FILE *out) {
+    image_t *img = &v->img;
+    const superblock_t *sb = &img->sb;
+    if (repair && !img->writable) {
+        fprintf(stderr, "Image is read-only\n");
+        return -1;
+    }
+    fat_cache_t *fc = volume_fat(v);
+    if (!fc) {
+        fprintf(stderr, "Error reading FAT\n");
+        return -1;
+    }
+    // Repairs must not depend on which worker reached a shared block
+    // first, so they run on one thread.
+    if (repair) nthreads = 1;
+    // Committing repairs rewrites the summary, so note its state first
+    const int stale = fc->summary == SUMMARY_STALE;
+
+    fsck_t f;
+    memset(&f, 0, sizeof(f));
+    f.img      = img;
+    f.fc       = fc;
+    f.meta_end = sb->fat_start + sb->fat_blocks;
+    f.next_id  = 1;   // the root
+    f.owner    = calloc((size_t)fc->nblocks + 1, sizeof(uint32_t));
+    char *root_path = strdup("");
+    if (!f.owner || !root_path) {
+        fprintf(stderr, "Out of memory\n");
+        free(f.owner);
+        free(root_path);
+        return -1;
+    }
+    pthread_mutex_init(&f.lock, NULL);
+    pthread_cond_init(&f.more, NULL);
+
+    // The root's chain comes from the superblock, not an entry
+    walk_t rw;
+    walk_chain(&f, 1, sb->root_start, &rw);
+    f.n_blocks = rw.len;
+    f.n_dirs   = 1;
+    int problems = 0;
+    if (rw.fault != F_NONE || rw.len != sb->root_blocks) {
+        issue_t is = { .path = "/", .is_dir = 1, .start = sb->root_start,
+                       .block_count = sb->root_blocks, .w = rw };
+        describe(out, &f, &is);
+        problems++;
+    }
+
+    if (rw.len > 0 && push_dir(&f, sb->root_start, rw.len, root_path) == 0) {
+        // Workers pull directories until the queue drains
+        run_pool(dir_worker, &f, nthreads, SIZE_MAX);
+    } else {
+        free(root_path);
+    }
+    run_pool(orphan_worker, &f, nthreads,
+             fc->nblocks / ORPHAN_CHUNK + 1);
+
+    int rc = FSCK_CLEAN;
+    if (f.failed) {
+        fprintf(stderr, "Error reading directory entries\n");
+        rc = -1;
+    }
+
+    // Report (and fix) in path order so runs are comparable.  Repairs
+    // are committed in batches that fit a journal.
+    qsort(f.issues, f.nissues, sizeof(issue_t), by_path);
+    size_t fixed = 0;
+    for (size_t i = 0; i < f.nissues; i++) {
+        issue_t *is = &f.issues[i];
+        describe(out, &f, is);
+        problems++;
+        if (repair && rc >= 0) {
+            if (repair_issue(&f, is) != 0 ||
+                (++fixed % JOURNAL_BATCH == 0 && sync_volume(v) != 0))
+            {
+                fprintf(stderr, "%s: repair failed\n", is->path);
+                rc = -1;
+            } else {
+                fprintf(out, "%s: fixed (%u blocks, %u bytes)\n",
+                        is->path, is->block_count, is->size);
+            }
+        }
+    }
+
+    if (f.n_orphans) {
+        fprintf(out, "%llu allocated block(s) belong to no file\n",
+                (unsigned long long)f.n_orphans);
+        problems++;
+        if (repair && rc >= 0) {
+            for (uint32_t b = f.meta_end; b < fc->nblocks; b++) {
+                uint32_t val = fat_get(fc, b);
+                if (val != FAT_FREE && val != FAT_RESERVED && f.owner[b] == 0)
+                    fat_set(fc, b, FAT_FREE);
+            }
+            fprintf(out, "freed %llu orphaned block(s)\n",
+                    (unsigned long long)f.n_orphans);
+        }
+    }
+
+    // A summary that disagrees with the FAT was left by a writer that
+    // did not keep it; the commit below writes a fresh one
+    if (stale) {
+        fprintf(out, "Free-space summary does not match the FAT\n");
+        problems++;
+    }
+    if (repair && rc >= 0 && sync_volume(v) != 0) {
+        fprintf(stderr, "Failed to write repairs\n");
+        rc = -1;
+    }
+    if (stale && repair && rc >= 0)
+        fprintf(out, "rewrote the free-space summary\n");
+
+    fprintf(out, "%llu directories, %llu files, %llu blocks in use, "
+                 "%d problem(s)%s\n",
+            (unsigned long long)f.n_dirs, (unsigned long long)f.n_files,
+            (unsigned long long)f.n_blocks, problems,
+            problems && repair && rc >= 0 ? " fixed" : "");
+    if (rc == 0 && problems) rc = repair ? FSCK_FIXED : FSCK_ERRORS;
+
+    for (size_t i = 0; i < f.nissues; i++) free(f.issues[i].path);
+    free(f.issues);
+    free(f.jobs);
+    free(f.owner);
+    pthread_mutex_destroy(&f.lock);
+    pthread_cond_destroy(&f.more);
+    return rc;
+}
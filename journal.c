@@ -0,0 +1,393 @@
+// journal.c -- write-ahead journal for directory, superblock and FAT blocks
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+
+// On-image layout, from the first block of the region: an 8-byte magic,
+// the commit's sequence number, the number of blocks n, a checksum, and
+// n big-endian home block numbers (spilling into as many blocks as they
+// need); then the n block images in the same order.  The checksum covers
+// everything after it, so a commit torn by a crash never replays.
+#define JN_MAGIC  "CSC360JL"
+#define JN_HEADER 20
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Checksum of a commit of len bytes: its sequence number and count, then
+// everything after the checksum field
+static uint32_t commit_sum(const uint8_t *buf, size_t len) {
+    return fnv1a(fnv1a(2166136261u, buf + 8, 8), buf + JN_HEADER,
+                 len - JN_HEADER);
+}
+
+// Blocks taken by the header and home list of an n-block commit
+static uint32_t desc_blocks(uint32_t bs, uint32_t n) {
+    return (uint32_t)((JN_HEADER + 4ull * n + bs - 1) / bs);
+}
+
+// --- Staging ---
+// Index of the first staged block >= b
+static uint32_t staged_pos(const journal_t *jn, uint32_t b) {
+    uint32_t lo = 0, hi = jn->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (jn->home[mid] < b) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Staged copy of block b, read from the image when first touched
+static uint8_t *stage_block(image_t *img, uint32_t b) {
+    journal_t *jn = &img->jn;
+    const uint32_t bs = img->sb.block_size;
+    uint32_t i = staged_pos(jn, b);
+    if (i < jn->count && jn->home[i] == b) return jn->data[i];
+
+    if (jn->count == jn->cap) {
+        uint32_t cap = jn->cap ? jn->cap * 2 : 16;
+        uint32_t *home = realloc(jn->home, cap * sizeof(*home));
+        if (home) jn->home = home;
+        uint8_t **data = realloc(jn->data, cap * sizeof(*data));
+        if (data) jn->data = data;
+        if (!home || !data) return NULL;
+        jn->cap = cap;
+    }
+    uint8_t *blk = malloc(bs);
+    if (!blk || read_image(img, (uint64_t)b * bs, blk, bs) != 0) {
+        free(blk);
+        return NULL;
+    }
+    memmove(jn->home + i + 1, jn->home + i, (jn->count - i) * sizeof(uint32_t));
+    memmove(jn->data + i + 1, jn->data + i, (jn->count - i) * sizeof(uint8_t*));
+    jn->home[i] = b;
+    jn->data[i] = blk;
+    jn->count++;
+    return blk;
+}
+
+static void drop_staged(journal_t *jn) {
+    for (uint32_t i = 0; i < jn->count; i++) free(jn->data[i]);
+    jn->count = 0;
+}
+
+int write_meta(image_t *img, uint64_t off, const void *buf, size_t len) {
+    if (!img->sb.journal_blocks) return write_image(img, off, buf, len);
+    if (!img->writable) { errno = EBADF; return -1; }
+    if (off > img->size || len > img->size - off) {
+        errno = EINVAL;
+        return -1;
+    }
+    const uint32_t bs = img->sb.block_size;
+    const uint8_t *src = buf;
+    while (len > 0) {
+        uint32_t within = (uint32_t)(off % bs);
+        size_t n = bs - within < len ? bs - within : len;
+        uint8_t *blk = stage_block(img, (uint32_t)(off / bs));
+        if (!blk) return -1;
+        memcpy(blk + within, src, n);
+        off += n;
+        src += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int image_staged(const image_t *img, uint64_t off, uint64_t len) {
+    const journal_t *jn = &img->jn;
+    if (jn->count == 0 || len == 0) return 0;
+    const uint32_t bs = img->sb.block_size;
+    uint32_t i = staged_pos(jn, (uint32_t)(off / bs));
+    return i < jn->count && jn->home[i] <= (off + len - 1) / bs;
+}
+
+// Walk the staged blocks overlapping [off, off+len), copying one way
+static void overlay(const image_t *img, uint64_t off, uint8_t *buf,
+                    size_t len, int into_staged)
+{
+    const journal_t *jn = &img->jn;
+    const uint32_t bs = img->sb.block_size;
+    if (len == 0) return;
+    uint64_t last = (off + len - 1) / bs;
+    for (uint32_t i = staged_pos(jn, (uint32_t)(off / bs));
+         i < jn->count && jn->home[i] <= last; i++)
+    {
+        uint64_t from = (uint64_t)jn->home[i] * bs;
+        uint64_t lo = from > off ? from : off;
+        uint64_t hi = from + bs < off + len ? from + bs : off + len;
+        if (into_staged) memcpy(jn->data[i] + (lo - from), buf + (lo - off), hi - lo);
+        else             memcpy(buf + (lo - off), jn->data[i] + (lo - from), hi - lo);
+    }
+}
+
+void staged_read(const image_t *img, uint64_t off, void *buf, size_t len) {
+    overlay(img, off, buf, len, 0);
+}
+
+void staged_write(image_t *img, uint64_t off, const void *buf, size_t len) {
+    overlay(img, off, (uint8_t*)buf, len, 1);
+}
+
+// --- Commit ---
+// Keep the in-memory superblock and FAT copies (fallback mode, or a
+// read-only overlay) in step with block b
+static void patch_copies(image_t *img, uint32_t b, const uint8_t *data) {
+    if (img->map && !img->meta_copied) return;
+    const superblock_t *sb = &img->sb;
+    const uint32_t bs = sb->block_size;
+    uint64_t off = (uint64_t)b * bs;
+    if (off < SUPERBLOCK_SIZE)
+        memcpy(img->raw_sb + off, data,
+               SUPERBLOCK_SIZE - off < bs ? SUPERBLOCK_SIZE - off : bs);
+    if (b >= sb->fat_start && b < sb->fat_start + sb->fat_blocks)
+        memcpy(img->fat + (uint64_t)(b - sb->fat_start) * bs, data, bs);
+}
+
+static int write_home(image_t *img, uint32_t b, const uint8_t *data) {
+    const uint32_t bs = img->sb.block_size;
+    if (write_image(img, (uint64_t)b * bs, data, bs) != 0) return -1;
+    patch_copies(img, b, data);
+    return 0;
+}
+
+// Copy the staged blocks home and let them go
+static int checkpoint(image_t *img) {
+    journal_t *jn = &img->jn;
+    uint32_t n = jn->count;
+    jn->count = 0;  // so write_image() does not patch them into themselves
+    int rc = 0;
+    for (uint32_t i = 0; rc == 0 && i < n; i++)
+        rc = write_home(img, jn->home[i], jn->data[i]);
+    jn->count = n;
+    drop_staged(jn);
+    return rc;
+}
+
+int commit_journal(image_t *img, fat_cache_t *fc) {
+    journal_t *jn = &img->jn;
+    const superblock_t *sb = &img->sb;
+    const uint32_t bs = sb->block_size;
+    uint64_t t0 = phase_begin();
+    uint8_t *buf = NULL;
+    int rc = -1;
+
+    // Changed FAT blocks join the transaction in on-disk byte order, and
+    // the free-space summary with them
+    uint32_t fat_staged = 0;
+    for (uint32_t b = 0; fc && b < fc->fat_blocks; b++) {
+        if (!fc->dirty[b]) continue;
+        uint8_t *blk = stage_block(img, sb->fat_start + b);
+        if (!blk) goto out;
+        const uint32_t first = b * fc->per_block;
+        for (uint32_t i = 0; i < fc->per_block; i++)
+            put_be32(blk + 4 * i, fc->entries[first + i]);
+        STAT_ADD(fat_entries, fc->per_block);
+        fc->dirty[b] = 0;
+        fat_staged++;
+    }
+    if (fc && (fat_staged || fc->summary != SUMMARY_OK) &&
+        write_space_summary(img, fc, 1) != 0)
+        goto out;
+    if (jn->count == 0) { rc = 0; goto out; }
+
+    // The last checkpoint must be on disk before the journal that
+    // covers it is overwritten
+    if (jn->pending && fsync_image(img) != 0) goto out;
+    jn->pending = 0;
+
+    uint32_t desc = desc_blocks(bs, jn->count);
+    if (desc + jn->count > sb->journal_blocks) {
+        img->in_place = desc + jn->count;
+        // As flush_fat(): the summary is absent until the FAT is home
+        if (fat_staged && clear_space_summary(img) != 0) goto out;
+        if (checkpoint(img) == 0 &&
+            (!fat_staged || write_space_summary(img, fc, 0) == 0) &&
+            fsync_image(img) == 0)
+            rc = 0;
+        goto out;
+    }
+
+    // Header, home list and block images go out as one write, and the
+    // fsync after it is the commit
+    size_t len = (size_t)(desc + jn->count) * bs;
+    if (!(buf = calloc(1, len))) goto out;
+    memcpy(buf, JN_MAGIC, 8);
+    put_be32(buf + 8, jn->seq + 1);
+    put_be32(buf + 12, jn->count);
+    for (uint32_t i = 0; i < jn->count; i++) {
+        put_be32(buf + JN_HEADER + 4 * i, jn->home[i]);
+        memcpy(buf + (size_t)(desc + i) * bs, jn->data[i], bs);
+    }
+    put_be32(buf + 16, commit_sum(buf, len));
+    if (write_image(img, (uint64_t)sb->journal_start * bs, buf, len) != 0 ||
+        fsync_image(img) != 0)
+        goto out;
+    jn->seq++;
+
+    // Committed: a crash from here on is repaired by replay
+    if (checkpoint(img) != 0) goto out;
+    jn->pending = 1;
+    rc = 0;
+out:
+    free(buf);
+    phase_end(PH_COMMIT, t0);
+    return rc;
+}
+
+int open_journal(image_t *img) {
+    journal_t *jn = &img->jn;
+    const superblock_t *sb = &img->sb;
+    const uint32_t bs = sb->block_size;
+    const uint64_t base = (uint64_t)sb->journal_start * bs;
+    if (!sb->journal_blocks) return 0;
+
+    uint8_t *head = malloc(bs);
+    uint8_t *buf = NULL;
+    int rc = -1;
+    if (!head || read_image(img, base, head, bs) != 0) goto out;
+    rc = 0;
+    if (memcmp(head, JN_MAGIC, 8) != 0) goto out;  // empty
+
+    // A header, home list or checksum that does not hold up is a commit
+    // that never finished, so the image is as it was before it
+    uint32_t n = get_be32(head + 12);
+    uint32_t desc = n ? desc_blocks(bs, n) : 0;
+    if (n == 0 || n > sb->journal_blocks ||
+        desc + n > sb->journal_blocks)
+        goto out;
+    size_t len = (size_t)(desc + n) * bs;
+    rc = -1;
+    if (!(buf = malloc(len)) || read_image(img, base, buf, len) != 0)
+        goto out;
+    rc = 0;
+    if (commit_sum(buf, len) != get_be32(buf + 16)) goto out;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t b = get_be32(buf + JN_HEADER + 4 * i);
+        if (b >= sb->block_count || (uint64_t)b * bs + bs > img->size ||
+            (b >= sb->journal_start && b - sb->journal_start < sb->journal_blocks))
+            goto out;
+    }
+    jn->seq = get_be32(buf + 8);
+
+    rc = -1;
+    if (img->writable) {
+        // Copy the blocks home again (the copy may have been cut short),
+        // sync, and only then retire the journal
+        for (uint32_t i = 0; i < n; i++)
+            if (write_home(img, get_be32(buf + JN_HEADER + 4 * i),
+                           buf + (size_t)(desc + i) * bs) != 0)
+                goto out;
+        if (fsync_image(img) != 0 ||
+            write_image(img, base, "\0\0\0\0\0\0\0\0", 8) != 0)
+            goto out;
+        img->replayed = n;
+    } else {
+        // Read-only: serve the committed blocks from memory, with the
+        // superblock and FAT copied off the read-only mapping
+        if (img->map) {
+            uint64_t fat_len = (uint64_t)sb->fat_blocks * bs;
+            uint8_t *raw_sb = malloc(SUPERBLOCK_SIZE);
+            uint8_t *fat = malloc(fat_len);
+            if (!raw_sb || !fat) {
+                free(raw_sb);
+                free(fat);
+                goto out;
+            }
+            memcpy(raw_sb, img->raw_sb, SUPERBLOCK_SIZE);
+            memcpy(fat, img->fat, fat_len);
+            img->raw_sb = raw_sb;
+            img->fat = fat;
+            img->meta_copied = 1;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t b = get_be32(buf + JN_HEADER + 4 * i);
+            uint8_t *blk = stage_block(img, b);
+            if (!blk) goto out;
+            memcpy(blk, buf + (size_t)(desc + i) * bs, bs);
+            patch_copies(img, b, blk);
+        }
+    }
+    rc = 1;
+out:
+    free(buf);
+    free(head);
+    return rc;
+}
+
+int close_journal(image_t *img) {
+    journal_t *jn = &img->jn;
+    int rc = 0;
+    // Whatever is still staged was never committed
+    drop_staged(jn);
+    if (jn->pending) {
+        const uint64_t base = (uint64_t)img->sb.journal_start * img->sb.block_size;
+        if (fsync_image(img) != 0 ||
+            write_image(img, base, "\0\0\0\0\0\0\0\0", 8) != 0)
+            rc = -1;
+        jn->pending = 0;
+    }
+    free(jn->home);
+    free(jn->data);
+    memset(jn, 0, sizeof(*jn));
+    return rc;
+}
+
+// --- Creating a journal ---
+int add_journal(volume_t *v, FILE *out) {
+    image_t *img = &v->img;
+    superblock_t *sb = &img->sb;
+    const uint32_t bs = sb->block_size;
+    if (sb->journal_blocks) {
+        fprintf(out, "Image already has a %u-block journal at block %u\n",
+                sb->journal_blocks, sb->journal_start);
+        return 0;
+    }
+    fat_cache_t *fc = volume_fat(v);
+    if (!fc) {
+        fprintf(stderr, "Error reading FAT\n");
+        return -1;
+    }
+
+    // Room for every FAT block, the header and a run of directory blocks
+    uint32_t want = sb->fat_blocks + JOURNAL_DIR_BLOCKS;
+    uint32_t start = fat_first_run(fc, want);
+    if (start == FAT_EOF) {
+        fprintf(stderr, "No run of %u free blocks for a journal\n", want);
+        return -1;
+    }
+
+    // Reserve the run and make that durable before the superblock
+    // points at it, so a crash can only leak the blocks
+    uint8_t *zero = calloc(1, bs);
+    int rc = zero ? write_image(img, (uint64_t)start * bs, zero, bs) : -1;
+    free(zero);
+    for (uint32_t b = 0; rc == 0 && b < want; b++)
+        fat_set(fc, start + b, FAT_RESERVED);
+    if (rc == 0) rc = flush_fat(img, fc);
+    if (rc == 0) rc = fsync_image(img);
+
+    uint8_t be[8];
+    put_be32(be, start);
+    put_be32(be + 4, want);
+    if (rc == 0) rc = write_image(img, 30, be, sizeof(be));
+    if (rc == 0 && !img->map) memcpy(img->raw_sb + 30, be, sizeof(be));
+    if (rc == 0) rc = fsync_image(img);
+    if (rc != 0) {
+        perror("journal");
+        return -1;
+    }
+    sb->journal_start  = start;
+    sb->journal_blocks = want;
+    fprintf(out, "Added a %u-block journal at block %u\n", want, start);
+    return 0;
+}
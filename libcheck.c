@@ -0,0 +1,207 @@
+// libcheck.c -- libcsc360fs under concurrent readers, for `make check`
+//
+// usage: libcheck <image> <fs_dir> <host_dir>
+// fs_dir must hold a copy of every regular file in host_dir.  Reader
+// threads read random ranges of them and compare with the host copies
+// while the main thread puts and syncs them, in name order, as
+// /lib/w0, /lib/w1 ...  A listing callback calls back into the handle,
+// putting the last file as /lib/in_list.
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "csc360fs.h"
+
+#define NREADERS 8
+#define NREADS   2000
+#define NPUTS    24
+#define MAX_READ 65536
+
+typedef struct {
+    char     name[256];
+    char     host[4096];
+    uint8_t *data;
+    size_t   size;
+} file_t;
+
+static csc360fs_t *fs;
+static const char *fs_dir;
+static file_t     *files;
+static size_t      nfiles;
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(((const file_t *)a)->name, ((const file_t *)b)->name);
+}
+
+// Every regular file of dir, in name order
+static int load_files(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) { perror(dir); return -1; }
+    struct dirent *de;
+    size_t cap = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        if (nfiles == cap) {
+            cap = cap ? cap * 2 : 16;
+            files = realloc(files, cap * sizeof(*files));
+            if (!files) { perror("realloc"); return -1; }
+        }
+        file_t *f = &files[nfiles];
+        snprintf(f->name, sizeof(f->name), "%s", de->d_name);
+        snprintf(f->host, sizeof(f->host), "%s/%s", dir, de->d_name);
+        struct stat st;
+        int fd = open(f->host, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) { perror(f->host); return -1; }
+        f->size = (size_t)st.st_size;
+        f->data = malloc(f->size + 1);
+        if (!f->data ||
+            read(fd, f->data, f->size) != (ssize_t)f->size)
+        {
+            perror(f->host);
+            return -1;
+        }
+        close(fd);
+        nfiles++;
+    }
+    closedir(d);
+    if (nfiles == 0) { fprintf(stderr, "%s: no files\n", dir); return -1; }
+    qsort(files, nfiles, sizeof(*files), by_name);
+    return 0;
+}
+
+// --- Listing with callbacks into the handle ---
+typedef struct {
+    size_t seen;
+    int    failed;
+} list_t;
+
+static int on_entry(const csc360fs_stat_t *st, void *arg) {
+    list_t *l = arg;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", fs_dir, st->name);
+    csc360fs_stat_t again;
+    if (csc360fs_stat(fs, path, &again) != 0 || again.size != st->size) {
+        fprintf(stderr, "%s: stat in the callback failed\n", path);
+        l->failed = 1;
+    }
+    for (size_t i = 0; i < nfiles; i++) {
+        if (strcmp(files[i].name, st->name) != 0) continue;
+        if (st->size != files[i].size) {
+            fprintf(stderr, "%s: listed with size %u, want %zu\n", path,
+                    st->size, files[i].size);
+            l->failed = 1;
+        }
+        l->seen++;
+    }
+    // A writer inside the callback must not wait on the listing's lock
+    if (l->seen == 1 &&
+        csc360fs_put(fs, files[nfiles - 1].host, "/lib/in_list") != 0)
+    {
+        perror("put from the list callback");
+        l->failed = 1;
+    }
+    return 0;
+}
+
+// --- Readers ---
+static int check_range(const file_t *f, const char *path, uint64_t off,
+                       size_t len, uint8_t *buf)
+{
+    ssize_t got = csc360fs_read(fs, path, buf, len, off);
+    size_t want = off >= f->size ? 0
+                : len < f->size - off ? len : f->size - (size_t)off;
+    if (got < 0) {
+        fprintf(stderr, "%s: read at %llu: %s\n", path,
+                (unsigned long long)off, strerror(errno));
+        return -1;
+    }
+    if ((size_t)got != want || memcmp(buf, f->data + off, want) != 0) {
+        fprintf(stderr, "%s: %zu bytes at %llu differ (got %zd)\n", path,
+                len, (unsigned long long)off, got);
+        return -1;
+    }
+    return 0;
+}
+
+static void *reader(void *arg) {
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    uint8_t *buf = malloc(MAX_READ);
+    long failed = buf ? 0 : 1;
+    for (int i = 0; !failed && i < NREADS; i++) {
+        const file_t *f = &files[rand_r(&seed) % nfiles];
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", fs_dir, f->name);
+        uint64_t off = f->size ? (uint64_t)rand_r(&seed) % (f->size + 16) : 0;
+        size_t len = (size_t)rand_r(&seed) % MAX_READ;
+        if (check_range(f, path, off, len, buf) != 0) failed = 1;
+    }
+    free(buf);
+    return (void *)failed;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <image> <fs_dir> <host_dir>\n", argv[0]);
+        return 2;
+    }
+    fs_dir = argv[2];
+    if (load_files(argv[3]) != 0) return 1;
+    fs = csc360fs_open(argv[1], CSC360FS_RDWR);
+    if (!fs) { perror(argv[1]); return 1; }
+
+    int failed = 0;
+    list_t l = { 0, 0 };
+    if (csc360fs_list(fs, fs_dir, on_entry, &l) != 0) {
+        perror(fs_dir);
+        failed = 1;
+    } else if (l.failed || l.seen != nfiles) {
+        fprintf(stderr, "%s: listed %zu of %zu files\n", fs_dir, l.seen,
+                nfiles);
+        failed = 1;
+    }
+
+    pthread_t tid[NREADERS];
+    for (uintptr_t t = 0; t < NREADERS; t++)
+        pthread_create(&tid[t], NULL, reader, (void *)(t + 1));
+    for (int i = 0; i < NPUTS; i++) {
+        char dest[64];
+        snprintf(dest, sizeof(dest), "/lib/w%d", i);
+        if (csc360fs_put(fs, files[i % nfiles].host, dest) != 0 ||
+            (i % 6 == 5 && csc360fs_sync(fs) != 0))
+        {
+            perror(dest);
+            failed = 1;
+        }
+    }
+    for (int t = 0; t < NREADERS; t++) {
+        void *r;
+        pthread_join(tid[t], &r);
+        if (r) failed = 1;
+    }
+
+    // Everything put must read back whole
+    uint8_t *buf = malloc(MAX_READ);
+    for (int i = 0; buf && !failed && i < NPUTS; i++) {
+        char dest[64];
+        snprintf(dest, sizeof(dest), "/lib/w%d", i);
+        const file_t *f = &files[i % nfiles];
+        for (uint64_t off = 0; !failed && off < f->size; off += MAX_READ)
+            if (check_range(f, dest, off, MAX_READ, buf) != 0) failed = 1;
+    }
+    free(buf);
+    if (csc360fs_close(fs) != 0) {
+        perror("close");
+        failed = 1;
+    }
+    if (!failed)
+        printf("%d reads on %d threads beside %d puts\n",
+               NREADERS * NREADS, NREADERS, NPUTS);
+    return failed;
+}
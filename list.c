@@ -0,0 +1,292 @@
+// list.c -- directory listings behind disklist and diskshell's list
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fs.h"
+
+#define LIST_OUT       (256u << 10)  // output buffer
+#define LIST_LINE_MAX  (6 * PATH_BUF_SIZE + 256)  // longest escaped line
+
+// --- Output buffer ---
+// Lines are formatted by hand straight into one large buffer, which goes
+// to the stream with a single fwrite() whenever it fills up
+typedef struct {
+    FILE  *out;
+    int    format;
+    char  *buf;
+    size_t len;
+    int    failed;
+    char   path[PATH_BUF_SIZE];  // directory being listed; "" for the root
+    size_t plen;
+} lister_t;
+
+static void flush_out(lister_t *l) {
+    if (l->len && !l->failed && fwrite(l->buf, 1, l->len, l->out) != l->len) {
+        perror("write");
+        l->failed = 1;
+    }
+    l->len = 0;
+}
+
+// v in decimal, right-aligned in width characters padded with pad
+static char *put_uint(char *p, uint64_t v, int width, char pad) {
+    char tmp[20];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    for (int i = n; i < width; i++) *p++ = pad;
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+static char *put_2d(char *p, unsigned v) {
+    v %= 100;
+    p[0] = (char)('0' + v / 10);
+    p[1] = (char)('0' + v % 10);
+    return p + 2;
+}
+
+// "YYYY/MM/DD hh:mm:ss" from the 7-byte on-disk time, or with date_sep
+// '-' and mid 'T' the ISO 8601 form "YYYY-MM-DDThh:mm:ss"
+static char *put_time(char *p, const uint8_t t[7], char date_sep, char mid) {
+    unsigned year = ((unsigned)t[0] << 8) | t[1];
+    p = put_uint(p, year % 10000u, 4, '0');
+    *p++ = date_sep;
+    p = put_2d(p, t[2]);
+    *p++ = date_sep;
+    p = put_2d(p, t[3]);
+    *p++ = mid;
+    p = put_2d(p, t[4]);
+    *p++ = ':';
+    p = put_2d(p, t[5]);
+    *p++ = ':';
+    return put_2d(p, t[6]);
+}
+
+static char *put_str(char *p, const char *s, size_t n) {
+    memcpy(p, s, n);
+    return p + n;
+}
+
+// TSV fields escape the tab, newline and backslash that would break them
+static char *put_tsv(char *p, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        char c = s[i];
+        if (c == '\t')      { *p++ = '\\'; *p++ = 't'; }
+        else if (c == '\n') { *p++ = '\\'; *p++ = 'n'; }
+        else if (c == '\r') { *p++ = '\\'; *p++ = 'r'; }
+        else if (c == '\\') { *p++ = '\\'; *p++ = '\\'; }
+        else *p++ = c;
+    }
+    return p;
+}
+
+static char *put_json(char *p, const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c < 0x20) {
+            p = put_str(p, "\\u00", 4);
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        } else {
+            *p++ = (char)c;
+        }
+    }
+    return p;
+}
+
+// Full path of an entry in the directory being listed
+static char *put_path(lister_t *l, char *p, const char *name, size_t nlen,
+                      char *(*put)(char *, const char *, size_t))
+{
+    p = put(p, l->path, l->plen);
+    *p++ = '/';
+    return put(p, name, nlen);
+}
+
+static void list_entry(lister_t *l, const uint8_t *raw) {
+    if (l->len + LIST_LINE_MAX > LIST_OUT) flush_out(l);
+    char *p = l->buf + l->len;
+
+    const char *name = dirent_name(raw);
+    size_t nlen = strnlen(name, MAX_NAME_LEN);
+    int is_dir = (dirent_status(raw) & DE_DIR) != 0;
+    switch (l->format) {
+    case LIST_TEXT:
+        // "%c %10u %-30.30s %s\n", as the listing has always been
+        *p++ = is_dir ? 'D' : 'F';
+        *p++ = ' ';
+        p = put_uint(p, dirent_size(raw), 10, ' ');
+        *p++ = ' ';
+        p = put_str(p, name, nlen);
+        memset(p, ' ', MAX_NAME_LEN - nlen);
+        p += MAX_NAME_LEN - nlen;
+        *p++ = ' ';
+        p = put_time(p, dirent_ctime(raw), '/', ' ');
+        break;
+    case LIST_TSV:
+        p = put_path(l, p, name, nlen, put_tsv);
+        p = put_str(p, is_dir ? "\tdir\t" : "\tfile\t", is_dir ? 5 : 6);
+        p = put_uint(p, dirent_size(raw), 0, 0);
+        *p++ = '\t';
+        p = put_uint(p, dirent_blocks(raw), 0, 0);
+        *p++ = '\t';
+        p = put_time(p, dirent_ctime(raw), '-', 'T');
+        *p++ = '\t';
+        p = put_time(p, dirent_mtime(raw), '-', 'T');
+        break;
+    case LIST_JSON:
+        p = put_str(p, "{\"path\":\"", 9);
+        p = put_path(l, p, name, nlen, put_json);
+        p = put_str(p, is_dir ? "\",\"type\":\"dir\",\"size\":"
+                              : "\",\"type\":\"file\",\"size\":",
+                    is_dir ? 22 : 23);
+        p = put_uint(p, dirent_size(raw), 0, 0);
+        p = put_str(p, ",\"blocks\":", 10);
+        p = put_uint(p, dirent_blocks(raw), 0, 0);
+        p = put_str(p, ",\"ctime\":\"", 10);
+        p = put_time(p, dirent_ctime(raw), '-', 'T');
+        p = put_str(p, "\",\"mtime\":\"", 11);
+        p = put_time(p, dirent_mtime(raw), '-', 'T');
+        p = put_str(p, "\"}", 2);
+        break;
+    }
+    *p++ = '\n';
+    l->len = (size_t)(p - l->buf);
+}
+
+// --- Walk ---
+typedef struct {
+    uint32_t start, blocks;
+    char     name[MAX_NAME_LEN + 1];
+} subdir_t;
+
+// List one directory, then (recursively) each subdirectory in the order
+// they appear, the way ls -R does
+static int list_one(lister_t *l, const fat_cache_t *fc, image_t *img,
+                    uint32_t start, uint32_t blocks, int recursive, int depth)
+{
+    if (recursive && l->format == LIST_TEXT) {
+        // Every directory after the first is set off by a blank line
+        if (l->len + LIST_LINE_MAX > LIST_OUT) flush_out(l);
+        char *p = l->buf + l->len;
+        if (depth > 0) *p++ = '\n';
+        p = put_str(p, l->plen ? l->path : "/", l->plen ? l->plen : 1);
+        p = put_str(p, ":\n", 2);
+        l->len = (size_t)(p - l->buf);
+    }
+
+    subdir_t *subs = NULL;
+    size_t nsubs = 0, cap = 0;
+    dir_iter_t it;
+    dir_iter_init(&it, img, fc, start, blocks);
+    const uint8_t *raw;
+    while ((raw = dir_iter_next(&it)) != NULL) {
+        const char *name = dirent_name(raw);
+        // "." and ".." are kept out of the machine-readable forms, and
+        // are never descended into (nor is the root's "." by any name)
+        int dots = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+        if (l->format == LIST_TEXT || !dots) list_entry(l, raw);
+        if (!recursive || !(dirent_status(raw) & DE_DIR) || dots ||
+            name[0] == '\0' || dirent_start(raw) == start)
+            continue;
+        if (nsubs == cap) {
+            cap = cap ? cap * 2 : 16;
+            subdir_t *grown = realloc(subs, cap * sizeof(*subs));
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                free(subs);
+                return -1;
+            }
+            subs = grown;
+        }
+        subdir_t *s = &subs[nsubs++];
+        s->start  = dirent_start(raw);
+        s->blocks = dirent_blocks(raw);
+        memcpy(s->name, name, MAX_NAME_LEN);
+        s->name[MAX_NAME_LEN] = '\0';
+    }
+    if (it.error) {
+        fprintf(stderr, "Error reading directory entries\n");
+        free(subs);
+        return -1;
+    }
+
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && !l->failed && i < nsubs; i++) {
+        size_t plen = l->plen, nlen = strlen(subs[i].name);
+        if (depth + 1 > MAX_TREE_DEPTH || plen + 1 + nlen >= PATH_BUF_SIZE) {
+            fprintf(stderr, "%s/%s: directory tree too deep\n",
+                    l->path, subs[i].name);
+            rc = -1;
+            break;
+        }
+        l->path[plen] = '/';
+        memcpy(l->path + plen + 1, subs[i].name, nlen + 1);
+        l->plen = plen + 1 + nlen;
+        rc = list_one(l, fc, img, subs[i].start, subs[i].blocks, 1, depth + 1);
+        l->plen = plen;
+        l->path[plen] = '\0';
+    }
+    free(subs);
+    return rc;
+}
+
+int list_tree(volume_t *v, const char *path, int format, int recursive,
+              FILE *out)
+{
+    dir_ref_t dir;
+    if (resolve_dir(&v->dc, path, &dir) != 0) {
+        fprintf(stderr, "Directory not found.\n");
+        return -1;
+    }
+
+    lister_t *l = malloc(sizeof(*l));
+    char *buf = malloc(LIST_OUT);
+    if (!l || !buf) {
+        fprintf(stderr, "Out of memory\n");
+        free(l);
+        free(buf);
+        return -1;
+    }
+    l->out    = out;
+    l->format = format;
+    l->buf    = buf;
+    l->len    = 0;
+    l->failed = 0;
+
+    // Paths are printed as given, less trailing slashes
+    size_t plen = strlen(path);
+    while (plen > 0 && path[plen - 1] == '/') plen--;
+    if (plen >= PATH_BUF_SIZE) plen = PATH_BUF_SIZE - 1;
+    memcpy(l->path, path, plen);
+    l->path[plen] = '\0';
+    l->plen = plen;
+
+    if (format == LIST_TSV) {
+        static const char head[] = "path\ttype\tsize\tblocks\tctime\tmtime\n";
+        l->len = sizeof(head) - 1;
+        memcpy(buf, head, l->len);
+    }
+
+    // Stream the raw slots, decoding only the fields that are printed
+    int rc = list_one(l, v->dc.fc, &v->img, dir.ent.start_block,
+                      dir.ent.block_count, recursive, 0);
+    flush_out(l);
+    if (l->failed) rc = -1;
+    free(buf);
+    free(l);
+    return rc;
+}
+
+int list_dir(volume_t *v, const char *path, FILE *out) {
+    return list_tree(v, path, LIST_TEXT, 0, out);
+}
@@ -0,0 +1,437 @@
+// mkimage.c -- build synthetic images of any size for testing and benchmarks
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fs.h"
+
+#define FILL_CHUNK (1u << 20)
+
+// --- Options ---
+enum { DIST_FIXED, DIST_UNIFORM, DIST_LOG };
+
+typedef struct {
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t root_blocks;
+    uint32_t depth;        // directory levels below the root
+    uint32_t fanout;       // subdirectories per directory
+    uint32_t files;        // files per directory
+    int      dist;
+    uint64_t size_min;
+    uint64_t size_max;
+    uint32_t frag;         // 0..100: chance of a gap before each block
+    uint32_t fill;         // stop adding files past this % of data blocks
+    uint64_t seed;
+    int      hashed;       // subdirectories use the hashed layout
+    int      journal;      // reserve a journal after the root
+} mk_opts_t;
+
+typedef struct {
+    image_t      img;
+    fat_cache_t  fat;
+    const mk_opts_t *o;
+    uint64_t     rng;
+    uint32_t     cursor;       // allocation cursor for file blocks
+    uint32_t     data_blocks;  // blocks after the root directory
+    uint32_t     used;
+    int          full;
+    uint8_t      stamp[7];
+    uint8_t     *fill_buf;
+    uint32_t    *chain;
+    // summary
+    uint32_t     n_files, n_dirs, n_extents;
+    uint64_t     n_bytes;
+} mk_t;
+
+// xorshift64*: fast, deterministic for a given seed
+static uint64_t next_rand(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    *s = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// "64", "4K", "16M", "1G"
+static int parse_u32(const char *s, uint32_t *out) {
+    uint64_t v;
+    if (parse_size(s, &v) != 0 || v > UINT32_MAX) return -1;
+    *out = (uint32_t)v;
+    return 0;
+}
+
+// fixed:N | uniform:MIN:MAX | log:MIN:MAX
+static int parse_dist(const char *s, mk_opts_t *o) {
+    char buf[64];
+    if (strlen(s) >= sizeof(buf)) return -1;
+    strcpy(buf, s);
+    char *save = NULL;
+    char *kind = strtok_r(buf, ":", &save);
+    char *a = strtok_r(NULL, ":", &save);
+    char *b = strtok_r(NULL, ":", &save);
+    if (!kind || !a) return -1;
+    if (strcmp(kind, "fixed") == 0 && !b) {
+        o->dist = DIST_FIXED;
+        if (parse_size(a, &o->size_min) != 0) return -1;
+        o->size_max = o->size_min;
+    } else if ((strcmp(kind, "uniform") == 0 || strcmp(kind, "log") == 0) && b) {
+        o->dist = kind[0] == 'u' ? DIST_UNIFORM : DIST_LOG;
+        if (parse_size(a, &o->size_min) != 0 ||
+            parse_size(b, &o->size_max) != 0 ||
+            o->size_min > o->size_max)
+            return -1;
+        if (o->dist == DIST_LOG && o->size_min == 0) o->size_min = 1;
+    } else {
+        return -1;
+    }
+    return o->size_max <= UINT32_MAX ? 0 : -1;
+}
+
+static uint32_t draw_size(mk_t *m) {
+    const mk_opts_t *o = m->o;
+    uint64_t span = o->size_max - o->size_min;
+    if (o->dist == DIST_FIXED || span == 0) return (uint32_t)o->size_min;
+    if (o->dist == DIST_UNIFORM)
+        return (uint32_t)(o->size_min + next_rand(&m->rng) % (span + 1));
+
+    // Log-uniform: pick a power of two in range, then a size inside it,
+    // so small files dominate the count and large ones the bytes
+    int lo = 63 - __builtin_clzll(o->size_min);
+    int hi = 63 - __builtin_clzll(o->size_max);
+    int k  = lo + (int)(next_rand(&m->rng) % (uint64_t)(hi - lo + 1));
+    uint64_t base = 1ULL << k;
+    uint64_t v = base + next_rand(&m->rng) % base;
+    if (v < o->size_min) v = o->size_min;
+    if (v > o->size_max) v = o->size_max;
+    return (uint32_t)v;
+}
+
+static void encode_now(uint8_t t[7]) {
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    int year = tm.tm_year + 1900;
+    t[0] = (uint8_t)(year >> 8);
+    t[1] = (uint8_t)year;
+    t[2] = (uint8_t)(tm.tm_mon + 1);
+    t[3] = (uint8_t)tm.tm_mday;
+    t[4] = (uint8_t)tm.tm_hour;
+    t[5] = (uint8_t)tm.tm_min;
+    t[6] = (uint8_t)tm.tm_sec;
+}
+
+static void put_be16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = (uint8_t)v; }
+
+// --- Allocation ---
+// Next free block at or after the cursor, wrapping once.  With frag > 0
+// the cursor sometimes skips ahead first, leaving holes that split the
+// file and that later files fall into after the cursor wraps.
+static uint32_t take_block(mk_t *m, int first) {
+    fat_cache_t *fc = &m->fat;
+    if (!first && m->o->frag &&
+        next_rand(&m->rng) % 100 < m->o->frag)
+        m->cursor += 1 + (uint32_t)(next_rand(&m->rng) % 16);
+
+    for (uint32_t n = 0; n < fc->nblocks; n++) {
+        if (m->cursor >= fc->nblocks) m->cursor = 0;
+        uint32_t b = m->cursor++;
+        if (fat_get(fc, b) == FAT_FREE) return b;
+    }
+    return FAT_EOF;
+}
+
+// Fill a file's blocks with seeded noise, one write per contiguous run
+static int fill_chain(mk_t *m, const uint32_t *chain, uint32_t n,
+                      uint32_t size)
+{
+    uint32_t bs = m->o->block_size;
+    uint32_t per_chunk = FILL_CHUNK / bs;
+    uint64_t left = size;
+    for (uint32_t i = 0; i < n && left > 0; ) {
+        uint32_t run = 1;
+        while (i + run < n && run < per_chunk && chain[i + run] == chain[i] + run)
+            run++;
+        uint64_t len = (uint64_t)run * bs;
+        if (len > left) len = left;
+        for (uint64_t k = 0; k < len; k += 8) {
+            uint64_t r = next_rand(&m->rng);
+            memcpy(m->fill_buf + k, &r, len - k < 8 ? len - k : 8);
+        }
+        if (write_image(&m->img, (uint64_t)chain[i] * bs, m->fill_buf, len) != 0)
+            return -1;
+        left -= len;
+        i += run;
+    }
+    return 0;
+}
+
+static void add_entry(uint8_t *slot, const char *name, uint8_t status,
+                      uint32_t start, uint32_t blocks, uint32_t size,
+                      const uint8_t stamp[7])
+{
+    dir_entry_t e;
+    memset(&e, 0, sizeof(e));
+    e.status      = status;
+    e.start_block = start;
+    e.block_count = blocks;
+    e.file_size   = size;
+    memcpy(e.ctime, stamp, 7);
+    memcpy(e.mtime, stamp, 7);
+    strncpy(e.name, name, MAX_NAME_LEN);
+    encode_dir_entry(&e, slot);
+}
+
+// Blocks for a directory holding `entries` entries; hashed ones are
+// kept at most three quarters full
+static uint32_t dir_size(const mk_opts_t *o, uint32_t entries, int hashed) {
+    uint32_t per = o->block_size / DIR_ENTRY_SIZE;
+    if (hashed) entries = entries * 4 / 3 + 1;
+    uint32_t n = (entries + per - 1) / per;
+    return n ? n : 1;
+}
+
+// Where the next entry goes: in order, or by hash for hashed directories
+static uint8_t *next_slot(uint8_t *buf, uint32_t nslots, uint32_t *slot,
+                          int hashed, const char *name)
+{
+    if (hashed) return dir_hash_slot(buf, nslots, name, strlen(name));
+    return buf + (size_t)DIR_ENTRY_SIZE * (*slot)++;
+}
+
+// --- Tree ---
+// Fill the directory at start/blocks with files, then subdirectories
+// down to `depth` more levels, and write its blocks out
+static int populate(mk_t *m, uint32_t start, uint32_t blocks, uint32_t depth,
+                    int is_root)
+{
+    const mk_opts_t *o = m->o;
+    size_t region = (size_t)blocks * o->block_size;
+    uint8_t *buf = malloc(region);
+    if (!buf) return -1;
+    memset(buf, 0, region);
+    uint32_t slot = 0;
+    uint32_t nslots = (uint32_t)(region / DIR_ENTRY_SIZE);
+    int hashed = o->hashed && !is_root;
+    int rc = 0;
+
+    if (is_root)
+        add_entry(buf + DIR_ENTRY_SIZE * slot++, ".", DE_IN_USE|DE_DIR,
+                  start, blocks, 0, m->stamp);
+
+    for (uint32_t f = 0; f < o->files && !m->full; f++) {
+        uint32_t size = draw_size(m);
+        uint32_t n = (uint32_t)(((uint64_t)size + o->block_size - 1) / o->block_size);
+        if (n > m->fat.free_count ||
+            (uint64_t)(m->used + n) * 100 > (uint64_t)m->data_blocks * o->fill)
+        {
+            m->full = 1;
+            break;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            m->chain[i] = take_block(m, i == 0);
+            fat_set(&m->fat, m->chain[i], FAT_EOF);
+            if (i > 0) fat_set(&m->fat, m->chain[i - 1], m->chain[i]);
+        }
+        if (fill_chain(m, m->chain, n, size) != 0) { rc = -1; goto out; }
+
+        char name[MAX_NAME_LEN + 1];
+        snprintf(name, sizeof(name), "f%u.bin", f);
+        add_entry(next_slot(buf, nslots, &slot, hashed, name), name,
+                  DE_IN_USE|DE_FILE,
+                  n ? m->chain[0] : FAT_EOF, n, size, m->stamp);
+        m->used += n;
+        m->n_files++;
+        m->n_bytes += size;
+        m->n_extents += count_extents(m->chain, n);
+    }
+
+    for (uint32_t d = 0; depth > 0 && d < o->fanout; d++) {
+        uint32_t child_blocks = dir_size(o, o->files + (depth > 1 ? o->fanout : 0),
+                                         o->hashed);
+        uint32_t *run = malloc(child_blocks * sizeof(uint32_t));
+        if (!run) { rc = -1; goto out; }
+        if (fat_alloc_run(&m->fat, child_blocks, run) != 0) {
+            free(run);
+            m->full = 1;
+            break;
+        }
+        uint32_t child = run[0];
+        free(run);
+        m->used += child_blocks;
+        m->n_dirs++;
+
+        char name[MAX_NAME_LEN + 1];
+        snprintf(name, sizeof(name), "d%u", d);
+        add_entry(next_slot(buf, nslots, &slot, hashed, name), name,
+                  DE_IN_USE|DE_DIR | (o->hashed ? DE_HASHED : 0),
+                  child, child_blocks, 0, m->stamp);
+        if (populate(m, child, child_blocks, depth - 1, 0) != 0) {
+            rc = -1;
+            goto out;
+        }
+    }
+
+    rc = write_image(&m->img, (uint64_t)start * o->block_size, buf, region);
+out:
+    free(buf);
+    return rc;
+}
+
+// --- Image layout ---
+// Superblock in block 0, FAT from block 1, root directory right after
+static int write_layout(const char *path, const mk_opts_t *o,
+                        uint32_t *fat_blocks)
+{
+    uint64_t fat_bytes = (uint64_t)o->block_count * 4;
+    *fat_blocks = (uint32_t)((fat_bytes + o->block_size - 1) / o->block_size);
+    uint32_t journal = o->journal ? *fat_blocks + JOURNAL_DIR_BLOCKS : 0;
+    if (1 + (uint64_t)*fat_blocks + o->root_blocks + journal >= o->block_count) {
+        fprintf(stderr, "Image too small for its FAT and root directory\n");
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { perror(path); return -1; }
+
+    uint8_t sb[SUPERBLOCK_SIZE];
+    memset(sb, 0, sizeof(sb));
+    memcpy(sb, "CSC360FS", FS_ID_LEN);
+    put_be16(sb + 8, (uint16_t)o->block_size);
+    put_be32(sb + 10, o->block_count);
+    put_be32(sb + 14, 1);
+    put_be32(sb + 18, *fat_blocks);
+    put_be32(sb + 22, 1 + *fat_blocks);
+    put_be32(sb + 26, o->root_blocks);
+    if (journal) {
+        put_be32(sb + 30, 1 + *fat_blocks + o->root_blocks);
+        put_be32(sb + 34, journal);
+    }
+
+    int rc = 0;
+    if (ftruncate(fd, (off_t)o->block_count * o->block_size) != 0 ||
+        pwrite(fd, sb, sizeof(sb), 0) != (ssize_t)sizeof(sb))
+    {
+        perror(path);
+        rc = -1;
+    }
+    if (close(fd) != 0) rc = -1;
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <image>\n"
+            "  -b SIZE   block size (default 512, multiple of 64)\n"
+            "  -n COUNT  block count (default 65536)\n"
+            "  -r COUNT  root directory blocks (default 8)\n"
+            "  -d DEPTH  directory levels below the root (default 2)\n"
+            "  -f N      subdirectories per directory (default 4)\n"
+            "  -F N      files per directory (default 8)\n"
+            "  -s DIST   file sizes: fixed:N, uniform:MIN:MAX or log:MIN:MAX\n"
+            "            (default log:1:64K; K/M/G suffixes allowed)\n"
+            "  -x PCT    fragmentation, 0-100 (default 0)\n"
+            "  -u PCT    fill at most this %% of the data blocks (default 80)\n"
+            "  -S SEED   random seed (default 1)\n"
+            "  -H        give subdirectories the hashed layout\n"
+            "  -J        reserve a journal (the FAT's size plus %u blocks)\n"
+            "  --stats[=json]  print I/O counters and timings on stderr\n",
+            prog, JOURNAL_DIR_BLOCKS);
+}
+
+int main(int argc, char **argv) {
+    mk_opts_t o = {
+        .block_size = 512, .block_count = 65536, .root_blocks = 8,
+        .depth = 2, .fanout = 4, .files = 8,
+        .dist = DIST_LOG, .size_min = 1, .size_max = 64 << 10,
+        .frag = 0, .fill = 80, .seed = 1,
+    };
+    int stats = take_stats_option(&argc, argv);
+    int opt, bad = 0;
+    while ((opt = getopt(argc, argv, "b:n:r:d:f:F:s:x:u:S:HJ")) != -1) {
+        switch (opt) {
+        case 'b': bad |= parse_u32(optarg, &o.block_size); break;
+        case 'n': bad |= parse_u32(optarg, &o.block_count); break;
+        case 'r': bad |= parse_u32(optarg, &o.root_blocks); break;
+        case 'd': bad |= parse_u32(optarg, &o.depth); break;
+        case 'f': bad |= parse_u32(optarg, &o.fanout); break;
+        case 'F': bad |= parse_u32(optarg, &o.files); break;
+        case 's': bad |= parse_dist(optarg, &o); break;
+        case 'x': bad |= parse_u32(optarg, &o.frag); break;
+        case 'u': bad |= parse_u32(optarg, &o.fill); break;
+        case 'S': bad |= parse_size(optarg, &o.seed); break;
+        case 'H': o.hashed = 1; break;
+        case 'J': o.journal = 1; break;
+        default:  bad = 1;
+        }
+    }
+    if (stats < 0 || bad || argc - optind != 1) { usage(argv[0]); return 1; }
+    if (o.block_size < DIR_ENTRY_SIZE || o.block_size > 0xFFC0 ||
+        o.block_size % DIR_ENTRY_SIZE || o.block_count < 16 ||
+        o.block_count >= FAT_EOF || o.root_blocks == 0 ||
+        o.frag > 100 || o.fill > 100)
+    {
+        fprintf(stderr, "Bad image geometry\n");
+        return 1;
+    }
+    if (dir_size(&o, 1 + o.files + (o.depth ? o.fanout : 0), 0) > o.root_blocks) {
+        fprintf(stderr, "Root directory needs more than %u blocks (-r)\n",
+                o.root_blocks);
+        return 1;
+    }
+    const char *path = argv[optind];
+
+    uint32_t fat_blocks;
+    if (write_layout(path, &o, &fat_blocks) != 0) return 1;
+
+    mk_t m;
+    memset(&m, 0, sizeof(m));
+    m.o   = &o;
+    m.rng = o.seed ? o.seed : 1;
+    encode_now(m.stamp);
+    if (open_image(&m.img, path, IMG_RDWR) != 0) {
+        perror("open_image");
+        return 1;
+    }
+    if (load_fat(&m.img, &m.fat) != 0) {
+        fprintf(stderr, "Error reading FAT\n");
+        close_image(&m.img);
+        return 1;
+    }
+
+    // Superblock and FAT are reserved; the root is a chain like any dir
+    uint32_t root = 1 + fat_blocks;
+    for (uint32_t b = 0; b < root; b++) fat_set(&m.fat, b, FAT_RESERVED);
+    for (uint32_t b = root; b < root + o.root_blocks; b++)
+        fat_set(&m.fat, b, b + 1 < root + o.root_blocks ? b + 1 : FAT_EOF);
+    m.cursor      = root + o.root_blocks;
+    for (uint32_t b = 0; b < m.img.sb.journal_blocks; b++)
+        fat_set(&m.fat, m.cursor++, FAT_RESERVED);
+    m.data_blocks = m.fat.nblocks - m.cursor;
+
+    uint32_t max_file = (uint32_t)((o.size_max + o.block_size - 1) / o.block_size);
+    m.chain    = malloc(((size_t)max_file + 1) * sizeof(uint32_t));
+    m.fill_buf = malloc(FILL_CHUNK);
+    int rc = (m.chain && m.fill_buf) ? 0 : -1;
+    if (rc == 0) rc = populate(&m, root, o.root_blocks, o.depth, 1);
+    if (rc == 0) rc = flush_fat(&m.img, &m.fat);
+    if (rc != 0) fprintf(stderr, "Failed to build image\n");
+    free(m.chain);
+    free(m.fill_buf);
+    free_fat(&m.fat);
+    if (close_image(&m.img) != 0) rc = -1;
+    if (stats) print_stats(stderr, stats == STATS_JSON);
+    if (rc != 0) return 1;
+
+    printf("%s: %u x %u-byte blocks, %u dirs, %u files, %llu bytes, "
+           "%.2f extents/file%s\n",
+           path, o.block_count, o.block_size, m.n_dirs, m.n_files,
+           (unsigned long long)m.n_bytes,
+           m.n_files ? (double)m.n_extents / m.n_files : 0.0,
+           m.full ? " (stopped at fill limit)" : "");
+    return 0;
+}
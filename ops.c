@@ -0,0 +1,1569 @@
+// ops.c -- volume handling and the operations behind the CLI tools
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "fs.h"
+
+#define COPY_CHUNK    (1u << 20)
+
+// --- Volume ---
+int open_volume(volume_t *v, const char *path, int mode) {
+    memset(v, 0, sizeof(*v));
+    if (open_image(&v->img, path, mode) != 0) return -1;
+    init_dir_cache(&v->dc, &v->img);
+    init_extent_cache(&v->xc, &v->img);
+    return 0;
+}
+
+fat_cache_t *volume_fat(volume_t *v) {
+    if (!v->fat_loaded) {
+        if (load_fat(&v->img, &v->fat) != 0) return NULL;
+        v->fat_loaded = 1;
+        v->dc.fc = &v->fat;
+        v->xc.fc = &v->fat;
+    }
+    return &v->fat;
+}
+
+int sync_volume(volume_t *v) {
+    uint64_t t0 = phase_begin();
+    int rc = 0;
+    if (v->img.writable && v->img.sb.journal_blocks) {
+        // One journal commit covers every operation since the last sync
+        if (commit_journal(&v->img, v->fat_loaded ? &v->fat : NULL) != 0)
+            rc = -1;
+    } else if (v->fat_loaded && v->img.writable &&
+               flush_fat(&v->img, &v->fat) != 0) {
+        rc = -1;
+    }
+    if (rc == 0) rc = sync_image(&v->img);
+    phase_end(PH_COMMIT, t0);
+    return rc;
+}
+
+int close_volume(volume_t *v) {
+    int rc = 0;
+    if (v->img.writable && sync_volume(v) != 0) rc = -1;
+    free_dir_cache(&v->dc);
+    free_extent_cache(&v->xc);
+    if (v->fat_loaded) free_fat(&v->fat);
+    v->fat_loaded = 0;
+    if (close_image(&v->img) != 0) rc = -1;
+    return rc;
+}
+
+// --- Journal notices ---
+void report_journal(volume_t *v) {
+    image_t *img = &v->img;
+    if (img->replayed)
+        fprintf(stderr, "Replayed %u journalled block(s)\n", img->replayed);
+    if (img->in_place)
+        fprintf(stderr, "Journal holds %u blocks, commit needed %u; "
+                "written in place\n", img->sb.journal_blocks, img->in_place);
+    img->replayed = img->in_place = 0;
+}
+
+// --- Statistics ---
+int take_stats_option(int *argc, char **argv) {
+    int mode = STATS_OFF, out = 1;
+    for (int i = 1; i < *argc; i++) {
+        const char *a = argv[i];
+        if (strcmp(a, "--") == 0) {
+            while (i < *argc) argv[out++] = argv[i++];
+            break;
+        }
+        if (strcmp(a, "--stats") == 0 || strcmp(a, "--stats=text") == 0)
+            mode = STATS_TEXT;
+        else if (strcmp(a, "--stats=json") == 0)
+            mode = STATS_JSON;
+        else if (strncmp(a, "--stats=", 8) == 0)
+            return -1;
+        else
+            argv[out++] = argv[i];
+    }
+    *argc = out;
+    argv[out] = NULL;
+    if (mode != STATS_OFF) fs_stats.start_ns = stats_clock();
+    return mode;
+}
+
+// --- Option parsing ---
+int parse_size(const char *s, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno || end == s) return -1;
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+    if (*end) return -1;
+    *out = v;
+    return 0;
+}
+
+// --- Helpers ---
+// Split "/a/b/name" into a parent path and a base name.  *dup owns the
+// storage for both and must be freed by the caller.
+static int split_path(const char *path, char **dup,
+                      const char **dir_path, const char **base)
+{
+    *dup = strdup(path);
+    if (!*dup) return -1;
+    char *slash = strrchr(*dup, '/');
+    if (!slash) {
+        *dir_path = "/";
+        *base     = *dup;
+    } else if (slash == *dup) {
+        *dir_path = "/";
+        *base     = *dup + 1;
+    } else {
+        *slash    = '\0';
+        *dir_path = *dup;
+        *base     = slash + 1;
+    }
+    return 0;
+}
+
+// Encode a time as local YYYY(2) MM DD hh mm ss
+static void encode_time(time_t when, uint8_t t[7]) {
+    struct tm tmb;
+    struct tm *lt = localtime_r(&when, &tmb);
+    uint16_t year = lt->tm_year + 1900;
+    t[0] = (year >> 8) & 0xFF;
+    t[1] = year & 0xFF;
+    t[2] = lt->tm_mon + 1;
+    t[3] = lt->tm_mday;
+    t[4] = lt->tm_hour;
+    t[5] = lt->tm_min;
+    t[6] = lt->tm_sec;
+}
+
+// Get current local time into the 7-byte format
+static void get_current_time(uint8_t t[7]) {
+    encode_time(time(NULL), t);
+}
+
+// Fill in a new entry stamped with the current time
+static void make_dir_entry(dir_entry_t *e, const char *name, uint8_t status,
+                           uint32_t start_block, uint32_t block_count,
+                           uint32_t file_size)
+{
+    memset(e, 0, sizeof(*e));
+    e->status      = status;
+    e->start_block = start_block;
+    e->block_count = block_count;
+    e->file_size   = file_size;
+    get_current_time(e->ctime);
+    memcpy(e->mtime, e->ctime, 7);
+    strncpy(e->name, name, MAX_NAME_LEN);
+}
+
+// --- Directory updates ---
+// Blocks for a new directory holding `entries` entries; hashed ones are
+// kept at most three quarters full
+static uint32_t dir_blocks_for(uint32_t bs, uint64_t entries, int hashed) {
+    if (hashed) entries = entries * 4 / 3 + 1;
+    uint64_t n = (entries * DIR_ENTRY_SIZE + bs - 1) / bs;
+    return n ? (uint32_t)n : 1;
+}
+
+// Write the directory's start and length back to where it is described
+static int update_dir_ref(volume_t *v, const dir_ref_t *dir) {
+    image_t *img = &v->img;
+    uint8_t be[8];
+    put_be32(be, dir->ent.start_block);
+    put_be32(be + 4, dir->ent.block_count);
+    if (dir->entry_off) {
+        invalidate_dir(&v->dc, dir->parent);
+        return write_meta(img, dir->entry_off + 1, be, 8);
+    }
+
+    if (set_root_blocks(img, dir->ent.block_count) != 0) return -1;
+    dir_entry_t dot;
+    uint64_t off;
+    if (find_in_dir(img, &v->fat, &dir->ent, ".", DE_DIR, &dot, &off) == 0 &&
+        dot.start_block == dir->ent.start_block)
+        return write_meta(img, off + 5, be + 4, 4);
+    return 0;
+}
+
+// Append blocks to a plain directory's chain, growing it by half
+static int extend_dir(volume_t *v, dir_ref_t *dir) {
+    image_t *img = &v->img;
+    const uint32_t bs = img->sb.block_size;
+    extent_t *ext = NULL;
+    int n = chain_extents(img, &v->fat, dir->ent.start_block,
+                          dir->ent.block_count, &ext);
+    if (n <= 0) {
+        free(ext);
+        return -1;
+    }
+    uint32_t have = 0;
+    for (int i = 0; i < n; i++) have += ext[i].count;
+    uint32_t last = ext[n - 1].start + ext[n - 1].count - 1;
+    free(ext);
+
+    uint32_t extra = have / 2 ? have / 2 : 1;
+    uint32_t *chain = malloc(extra * sizeof(uint32_t));
+    uint8_t *zero = calloc(1, bs);
+    int rc = -1;
+    if (!chain || !zero || fat_extend_chain(&v->fat, last, extra, chain) != 0)
+        goto out;
+    rc = 0;
+    for (uint32_t i = 0; rc == 0 && i < extra; i++)
+        rc = write_image(img, (uint64_t)chain[i] * bs, zero, bs);
+    if (rc == 0) {
+        dir->ent.block_count = have + extra;
+        rc = update_dir_ref(v, dir);
+    }
+    if (rc != 0) {
+        fat_set(&v->fat, last, FAT_EOF);
+        for (uint32_t i = 0; i < extra; i++) fat_set(&v->fat, chain[i], FAT_FREE);
+        dir->ent.block_count = have;
+    }
+out:
+    free(zero);
+    free(chain);
+    return rc;
+}
+
+// Rebuild a hashed directory into a fresh run of nblocks, placing every
+// entry by hash.  The new run is written before the directory's entry
+// is switched to it, and the old chain is freed last.
+static int rehash_dir(volume_t *v, dir_ref_t *dir, uint32_t nblocks) {
+    image_t *img = &v->img;
+    const uint32_t bs = img->sb.block_size;
+    uint32_t nslots = (uint32_t)((uint64_t)nblocks * bs / DIR_ENTRY_SIZE);
+    uint8_t *table = calloc(nblocks, bs);
+    uint32_t *chain = malloc(nblocks * sizeof(uint32_t));
+    extent_t *old = NULL;
+    int nold = -1, rc = -1;
+    if (!table || !chain) goto out;
+
+    dir_iter_t it;
+    dir_iter_init(&it, img, &v->fat, dir->ent.start_block, dir->ent.block_count);
+    const uint8_t *raw;
+    while ((raw = dir_iter_next(&it)) != NULL) {
+        const char *nm = dirent_name(raw);
+        uint8_t *slot = dir_hash_slot(table, nslots, nm,
+                                      strnlen(nm, MAX_NAME_LEN));
+        if (!slot) break;
+        memcpy(slot, raw, DIR_ENTRY_SIZE);
+    }
+    if (raw || it.error) {
+        errno = it.error ? EIO : ENOSPC;
+        goto out;
+    }
+    nold = chain_extents(img, &v->fat, dir->ent.start_block,
+                         dir->ent.block_count, &old);
+    if (nold < 0) goto out;
+
+    if (fat_alloc_run(&v->fat, nblocks, chain) != 0) goto out;
+    dir_ref_t moved = *dir;
+    moved.ent.start_block = chain[0];
+    moved.ent.block_count = nblocks;
+    if (write_image(img, (uint64_t)chain[0] * bs, table,
+                    (size_t)nblocks * bs) != 0 ||
+        update_dir_ref(v, &moved) != 0)
+    {
+        for (uint32_t i = 0; i < nblocks; i++) fat_set(&v->fat, chain[i], FAT_FREE);
+        goto out;
+    }
+    for (int x = 0; x < nold; x++)
+        for (uint32_t b = 0; b < old[x].count; b++)
+            fat_set(&v->fat, old[x].start + b, FAT_FREE);
+    invalidate_dir(&v->dc, dir->ent.start_block);
+    *dir = moved;
+    rc = 0;
+out:
+    free(old);
+    free(chain);
+    free(table);
+    return rc;
+}
+
+// Store e in the directory, growing it when there is no room.  Plain
+// directories take the first free slot and grow by extending their
+// chain.  Hashed ones take the first free slot on the name's probe
+// sequence, and are rebuilt at twice the size when that lies more than
+// HASH_MAX_PROBE slots away (or the directory is no longer one run).
+// *out_off (if given) receives the entry's image offset.
+static int add_dir_entry(volume_t *v, dir_ref_t *dir, const dir_entry_t *e,
+                         uint64_t *out_off)
+{
+    image_t *img = &v->img;
+    uint64_t t0 = phase_begin();
+    int rc = -1;
+    if (!volume_fat(v)) goto out;
+
+    uint64_t off = UINT64_MAX;
+    for (;;) {
+        if (dir->ent.status & DE_HASHED) {
+            if (probe_hashed(img, &v->fat, &dir->ent, e->name,
+                             strlen(e->name), 0, HASH_MAX_PROBE, NULL,
+                             &off) < 0)
+                off = UINT64_MAX;
+        } else {
+            dir_iter_t it;
+            dir_iter_init(&it, img, &v->fat, dir->ent.start_block,
+                          dir->ent.block_count);
+            const uint8_t *raw;
+            while ((raw = dir_iter_slot(&it)) != NULL) {
+                if (!(dirent_status(raw) & DE_IN_USE)) {
+                    off = dir_iter_offset(&it);
+                    break;
+                }
+            }
+            if (it.error) {
+                errno = EIO;
+                goto out;
+            }
+        }
+        if (off != UINT64_MAX) break;
+
+        uint32_t start = dir->ent.start_block;
+        if ((dir->ent.status & DE_HASHED)
+            ? rehash_dir(v, dir, dir->ent.block_count * 2) != 0
+            : extend_dir(v, dir) != 0)
+            goto out;
+        invalidate_dir(&v->dc, start);
+    }
+
+    uint8_t raw[DIR_ENTRY_SIZE];
+    encode_dir_entry(e, raw);
+    rc = write_meta(img, off, raw, DIR_ENTRY_SIZE);
+    if (rc == 0 && out_off) *out_off = off;
+    invalidate_dir(&v->dc, dir->ent.start_block);
+out:
+    phase_end(PH_COMMIT, t0);
+    return rc;
+}
+
+// Allocate an empty nblocks-long directory and link it into its parent
+static int create_dir(volume_t *v, dir_ref_t *parent, const char *name,
+                      uint32_t nblocks, dir_ref_t *out)
+{
+    image_t *img = &v->img;
+    const superblock_t *sb = &img->sb;
+    fat_cache_t *fat = volume_fat(v);
+    if (!fat) return -1;
+
+    uint32_t *chain = malloc(nblocks * sizeof(uint32_t));
+    if (!chain || fat_alloc_run(fat, nblocks, chain) != 0) {
+        free(chain);
+        return -1;
+    }
+
+    // start the new directory out empty
+    int rc = 0;
+    uint8_t *zero = calloc(1, sb->block_size);
+    if (!zero) rc = -1;
+    for (uint32_t i = 0; rc == 0 && i < nblocks; i++)
+        rc = write_image(img, (uint64_t)chain[i] * sb->block_size,
+                         zero, sb->block_size);
+    if (rc == 0) {
+        make_dir_entry(&out->ent, name,
+                       0x1|0x4 | (v->hashed_dirs ? DE_HASHED : 0),
+                       chain[0], nblocks, 0);
+        rc = add_dir_entry(v, parent, &out->ent, &out->entry_off);
+        out->parent = parent->ent.start_block;
+    }
+    if (rc != 0) {
+        for (uint32_t i = 0; i < nblocks; i++)
+            fat_set(fat, chain[i], FAT_FREE);
+    }
+    int saved = errno;
+    free(zero);
+    free(chain);
+    errno = saved;
+    return rc;
+}
+
+// Resolve a directory path, creating every missing level along it
+static int ensure_dir(volume_t *v, const char *path, dir_ref_t *out) {
+    if (resolve_dir(&v->dc, path, out) == 0) return 0;
+    if (errno != ENOENT) return -1;
+
+    char *pd;
+    const char *p_dir, *new_dir;
+    if (split_path(path, &pd, &p_dir, &new_dir) != 0) return -1;
+
+    int rc = -1;
+    dir_ref_t parent;
+    if (*new_dir == '\0') {
+        rc = ensure_dir(v, p_dir, out);  // trailing '/'
+    } else if (strlen(new_dir) > MAX_NAME_LEN) {
+        errno = ENAMETOOLONG;
+    } else if (ensure_dir(v, p_dir, &parent) == 0 &&
+               create_dir(v, &parent, new_dir, 1, out) == 0)
+    {
+        rc = 0;
+    }
+    free(pd);
+    return rc;
+}
+
+// --- diskinfo ---
+int print_info(volume_t *v, FILE *out) {
+    superblock_t sb;
+    if (read_superblock(&v->img, &sb) != 0) {
+        fprintf(stderr, "Failed to read superblock\n");
+        return -1;
+    }
+
+    fprintf(out, "Super block information:\n");
+    fprintf(out, "Block size: %u\n", sb.block_size);
+    fprintf(out, "Block count: %u\n", sb.block_count);
+    fprintf(out, "FAT starts: %u\n", sb.fat_start);
+    fprintf(out, "FAT blocks: %u\n", sb.fat_blocks);
+    fprintf(out, "Root directory start: %u\n", sb.root_start);
+    fprintf(out, "Root directory blocks: %u\n\n", sb.root_blocks);
+
+    // A loaded FAT cache keeps its histogram current, so batches that
+    // have already written do not need a rescan (or a flush).  Otherwise
+    // the superblock's free-space summary saves the scan when it has one.
+    uint32_t free_b, res_b, alloc_b;
+    space_summary_t sum;
+    if (v->fat_loaded) {
+        free_b  = v->fat.n_free;
+        res_b   = v->fat.n_reserved;
+        alloc_b = v->fat.n_alloc;
+    } else if (read_space_summary(&v->img, &sum) == 0) {
+        free_b  = sum.n_free;
+        res_b   = sum.n_reserved;
+        alloc_b = sum.n_alloc;
+    } else if (analyze_fat(&v->img, &sb, &free_b, &res_b, &alloc_b) != 0) {
+        fprintf(stderr, "Failed to analyze FAT\n");
+        return -1;
+    }
+
+    fprintf(out, "FAT information:\n");
+    fprintf(out, "Free Blocks: %u\n", free_b);
+    fprintf(out, "Reserved Blocks: %u\n", res_b);
+    fprintf(out, "Allocated Blocks: %u\n", alloc_b);
+    return 0;
+}
+
+// --- diskget ---
+// Copy bytes off..off+len of a file (clamped to its size) to host_dest
+// ("-" for stdout), one large transfer per extent; compressed files are
+// decompressed on nthreads workers.  Only reads shared state (the extent
+// cache locks itself), so workers may call it concurrently.
+static int extract_entry(volume_t *v, const dir_entry_t *file_ent,
+                         uint64_t off, uint64_t len, const char *host_dest,
+                         int nthreads)
+{
+    uint64_t t0 = phase_begin();
+
+    // Open destination
+    int to_stdout = strcmp(host_dest, "-") == 0;
+    int out = to_stdout ? STDOUT_FILENO
+                        : open(host_dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror(host_dest);
+        phase_end(PH_COPY, t0);
+        return -1;
+    }
+
+    // The chain is resolved once into an extent index (cached on the
+    // volume), so a range far into the file costs a binary search
+    int rc = copy_file_span(&v->xc, file_ent, off, len, out, nthreads);
+    if (rc != 0) {
+        if (errno == EIO)
+            fprintf(stderr, "%s: corrupt FAT chain\n", file_ent->name);
+        else
+            perror(host_dest);
+    }
+    if (!to_stdout && close(out) != 0) rc = -1;
+    phase_end(PH_COPY, t0);
+    return rc;
+}
+
+int get_file(volume_t *v, const char *fs_path, const char *host_dest) {
+    return get_file_range(v, fs_path, host_dest, 0, UINT64_MAX);
+}
+
+int get_file_range(volume_t *v, const char *fs_path, const char *host_dest,
+                   uint64_t off, uint64_t len)
+{
+    char *dup;
+    const char *dir_path, *file_name;
+    if (split_path(fs_path, &dup, &dir_path, &file_name) != 0) return -1;
+
+    // Locate parent directory and the file entry in it
+    dir_ref_t dir;
+    if (resolve_dir(&v->dc, dir_path, &dir) != 0) {
+        fprintf(stderr, "Directory not found.\n");
+        free(dup);
+        return -1;
+    }
+
+    // One lookup in the leaf directory: probe or scan it in place rather
+    // than decoding and caching the whole thing
+    dir_entry_t file_ent;
+    int rc = find_in_dir(&v->img, v->dc.fc, &dir.ent, file_name, DE_FILE,
+                         &file_ent, NULL);
+    free(dup);
+    if (rc != 0) {
+        // Keep a stdout stream clean of messages
+        if (errno == ENOENT)
+            fputs("File not found.\n", strcmp(host_dest, "-") ? stdout : stderr);
+        else fprintf(stderr, "Error reading directory entries\n");
+        return -1;
+    }
+    return extract_entry(v, &file_ent, off, len, host_dest, 0);
+}
+
+// --- Worker pool ---
+void run_pool(void *(*fn)(void *), void *arg, int nthreads, size_t njobs)
+{
+    if (nthreads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((size_t)nthreads > njobs) nthreads = njobs ? (int)njobs : 1;
+
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    int started = 0;
+    if (tids) {
+        while (started < nthreads - 1 &&
+               pthread_create(&tids[started], NULL, fn, arg) == 0)
+            started++;
+    }
+    fn(arg);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+// --- diskget -r ---
+// The tree is walked once on the calling thread, which also creates the
+// host directories; the file copies are then spread over a worker pool.
+// Workers only read shared state and copy with positional I/O, so they
+// need no locking beyond the job counter.
+
+typedef struct {
+    dir_entry_t ent;
+    char       *host_path;
+} tree_job_t;
+
+typedef struct {
+    volume_t   *vol;
+    tree_job_t *jobs;
+    size_t      njobs;
+    size_t      cap;
+    size_t      next;      // next job to claim (atomic)
+    int         failures;  // (atomic)
+} tree_get_t;
+
+static int add_tree_job(tree_get_t *t, const dir_entry_t *e,
+                        const char *host_path)
+{
+    if (t->njobs == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        tree_job_t *grown = realloc(t->jobs, cap * sizeof(tree_job_t));
+        if (!grown) return -1;
+        t->jobs = grown;
+        t->cap  = cap;
+    }
+    t->jobs[t->njobs].ent = *e;
+    t->jobs[t->njobs].host_path = strdup(host_path);
+    if (!t->jobs[t->njobs].host_path) return -1;
+    t->njobs++;
+    return 0;
+}
+
+// Names that must not become host path components
+static int unsafe_name(const char *name) {
+    return name[0] == '\0' || strcmp(name, ".") == 0 ||
+           strcmp(name, "..") == 0 || strchr(name, '/') != NULL;
+}
+
+static int walk_tree(tree_get_t *t, uint32_t start, uint32_t blocks,
+                     const char *host_dir, int depth)
+{
+    if (depth > MAX_TREE_DEPTH) {
+        fprintf(stderr, "%s: directory tree too deep\n", host_dir);
+        return -1;
+    }
+    if (mkdir(host_dir, 0755) != 0 && errno != EEXIST) {
+        perror(host_dir);
+        return -1;
+    }
+
+    const cached_dir_t *dir = get_dir(&t->vol->dc, start, blocks);
+    if (!dir) {
+        fprintf(stderr, "Error reading directory entries\n");
+        return -1;
+    }
+
+    // Copy the entries out: recursing may evict this directory
+    int count = dir->count;
+    dir_entry_t *ents = malloc((count + 1) * sizeof(dir_entry_t));
+    if (!ents) { perror("malloc"); return -1; }
+    memcpy(ents, dir->entries, count * sizeof(dir_entry_t));
+
+    int rc = 0;
+    char path[PATH_BUF_SIZE];
+    for (int i = 0; i < count && rc == 0; i++) {
+        if (unsafe_name(ents[i].name)) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", host_dir, ents[i].name)
+            >= (int)sizeof(path))
+        {
+            fprintf(stderr, "%s/%s: path too long\n", host_dir, ents[i].name);
+            rc = -1;
+        } else if (ents[i].status & DE_DIR) {
+            if (ents[i].start_block != start)
+                rc = walk_tree(t, ents[i].start_block, ents[i].block_count,
+                               path, depth + 1);
+        } else if (ents[i].status & DE_FILE) {
+            if (add_tree_job(t, &ents[i], path) != 0) {
+                perror("malloc");
+                rc = -1;
+            }
+        }
+    }
+    free(ents);
+    return rc;
+}
+
+static void *tree_worker(void *arg) {
+    tree_get_t *t = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+        if (i >= t->njobs) break;
+        if (extract_entry(t->vol, &t->jobs[i].ent, 0, UINT64_MAX,
+                          t->jobs[i].host_path, 1) != 0)
+            __atomic_fetch_add(&t->failures, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int get_tree(volume_t *v, const char *fs_dir, const char *host_dir,
+             int nthreads)
+{
+    dir_ref_t dir;
+    if (resolve_dir(&v->dc, fs_dir, &dir) != 0) {
+        fprintf(stderr, "Directory not found.\n");
+        return -1;
+    }
+
+    tree_get_t t;
+    memset(&t, 0, sizeof(t));
+    t.vol = v;
+    int rc = walk_tree(&t, dir.ent.start_block, dir.ent.block_count,
+                       host_dir, 0);
+
+    if (rc == 0) {
+        run_pool(tree_worker, &t, nthreads, t.njobs);
+        if (t.failures) rc = -1;
+    }
+
+    for (size_t i = 0; i < t.njobs; i++) free(t.jobs[i].host_path);
+    free(t.jobs);
+    return rc;
+}
+
+// --- diskput ---
+static int read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        STAT_ADD(read_calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) { errno = EIO; return -1; }  // file shrank
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read a file's chain (block_count blocks) into a malloc'd array with
+// room for one more entry; -1 if it leaves the data area or runs short
+static int load_chain(const fat_cache_t *fat, const dir_entry_t *e,
+                      uint32_t **out)
+{
+    uint32_t *chain = malloc(((size_t)e->block_count + 1) * sizeof(uint32_t));
+    if (!chain) return -1;
+    chain[0] = FAT_EOF;
+    uint32_t b = e->start_block;
+    for (uint32_t i = 0; i < e->block_count; i++) {
+        if (b < 2 || b >= fat->nblocks || fat_get(fat, b) == FAT_FREE) {
+            free(chain);
+            errno = EIO;
+            return -1;
+        }
+        chain[i] = b;
+        b = fat_get(fat, b);
+    }
+    *out = chain;
+    return 0;
+}
+
+// Lengthen a chain of *n blocks to `want`, after its tail (or wherever
+// fits best when it is empty)
+static int grow_chain(fat_cache_t *fat, uint32_t **chain, uint32_t *n,
+                      uint32_t want)
+{
+    if (want <= *n) return 0;
+    uint32_t *grown = realloc(*chain, ((size_t)want + 1) * sizeof(uint32_t));
+    if (!grown) return -1;
+    *chain = grown;
+    if (*n == 0 ? fat_alloc_chain(fat, want, grown) != 0
+                : fat_extend_chain(fat, grown[*n - 1], want - *n,
+                                   grown + *n) != 0)
+        return -1;
+    *n = want;
+    return 0;
+}
+
+// Free every block past the first `keep` and end the chain there
+static void cut_chain(fat_cache_t *fat, uint32_t *chain, uint32_t *n,
+                      uint32_t keep)
+{
+    if (keep >= *n) return;
+    for (uint32_t i = keep; i < *n; i++) fat_set(fat, chain[i], FAT_FREE);
+    if (keep > 0) fat_set(fat, chain[keep - 1], FAT_EOF);
+    else chain[0] = FAT_EOF;  // empty files own no blocks
+    *n = keep;
+}
+
+// Write size bytes read from fd into a chain starting at byte `from` of
+// it, one read per extent.  Mapped images are read into directly.
+static int copy_host_to_chain(image_t *img, int fd, const uint32_t *chain,
+                              uint32_t nblocks, uint64_t from, uint64_t size)
+{
+    const uint32_t bs = img->sb.block_size;
+    uint64_t t0 = phase_begin();
+    uint8_t *buf = NULL;
+    int rc = 0;
+
+    uint32_t within = (uint32_t)(from % bs);
+    for (uint32_t i = (uint32_t)(from / bs);
+         i < nblocks && size > 0 && rc == 0; )
+    {
+        uint32_t run = 1;
+        while (i + run < nblocks && chain[i + run] == chain[i] + run) run++;
+        uint64_t off = (uint64_t)chain[i] * bs + within;
+        uint64_t len = (uint64_t)run * bs - within;
+        if (len > size) len = size;
+
+        // Blocks a journal has staged take the write_image() path
+        if (img->map && off + len <= img->size &&
+            !image_staged(img, off, len))
+        {
+            stats_access(off, len, 1);
+            rc = read_full(fd, img->map + off, len);
+        } else {
+            if (!buf && !(buf = malloc(COPY_CHUNK))) { rc = -1; break; }
+            for (uint64_t done = 0; done < len && rc == 0; ) {
+                size_t chunk = len - done < COPY_CHUNK ? len - done : COPY_CHUNK;
+                rc = read_full(fd, buf, chunk);
+                if (rc == 0) rc = write_image(img, off + done, buf, chunk);
+                done += chunk;
+            }
+        }
+        size -= len;
+        i += run;
+        within = 0;
+    }
+    free(buf);
+    phase_end(PH_COPY, t0);
+    return rc;
+}
+
+// --- diskput --sync ---
+// Compare size bytes of fd with the chain block by block and write only
+// the blocks that differ, coalescing neighbours into one write.  Blocks
+// from index `reused` on were just allocated and are written unread.
+// Comparing the bytes themselves costs the same reads a checksum of both
+// sides would, without the chance of a false match.
+static int sync_host_to_chain(image_t *img, int fd, const uint32_t *chain,
+                              uint32_t nblocks, uint64_t size,
+                              uint32_t reused, uint32_t *changed)
+{
+    const uint32_t bs = img->sb.block_size;
+    const uint32_t step = COPY_CHUNK / bs;
+    uint64_t t0 = phase_begin();
+    uint8_t *host = malloc(COPY_CHUNK);
+    uint8_t *have = img->map ? NULL : malloc(COPY_CHUNK);
+    int rc = host && (img->map || have) ? 0 : -1;
+
+    for (uint32_t i = 0; i < nblocks && size > 0 && rc == 0; ) {
+        uint32_t run = 1;
+        while (run < step && i + run < nblocks &&
+               chain[i + run] == chain[i] + run)
+            run++;
+        uint64_t off = (uint64_t)chain[i] * bs;
+        uint64_t len = (uint64_t)run * bs;
+        if (len > size) len = size;
+        if (read_full(fd, host, len) != 0) { rc = -1; break; }
+
+        // The image side of the blocks that were there before
+        const uint8_t *old = NULL;
+        if (i < reused) {
+            uint64_t old_len = (uint64_t)(reused - i) * bs;
+            if (old_len > len) old_len = len;
+            if (img->map && off + len <= img->size) {
+                stats_access(off, old_len, 0);
+                old = img->map + off;
+            } else if (have && read_image(img, off, have, old_len) == 0) {
+                old = have;
+            } else {
+                rc = -1;
+                break;
+            }
+        }
+
+        for (uint32_t j = 0; j < run && (uint64_t)j * bs < len && rc == 0; ) {
+            uint32_t k = j;
+            while ((uint64_t)k * bs < len &&
+                   (i + k >= reused ||
+                    memcmp(host + (size_t)k * bs, old + (size_t)k * bs,
+                           len - (uint64_t)k * bs < bs ? len - (uint64_t)k * bs
+                                                       : bs) != 0))
+                k++;
+            if (k > j) {
+                uint64_t end = (uint64_t)k * bs < len ? (uint64_t)k * bs : len;
+                rc = write_image(img, off + (uint64_t)j * bs,
+                                 host + (size_t)j * bs, end - (uint64_t)j * bs);
+                *changed += k - j;
+            }
+            j = k + 1;
+        }
+        size -= len;
+        i += run;
+    }
+    free(host);
+    free(have);
+    phase_end(PH_COPY, t0);
+    return rc;
+}
+
+// --- diskput from a stream ---
+// Read until len bytes or end of input; returns the count read
+static ssize_t read_upto(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, p + done, len - done);
+        STAT_ADD(read_calls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+// Copy input of unknown length (a pipe) into a chain from byte *size of
+// it on.  The chain's own *n blocks are filled first; after them blocks
+// are claimed as data arrives, up to COPY_CHUNK bytes' worth at a time,
+// continuing the previous run when the block after it is free and
+// otherwise starting at the largest free run, so the file lands in as
+// few extents as free space allows.  *chain, *n and *size always
+// describe what was claimed and written, so the caller can cut the
+// chain back either way.
+static int stream_host_to_chain(image_t *img, fat_cache_t *fat, int fd,
+                                uint32_t **chain_io, uint32_t *n_io,
+                                uint64_t *size_io)
+{
+    const uint32_t bs = img->sb.block_size;
+    const uint32_t step = COPY_CHUNK / bs;
+    uint64_t t0 = phase_begin();
+    uint32_t *chain = *chain_io, n = *n_io, cap = n + 1;
+    uint64_t size = *size_io;
+    uint8_t *buf = NULL;
+    int rc = -1;
+
+    for (;;) {
+        uint32_t bi = (uint32_t)(size / bs);
+        if (bi == n) {
+            // Every block is full: claim the next step...
+            if (n + step + 1 > cap) {
+                uint32_t ncap = cap * 2 > n + step + 1 ? cap * 2 : n + step + 1;
+                uint32_t *grown = realloc(chain, ncap * sizeof(uint32_t));
+                if (!grown) goto out;
+                chain = grown;
+                cap = ncap;
+            }
+            uint32_t run = n > 0 ? chain[n-1] + 1 : FAT_EOF;
+            uint32_t len = n > 0 ? fat_free_run(fat, run) : 0;
+            if (len == 0) run = fat_largest_run(fat, &len);
+            if (run == FAT_EOF) {
+                // A stream that exactly fills the free space still fits
+                uint8_t probe;
+                if (read_upto(fd, &probe, 1) == 0) { rc = 0; goto out; }
+                errno = ENOSPC;
+                goto out;
+            }
+            if (len > step) len = step;
+            fat_take_run(fat, run, len, chain + n);
+            if (n > 0) fat_set(fat, chain[n-1], run);
+            n += len;
+        }
+
+        // ...and fill blocks from the write position, straight into the
+        // mapping when there is one
+        uint32_t run = 1;
+        while (bi + run < n && chain[bi + run] == chain[bi] + run) run++;
+        uint64_t off = (uint64_t)chain[bi] * bs + size % bs;
+        uint64_t want = (uint64_t)run * bs - size % bs;
+        if (want > COPY_CHUNK) want = COPY_CHUNK;
+        ssize_t got;
+        if (img->map && off + want <= img->size &&
+            !image_staged(img, off, want))
+        {
+            got = read_upto(fd, img->map + off, want);
+            if (got > 0) stats_access(off, got, 1);
+        } else {
+            if (!buf && !(buf = malloc(COPY_CHUNK))) goto out;
+            got = read_upto(fd, buf, want);
+            if (got > 0 && write_image(img, off, buf, got) != 0) got = -1;
+        }
+        if (got < 0) goto out;
+        size += got;
+        if (size > UINT32_MAX) {
+            errno = EFBIG;
+            goto out;
+        }
+        if ((uint64_t)got < want) { rc = 0; break; }
+    }
+out:
+    free(buf);
+    phase_end(PH_COPY, t0);
+    *chain_io = chain;
+    *n_io = n;
+    *size_io = size;
+    return rc;
+}
+
+// --- diskput -z ---
+// Copy a stream to an unlinked temporary file, which can then be mapped
+// like any regular input; returns its descriptor
+static int spool_input(int fd, uint32_t *size) {
+    FILE *tmp = tmpfile();
+    int out = tmp ? dup(fileno(tmp)) : -1;
+    if (tmp) fclose(tmp);
+    uint8_t *buf = out >= 0 ? malloc(COPY_CHUNK) : NULL;
+    if (!buf) goto fail;
+    uint64_t have = 0;
+    for (;;) {
+        ssize_t got = read_upto(fd, buf, COPY_CHUNK);
+        if (got < 0) goto fail;
+        have += got;
+        if (have > UINT32_MAX) { errno = EFBIG; goto fail; }
+        if (got > 0 && write_full(out, buf, got) != 0) goto fail;
+        if (got < COPY_CHUNK) break;
+    }
+    free(buf);
+    *size = (uint32_t)have;
+    return out;
+fail:
+    {
+        int saved = errno;
+        free(buf);
+        if (out >= 0) close(out);
+        errno = saved;
+    }
+    return -1;
+}
+
+// Write len bytes at byte off of a chain of nblocks blocks
+static int write_buf_to_chain(image_t *img, const uint32_t *chain,
+                              uint32_t nblocks, uint64_t off,
+                              const uint8_t *buf, uint64_t len)
+{
+    const uint32_t bs = img->sb.block_size;
+    uint32_t within = (uint32_t)(off % bs);
+    for (uint32_t i = (uint32_t)(off / bs); i < nblocks && len > 0; ) {
+        uint32_t run = 1;
+        while (i + run < nblocks && chain[i + run] == chain[i] + run) run++;
+        uint64_t n = (uint64_t)run * bs - within;
+        if (n > len) n = len;
+        if (write_image(img, (uint64_t)chain[i] * bs + within, buf, n) != 0)
+            return -1;
+        buf += n;
+        len -= n;
+        i += run;
+        within = 0;
+    }
+    return 0;
+}
+
+// The compressor's store: lengthen the chain to take each piece
+typedef struct {
+    image_t     *img;
+    fat_cache_t *fat;
+    uint32_t   **chain;
+    uint32_t    *n;
+} chain_store_t;
+
+static int store_in_chain(uint64_t off, const void *buf, size_t len,
+                          void *arg)
+{
+    chain_store_t *cs = arg;
+    const uint32_t bs = cs->img->sb.block_size;
+    if (grow_chain(cs->fat, cs->chain, cs->n,
+                   (uint32_t)((off + len + bs - 1) / bs)) != 0)
+        return -1;
+    return write_buf_to_chain(cs->img, *cs->chain, *cs->n, off, buf, len);
+}
+
+// Compress the input a batch of chunks at a time (on one worker per
+// CPU) and write each batch over the chain, lengthening it as needed and
+// setting DE_COMPRESSED in *status.  A stream is spooled to a temporary
+// file first, since the index ahead of the chunks needs their count.
+// Input that would not save a block is stored plain.  *size becomes the
+// input length and *stored the bytes written.
+static int store_compressed(volume_t *v, fat_cache_t *fat, int fd,
+                            int streaming, uint32_t *size, uint8_t *status,
+                            uint32_t **chain, uint32_t *n, uint64_t *stored)
+{
+    const uint32_t bs = v->img.sb.block_size;
+    int in = streaming ? spool_input(fd, size) : fd;
+    if (in < 0) return -1;
+
+    // Kept only if it takes fewer blocks than the plain file
+    uint64_t plain_blocks = ((uint64_t)*size + bs - 1) / bs;
+    chain_store_t cs = { &v->img, fat, chain, n };
+    uint32_t packed_len = 0;
+    int rc = plain_blocks < 2 ? 1
+           : compress_file_data(in, *size, 0, (plain_blocks - 1) * bs,
+                                store_in_chain, &cs, &packed_len);
+    if (rc == 0) {
+        *status |= DE_COMPRESSED;
+        *stored = packed_len;
+    } else if (rc > 0) {
+        rc = lseek(in, 0, SEEK_SET) == 0 &&
+             grow_chain(fat, chain, n, (uint32_t)plain_blocks) == 0 &&
+             copy_host_to_chain(&v->img, in, *chain, *n, 0, *size) == 0
+           ? 0 : -1;
+        if (rc == 0) *stored = *size;
+    }
+    if (streaming) {
+        int saved = errno;
+        close(in);
+        errno = saved;
+    }
+    return rc;
+}
+
+// --- put ---
+// A new file gets a best-fitting chain.  An existing one keeps its chain:
+// PUT_REPLACE overwrites it from the start, PUT_APPEND writes on from
+// its last byte, and PUT_SYNC rewrites only the blocks that changed.
+// The chain is lengthened from its tail or cut back to fit, and on
+// failure cut back to where it was, so nothing leaks.  Quiet: failures
+// come back as errno for put_file() or the library to report.
+int put_fd(volume_t *v, int src, const char *fs_dest, int mode,
+           put_info_t *info)
+{
+    image_t *img = &v->img;
+    const uint32_t bs = img->sb.block_size;
+    put_info_t dummy;
+    if (!info) info = &dummy;
+    memset(info, 0, sizeof(*info));
+    info->changed = UINT32_MAX;
+    if (!img->writable) {
+        errno = EROFS;
+        return -1;
+    }
+
+    // 1) Anything but a regular file is streamed, as its size is known
+    //    only once it ends
+    struct stat st;
+    if (fstat(src, &st) != 0) return -1;
+    int streaming = !S_ISREG(st.st_mode);
+    if (!streaming && (uint64_t)st.st_size > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    uint32_t file_size = streaming ? 0 : (uint32_t)st.st_size;
+
+    // 2) Split fs_dest into parent dir and filename, which must fit an
+    //    entry as it is: a cut-down name would never be found again
+    int rc = -1;
+    char *dup = NULL;
+    uint32_t *chain = NULL;
+    uint32_t n = 0, own = 0;
+    const char *dir_path, *file_name;
+    if (split_path(fs_dest, &dup, &dir_path, &file_name) != 0) return -1;
+    if (*file_name == '\0' || strcmp(file_name, ".") == 0 ||
+        strcmp(file_name, "..") == 0)
+    {
+        errno = EINVAL;
+        goto out;
+    }
+    if (strlen(file_name) > MAX_NAME_LEN) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+
+    // 3) All allocation happens in the cached FAT
+    fat_cache_t *fat = volume_fat(v);
+    if (!fat) goto out;
+
+    // 4) Locate parent directory, creating any missing levels
+    dir_ref_t dir;
+    if (ensure_dir(v, dir_path, &dir) != 0) goto out;
+
+    // 5) An existing file lends its entry and chain
+    dir_entry_t old;
+    uint64_t old_off = 0;
+    int exists = find_in_dir(img, fat, &dir.ent, file_name, DE_FILE | DE_DIR,
+                             &old, &old_off) == 0;
+    if (!exists && errno != ENOENT) goto out;
+    if (exists && (old.status & DE_DIR)) {
+        errno = EISDIR;
+        goto out;
+    }
+    if (exists && mode == PUT_APPEND && (old.status & DE_COMPRESSED)) {
+        errno = EOPNOTSUPP;
+        goto out;
+    }
+    if (exists) {
+        if (load_chain(fat, &old, &chain) != 0) goto out;
+        own = n = old.block_count;
+    } else {
+        if (!(chain = malloc(sizeof(uint32_t)))) goto out;
+        chain[0] = FAT_EOF;  // empty files own no blocks
+    }
+
+    uint8_t mtime[7];
+    if (mode == PUT_SYNC && !streaming) encode_time(st.st_mtime, mtime);
+    else get_current_time(mtime);
+
+    // 6) Write the data
+    uint64_t from = exists && mode == PUT_APPEND ? old.file_size : 0;
+    uint64_t end = from + file_size;  // bytes of the chain in use
+    uint8_t status = 0x1|0x2;
+    int wrc;
+    if (v->compress_files && mode != PUT_APPEND) {
+        // Compress everything first; the stored size is then known
+        wrc = store_compressed(v, fat, src, streaming, &file_size, &status,
+                               &chain, &n, &end);
+    } else if (streaming) {
+        // Claim and fill blocks as the data arrives
+        end = from;
+        wrc = stream_host_to_chain(img, fat, src, &chain, &n, &end);
+        file_size = (uint32_t)(end - from);
+    } else if (mode == PUT_SYNC && exists && !(old.status & DE_COMPRESSED)) {
+        // Unchanged size and mtime: nothing to do
+        if (old.file_size == file_size && memcmp(old.mtime, mtime, 7) == 0) {
+            info->unchanged = 1;
+            rc = 0;
+            goto out;
+        }
+        info->changed = 0;
+        wrc = grow_chain(fat, &chain, &n, (uint32_t)((end + bs - 1) / bs));
+        if (wrc == 0)
+            wrc = sync_host_to_chain(img, src, chain, n, end, own,
+                                     &info->changed);
+    } else {
+        // One read per extent, straight into the mapping when there is one
+        wrc = grow_chain(fat, &chain, &n, (uint32_t)((end + bs - 1) / bs));
+        if (wrc == 0)
+            wrc = copy_host_to_chain(img, src, chain, n, from, file_size);
+    }
+    if (wrc != 0) goto undo;
+    if (end > UINT32_MAX || from + file_size > UINT32_MAX) {
+        errno = EFBIG;
+        goto undo;
+    }
+    cut_chain(fat, chain, &n, (uint32_t)((end + bs - 1) / bs));
+    info->blocks = n;
+    info->extents = count_extents(chain, n);
+    info->compressed = (status & DE_COMPRESSED) != 0;
+
+    // 7) Write the directory entry, growing the directory if a new one
+    //    does not fit; the FAT is written back when the volume is synced
+    dir_entry_t e;
+    make_dir_entry(&e, file_name, status, chain[0], n,
+                   (uint32_t)(from + file_size));
+    memcpy(e.mtime, mtime, 7);
+    if (exists) {
+        memcpy(e.ctime, old.ctime, 7);
+        uint8_t raw[DIR_ENTRY_SIZE];
+        encode_dir_entry(&e, raw);
+        if (write_meta(img, old_off, raw, DIR_ENTRY_SIZE) != 0) goto undo;
+        invalidate_dir(&v->dc, dir.ent.start_block);
+        invalidate_extents(&v->xc, old.start_block);
+    } else if (add_dir_entry(v, &dir, &e, NULL) != 0) {
+        goto undo;
+    }
+    rc = 0;
+    goto out;
+
+undo:
+    // Hand back what this put claimed so a failure leaks nothing; data
+    // already overwritten in place stays overwritten
+    cut_chain(fat, chain, &n, own);
+out:
+    {
+        int saved = errno;
+        free(chain);
+        free(dup);
+        errno = saved;
+    }
+    return rc;
+}
+
+// The diskput/diskshell front end: "-" is stdin, and every failure is
+// reported here
+int put_file(volume_t *v, const char *host_src, const char *fs_dest,
+             int mode, int verbose)
+{
+    int streaming = strcmp(host_src, "-") == 0;
+    int src = streaming ? STDIN_FILENO : open(host_src, O_RDONLY);
+    struct stat st;
+    if (!streaming &&
+        (src < 0 || fstat(src, &st) != 0 || !S_ISREG(st.st_mode)))
+    {
+        printf("File not found.\n");
+        if (src >= 0) close(src);
+        return -1;
+    }
+
+    put_info_t info;
+    int rc = put_fd(v, src, fs_dest, mode, &info);
+    if (rc != 0) {
+        switch (errno) {
+        case EROFS:
+            fprintf(stderr, "Image is read-only\n");
+            break;
+        case ENOSPC:
+            fprintf(stderr, "Not enough space for file\n");
+            break;
+        case EINVAL:
+            fprintf(stderr, "%s: no file name given\n", fs_dest);
+            break;
+        case EISDIR:
+            fprintf(stderr, "%s: is a directory\n", fs_dest);
+            break;
+        case EOPNOTSUPP:
+            fprintf(stderr, "%s: cannot append to a compressed file\n",
+                    fs_dest);
+            break;
+        case EIO:
+            fprintf(stderr, "%s: corrupt FAT chain or directory\n", fs_dest);
+            break;
+        default:
+            perror(fs_dest);
+        }
+    } else if (verbose && info.unchanged) {
+        fprintf(stderr, "%s: unchanged\n", fs_dest);
+    } else if (verbose) {
+        fprintf(stderr, "%s: %u blocks in %u extent(s)%s", fs_dest,
+                info.blocks, info.extents,
+                info.compressed ? ", compressed" : "");
+        if (info.changed != UINT32_MAX)
+            fprintf(stderr, ", %u changed", info.changed);
+        fputc('\n', stderr);
+    }
+    if (!streaming) close(src);
+    return rc;
+}
+
+// --- diskput -r ---
+// The host tree is planned first: every directory and file becomes a
+// node, and all blocks (new directories sized to fit their children) are
+// allocated from the cached FAT before any data moves.  Workers then
+// stream file contents into their blocks in parallel.  Only when every
+// copy has succeeded are the new directory blocks and the top-level
+// entries written, and the FAT follows when the volume is synced.
+typedef struct {
+    char     *host_path;
+    char      name[MAX_NAME_LEN + 1];
+    int       parent;      // node index; -1 for entries of the target
+    int       is_dir;
+    uint32_t  size;        // file bytes
+    uint32_t  nchildren;
+    uint32_t  nblocks;
+    size_t    chain_off;   // into tree_put_t.chains
+} import_node_t;
+
+typedef struct {
+    volume_t      *vol;
+    import_node_t *nodes;
+    size_t         nnodes;
+    size_t         cap;
+    uint32_t      *chains;
+    size_t         next;      // next node to copy (atomic)
+    int            failures;  // (atomic)
+} tree_put_t;
+
+static int add_import_node(tree_put_t *t, const char *host_path,
+                           const char *name, int parent, int is_dir,
+                           uint64_t size)
+{
+    if (strlen(name) > MAX_NAME_LEN) {
+        fprintf(stderr, "%s: name too long\n", host_path);
+        return -1;
+    }
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "%s: file too large\n", host_path);
+        return -1;
+    }
+    if (t->nnodes == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        import_node_t *grown = realloc(t->nodes, cap * sizeof(import_node_t));
+        if (!grown) { perror("malloc"); return -1; }
+        t->nodes = grown;
+        t->cap   = cap;
+    }
+    import_node_t *n = &t->nodes[t->nnodes];
+    memset(n, 0, sizeof(*n));
+    n->host_path = strdup(host_path);
+    if (!n->host_path) { perror("strdup"); return -1; }
+    strcpy(n->name, name);
+    n->parent = parent;
+    n->is_dir = is_dir;
+    n->size   = (uint32_t)size;
+    if (parent >= 0) t->nodes[parent].nchildren++;
+    return (int)t->nnodes++;
+}
+
+static int plan_host_dir(tree_put_t *t, const char *host_dir, int parent,
+                         int depth)
+{
+    if (depth > MAX_TREE_DEPTH) {
+        fprintf(stderr, "%s: directory tree too deep\n", host_dir);
+        return -1;
+    }
+    DIR *d = opendir(host_dir);
+    if (!d) { perror(host_dir); return -1; }
+
+    int rc = 0;
+    char path[PATH_BUF_SIZE];
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", host_dir, de->d_name)
+            >= (int)sizeof(path))
+        {
+            fprintf(stderr, "%s/%s: path too long\n", host_dir, de->d_name);
+            rc = -1;
+            break;
+        }
+        struct stat st;
+        if (lstat(path, &st) != 0) { perror(path); rc = -1; break; }
+
+        // Symlinks and special files are skipped
+        if (S_ISDIR(st.st_mode)) {
+            int idx = add_import_node(t, path, de->d_name, parent, 1, 0);
+            rc = idx < 0 ? -1 : plan_host_dir(t, path, idx, depth + 1);
+        } else if (S_ISREG(st.st_mode)) {
+            if (add_import_node(t, path, de->d_name, parent, 0,
+                                (uint64_t)st.st_size) < 0)
+                rc = -1;
+        }
+    }
+    closedir(d);
+    return rc;
+}
+
+static void *import_worker(void *arg) {
+    tree_put_t *t = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+        if (i >= t->nnodes) break;
+        const import_node_t *n = &t->nodes[i];
+        if (n->is_dir) continue;
+
+        int fd = open(n->host_path, O_RDONLY);
+        if (fd < 0 ||
+            copy_host_to_chain(&t->vol->img, fd, t->chains + n->chain_off,
+                               n->nblocks, 0, n->size) != 0)
+        {
+            perror(n->host_path);
+            __atomic_fetch_add(&t->failures, 1, __ATOMIC_RELAXED);
+        }
+        if (fd >= 0) close(fd);
+    }
+    return NULL;
+}
+
+// Build every new directory's blocks in memory and write them out, then
+// link the top-level entries into the target directory.  Nodes are in
+// depth-first order, so *linked (the nodes now reachable) is a prefix.
+static int commit_import(tree_put_t *t, dir_ref_t *dir, size_t *linked)
+{
+    image_t *img = &t->vol->img;
+    const uint32_t bs = img->sb.block_size;
+    const int hashed = t->vol->hashed_dirs;
+    const uint8_t dir_status = 0x1|0x4 | (hashed ? DE_HASHED : 0);
+    uint64_t t0 = phase_begin();
+
+    uint8_t **bufs = calloc(t->nnodes + 1, sizeof(uint8_t*));
+    uint32_t *used = calloc(t->nnodes + 1, sizeof(uint32_t));
+    int rc = (bufs && used) ? 0 : -1;
+
+    for (size_t i = 0; rc == 0 && i < t->nnodes; i++) {
+        const import_node_t *n = &t->nodes[i];
+        if (n->is_dir && !(bufs[i] = calloc(n->nblocks, bs))) rc = -1;
+    }
+
+    // Fill the new directories, then write their blocks; nothing points
+    // at them until the top-level entries go in last.
+    for (size_t i = 0; rc == 0 && i < t->nnodes; i++) {
+        const import_node_t *n = &t->nodes[i];
+        if (n->parent < 0) continue;
+        dir_entry_t e;
+        make_dir_entry(&e, n->name, n->is_dir ? dir_status : (0x1|0x2),
+                       n->nblocks ? t->chains[n->chain_off] : FAT_EOF,
+                       n->nblocks, n->size);
+        uint8_t *slot = bufs[n->parent] +
+                        (size_t)used[n->parent]++ * DIR_ENTRY_SIZE;
+        if (hashed) {
+            uint32_t nslots = (uint32_t)((uint64_t)t->nodes[n->parent].nblocks
+                                         * bs / DIR_ENTRY_SIZE);
+            slot = dir_hash_slot(bufs[n->parent], nslots, n->name,
+                                 strlen(n->name));
+        }
+        encode_dir_entry(&e, slot);
+    }
+    for (size_t i = 0; rc == 0 && i < t->nnodes; i++) {
+        const import_node_t *n = &t->nodes[i];
+        const uint32_t *chain = t->chains + n->chain_off;
+        for (uint32_t b = 0; rc == 0 && n->is_dir && b < n->nblocks; b++)
+            rc = write_image(img, (uint64_t)chain[b] * bs,
+                             bufs[i] + (size_t)b * bs, bs);
+    }
+    for (size_t i = 0; rc == 0 && i < t->nnodes; i++) {
+        const import_node_t *n = &t->nodes[i];
+        if (n->parent >= 0) continue;
+        dir_entry_t e;
+        make_dir_entry(&e, n->name, n->is_dir ? dir_status : (0x1|0x2),
+                       n->nblocks ? t->chains[n->chain_off] : FAT_EOF,
+                       n->nblocks, n->size);
+        *linked = i;
+        rc = add_dir_entry(t->vol, dir, &e, NULL);
+    }
+    if (rc == 0) *linked = t->nnodes;
+
+    if (bufs)
+        for (size_t i = 0; i < t->nnodes; i++) free(bufs[i]);
+    free(bufs);
+    free(used);
+    phase_end(PH_COMMIT, t0);
+    return rc;
+}
+
+int put_tree(volume_t *v, const char *host_dir, const char *fs_dir,
+             int nthreads, int verbose)
+{
+    image_t *img = &v->img;
+    const uint32_t bs = img->sb.block_size;
+    if (!img->writable) {
+        fprintf(stderr, "Image is read-only\n");
+        return -1;
+    }
+    fat_cache_t *fat = volume_fat(v);
+    if (!fat) {
+        fprintf(stderr, "Error reading FAT\n");
+        return -1;
+    }
+
+    tree_put_t t;
+    memset(&t, 0, sizeof(t));
+    t.vol = v;
+    int rc = plan_host_dir(&t, host_dir, -1, 0);
+    size_t allocated = 0;  // nodes whose chains are in the FAT
+    dir_ref_t dir;
+
+    // Target directory: must exist (or be creatable) and not already
+    // hold any of the top-level names.  It grows as entries go in.
+    if (rc == 0 && (rc = ensure_dir(v, fs_dir, &dir)) != 0) perror(fs_dir);
+    if (rc == 0) {
+        const cached_dir_t *cd = get_dir(&v->dc, dir.ent.start_block,
+                                         dir.ent.block_count);
+        for (size_t i = 0; cd && i < t.nnodes; i++) {
+            if (t.nodes[i].parent >= 0) continue;
+            if (find_entry(cd, t.nodes[i].name, DE_FILE|DE_DIR)) {
+                fprintf(stderr, "%s: already exists\n", t.nodes[i].name);
+                rc = -1;
+            }
+        }
+        if (!cd) {
+            fprintf(stderr, "Error reading directory entries\n");
+            rc = -1;
+        }
+    }
+
+    // Size and allocate everything up front
+    size_t total = 0;
+    for (size_t i = 0; rc == 0 && i < t.nnodes; i++) {
+        import_node_t *n = &t.nodes[i];
+        n->nblocks = n->is_dir
+                   ? dir_blocks_for(bs, n->nchildren, v->hashed_dirs)
+                   : (uint32_t)(((uint64_t)n->size + bs - 1) / bs);
+        n->chain_off = total;
+        total += n->nblocks;
+    }
+    if (rc == 0 && !(t.chains = malloc((total + 1) * sizeof(uint32_t)))) {
+        perror("malloc");
+        rc = -1;
+    }
+    for (; rc == 0 && allocated < t.nnodes; allocated++) {
+        import_node_t *n = &t.nodes[allocated];
+        uint32_t *chain = t.chains + n->chain_off;
+        if ((n->is_dir ? fat_alloc_run(fat, n->nblocks, chain)
+                       : fat_alloc_chain(fat, n->nblocks, chain)) != 0)
+        {
+            fprintf(stderr, "Not enough space for %s\n", n->host_path);
+            rc = -1;
+            break;
+        }
+    }
+
+    if (rc == 0) {
+        run_pool(import_worker, &t, nthreads, t.nnodes);
+        if (t.failures) rc = -1;
+    }
+    size_t linked = 0;
+    if (rc == 0 && (rc = commit_import(&t, &dir, &linked)) != 0)
+        perror(fs_dir);
+    if (rc == 0) {
+        if (verbose) {
+            size_t files = 0;
+            for (size_t i = 0; i < t.nnodes; i++) files += !t.nodes[i].is_dir;
+            fprintf(stderr, "%s: %zu files, %zu directories, %zu blocks "
+                    "in %u extent(s)\n", fs_dir, files, t.nnodes - files,
+                    total, count_extents(t.chains, (uint32_t)total));
+        }
+    } else {
+        // Give back the blocks of everything not linked in; if the
+        // target directory could not grow, what went in stays
+        if (linked > 0)
+            fprintf(stderr, "%s: import stopped after %zu of %zu entries\n",
+                    fs_dir, linked, t.nnodes);
+        for (size_t i = linked; i < allocated; i++) {
+            const import_node_t *n = &t.nodes[i];
+            for (uint32_t b = 0; b < n->nblocks; b++)
+                fat_set(fat, t.chains[n->chain_off + b], FAT_FREE);
+        }
+    }
+
+    for (size_t i = 0; i < t.nnodes; i++) free(t.nodes[i].host_path);
+    free(t.nodes);
+    free(t.chains);
+    return rc;
+}